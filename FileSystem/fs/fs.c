@@ -1,6 +1,8 @@
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include "fs.h"
+#include "fs_cache.h"
 
 /*
  * 0 for superblock,
@@ -16,10 +18,17 @@ struct inode *g_root = NULL;
 #define BITS_PER_WORD 32
 #define BLOCK_BITMAP_COUNT (FS_BLOCK_COUNT / BITS_PER_WORD)
 #define INODE_BITMAP_COUNT (FS_BLOCK_SIZE / (sizeof(struct dinode)))
+#define INODE_BITMAP_WORDS ((INODE_BITMAP_COUNT - 1) / BITS_PER_WORD + 1)
 #define DINODE_COUNT (FS_BLOCK_SIZE / (sizeof(struct dinode)))
 static uint32_t BlockBitmap[BLOCK_BITMAP_COUNT];
-static uint32_t InodeBitmap[(INODE_BITMAP_COUNT - 1) / 32 + 1];
+static uint32_t InodeBitmap[INODE_BITMAP_WORDS];
 static struct dinode DInodeArray[DINODE_COUNT];
+static uint32_t EraseCount[FS_BLOCK_COUNT];
+static struct superblock *g_sb;
+
+#define META_NONE 0xFFFFFFFF
+#define SEQ_NONE 0xFFFFFFFF     /* superblock from before checkpoints were counted */
+#define BLOCK_NONE 0xFFFFFFFF
 
 void bitmap_init(uint32_t *bitmap, uint32_t count)
 {
@@ -57,65 +66,784 @@ int bitmap_find_free(const uint32_t *bitmap, uint32_t bit_word_count)
     return -1;
 }
 
-int block_alloc(void)
+/*
+ * Every change to DInodeArray goes through here, so the journal knows what to log.
+ */
+static uint32_t InodeDirty;
+static void inode_store(uint32_t ino, const struct dinode *din)
+{
+    DInodeArray[ino] = *din;
+    InodeDirty |= 1U << ino;
+}
+
+static int bitmap_is_free(const uint32_t *bitmap, uint32_t blk)
+{
+    return (bitmap[blk / BITS_PER_WORD] >> (blk % BITS_PER_WORD)) & 1U;
+}
+
+static void wear_erased(uint32_t blk)
+{
+    if (blk < FS_BLOCK_COUNT)
+        EraseCount[blk]++;
+}
+
+/*
+ * Free blocks known to hold only 0xFF, bit set like a free block in BlockBitmap.
+ * Kept in RAM only, fs_erase_step() fills it in after mount.
+ */
+static uint32_t ErasedBitmap[BLOCK_BITMAP_COUNT];
+
+/*
+ * Inode and block bitmaps as of the last journal commit. A block freed since then
+ * is still what the committed inodes point at, power lost before the next commit
+ * brings them back, so it is neither reused nor erased until that commit.
+ */
+static uint32_t JournalImap[INODE_BITMAP_WORDS];
+static uint32_t JournalBmap[BLOCK_BITMAP_COUNT];
+
+static int block_usable(uint32_t blk)
+{
+    return bitmap_is_free(BlockBitmap, blk) && bitmap_is_free(JournalBmap, blk);
+}
+
+/*
+ * The free block erased the fewest times, so wear spreads over the whole device
+ * instead of piling up on the lowest free blocks. erased = 1 only looks at blocks
+ * already erased.
+ */
+static int block_least_worn(int erased)
+{
+    int best = -1;
+
+    for (uint32_t blk = 0; blk < FS_BLOCK_COUNT; blk++) {
+        if (block_usable(blk) &&
+            (!erased || bitmap_is_free(ErasedBitmap, blk)) &&
+            (best < 0 || EraseCount[blk] < EraseCount[best]))
+            best = (int)blk;
+    }
+    return best;
+}
+
+static void block_take(uint32_t blk)
 {
-    int blk = bitmap_find_free(BlockBitmap, FS_BLOCK_COUNT / BITS_PER_WORD);
-    if (blk < 0) return -1;
     bitmap_set_used(BlockBitmap, blk);
+    bitmap_set_used(ErasedBitmap, blk);     //about to be written
+}
+
+/*
+ * goal is the block after the one holding the previous part of the file, taking it
+ * keeps files contiguous for bcache_read_blocks(). An erased block comes before a
+ * goal that is not, its first writeback then needs no erase. Neither is taken once
+ * it is FS_BLOCK_CYCLES erases ahead of the least worn block, same as block_relocate().
+ */
+static int block_choose(uint32_t goal)
+{
+    int blk = block_least_worn(0);
+    int ready = block_least_worn(1);
+
+    if (blk < 0) return -1;
+    if (goal < FS_BLOCK_COUNT && block_usable(goal) &&
+        EraseCount[goal] < EraseCount[blk] + FS_BLOCK_CYCLES &&
+        (ready < 0 || bitmap_is_free(ErasedBitmap, goal)))
+        blk = (int)goal;
+    else if (ready >= 0 && EraseCount[ready] < EraseCount[blk] + FS_BLOCK_CYCLES)
+        blk = ready;
     return blk;
 }
 
+/*
+ * A checkpoint copies the metadata to META_COUNT fresh blocks before it lets go of
+ * the old ones, files never get the last of them.
+ */
+static int block_spare(void)
+{
+    uint32_t n = 0;
+
+    for (uint32_t blk = 0; blk < FS_BLOCK_COUNT; blk++) {
+        if (block_usable(blk))
+            n++;
+    }
+    return n > META_COUNT;
+}
+
+static int block_alloc_near(uint32_t goal)
+{
+    int blk = block_spare() ? block_choose(goal) : -1;
+
+    if (blk >= 0)
+        block_take(blk);
+    return blk;
+}
+
+int block_alloc(void)
+{
+    return block_alloc_near(BLOCK_NONE);
+}
 
 int block_free(uint32_t blk)
 {
     bitmap_set_free(BlockBitmap, blk);
+    bitmap_set_used(ErasedBitmap, blk);     //whatever it held is still there
+    bcache_drop(blk);
     return 0;
 }
 
+/*
+ * Allocated as of the last commit, what power lost now would come back to.
+ */
+static int block_committed(uint32_t blk)
+{
+    return !bitmap_is_free(JournalBmap, blk);
+}
+
+static int block_move_to(uint32_t *blk, uint32_t to)
+{
+    if (bcache_move(*blk, to) != 0)
+        return -1;
+    block_take(to);
+    block_free(*blk);
+    *blk = to;
+    return 0;
+}
+
+/*
+ * A block rewritten in place, like the tail of a log file, moves to the least worn
+ * free block once it is FS_BLOCK_CYCLES erases ahead of it. *blk is updated.
+ */
+static int block_relocate(uint32_t *blk)
+{
+    int to = block_least_worn(0);
+
+    if (to < 0 || !block_spare() || EraseCount[*blk] < EraseCount[to] + FS_BLOCK_CYCLES)
+        return 0;
+    return block_move_to(blk, (uint32_t)to);
+}
+
+/*
+ * A committed block that can only change with an erase is copied to a fresh one
+ * instead, near goal. Erasing it in place would lose what it holds when power goes
+ * before the program, the copy leaves it intact until the next commit.
+ */
+static int block_cow(uint32_t *blk, uint32_t goal)
+{
+    int to = block_spare() ? block_choose(goal) : -1;
+
+    if (to < 0)
+        return -1;
+    return block_move_to(blk, (uint32_t)to);
+}
+
+
+/*
+ * One step of the background eraser: the least worn free block not known to be
+ * erased is checked, and erased unless it already reads all 0xFF.
+ * Returns 1 after doing that, 0 once FS_ERASE_POOL free blocks are erased or there
+ * is nothing left to erase. Same rules as any other fs call, callers serialise them.
+ */
+int fs_erase_step(void)
+{
+    uint8_t buf[64];
+    uint32_t ready = 0;
+    int blk = -1;
+
+    if (!g_bdev)
+        return 0;
+    for (uint32_t i = 0; i < FS_BLOCK_COUNT; i++) {
+        if (!block_usable(i))
+            continue;
+        if (bitmap_is_free(ErasedBitmap, i))
+            ready++;
+        else if (blk < 0 || EraseCount[i] < EraseCount[blk])
+            blk = (int)i;
+    }
+    if (blk < 0 || ready >= FS_ERASE_POOL)
+        return 0;
+
+    for (uint32_t off = 0; off < FS_BLOCK_SIZE; off += sizeof(buf)) {
+        uint32_t k;
+
+        if (g_bdev->read(g_bdev->ctx, blk, off, buf, sizeof(buf)) != 0)
+            return 0;
+        for (k = 0; k < sizeof(buf) && buf[k] == 0xFF; k++)
+            ;
+        if (k < sizeof(buf)) {
+            if (g_bdev->erase(g_bdev->ctx, blk) != 0)
+                return 0;
+            wear_erased(blk);
+            break;
+        }
+    }
+    bitmap_set_free(ErasedBitmap, blk);
+    return 1;
+}
+
+/*
+ * Points the parent of level at blks[level], the inode slot for level 0. A table the
+ * last commit points at takes the pointer only with a plain program, else it is
+ * copied first and its own parent gets pointed at the copy, up to the inode.
+ */
+static int bmap_link(uint32_t *slot, uint32_t *blks, const uint32_t *path, uint32_t level)
+{
+    for (; level > 0; level--) {
+        uint32_t at = path[level - 1] * sizeof(uint32_t);
+
+        if (!block_committed(blks[level - 1]) ||
+            bcache_programmable(blks[level - 1], at, &blks[level], sizeof(uint32_t)))
+            return bcache_write(blks[level - 1], at, &blks[level], sizeof(uint32_t));
+        if (block_cow(&blks[level - 1], BLOCK_NONE) != 0 ||
+            bcache_write(blks[level - 1], at, &blks[level], sizeof(uint32_t)) != 0)
+            return -1;
+    }
+    *slot = blks[0];
+    return 0;
+}
+
+/*
+ * The flash block holding block idx of the file, BLOCK_NONE if it was never written.
+ * Blocks past NDIRECT go through the indirect block, then the double indirect one,
+ * the tables are read through the cache. A pointer to a free block was left by a
+ * transaction that never committed and counts as none.
+ * write = 1 allocates what is missing on the way, the data block near goal and
+ * left erased so it can be appended to without an erase, tables filled with
+ * BLOCK_NONE. An existing data block may be relocated, or copied when len bytes of
+ * buf at off would need an erase of a committed block.
+ */
+static int bmap_walk(struct inode *inode, uint32_t idx, int write, uint32_t goal,
+                     uint32_t off, const void *buf, uint32_t len, uint32_t *out)
+{
+    uint32_t path[2], blks[3], depth, level;
+    uint32_t *slot;
+    uint32_t blk;
+
+    if (idx < NDIRECT) {
+        slot = &inode->din.direct[idx];
+        depth = 0;
+    } else if ((idx -= NDIRECT) < NINDIRECT) {
+        slot = &inode->din.indirect;
+        path[0] = idx;
+        depth = 1;
+    } else if ((idx -= NINDIRECT) < NINDIRECT * NINDIRECT) {
+        slot = &inode->din.dindirect;
+        path[0] = idx / NINDIRECT;
+        path[1] = idx % NINDIRECT;
+        depth = 2;
+    } else {
+        return -1;
+    }
+
+    blk = *slot;
+    for (level = 0; ; level++) {
+        int leaf = (level == depth);
+        uint32_t old = blk;
+
+        if (blk != BLOCK_NONE && (blk >= FS_BLOCK_COUNT || bitmap_is_free(BlockBitmap, blk)))
+            blk = BLOCK_NONE;
+        if (blk == BLOCK_NONE) {
+            if (!write)
+                break;
+            int nb = block_alloc_near(leaf ? goal : BLOCK_NONE);
+            if (nb < 0)
+                return -1;
+            if (bcache_fill(nb, 0xFF) != 0)
+                return -1;
+            blk = (uint32_t)nb;
+        } else if (leaf && len && block_committed(blk) && !bcache_programmable(blk, off, buf, len)) {
+            if (block_cow(&blk, goal) != 0)
+                return -1;
+        } else if (leaf && write && block_relocate(&blk) != 0) {
+            return -1;
+        }
+        blks[level] = blk;
+        if (blk != old && bmap_link(slot, blks, path, level) != 0)
+            return -1;
+        if (leaf)
+            break;
+        if (bcache_read(blks[level], path[level] * sizeof(uint32_t), &blk, sizeof(uint32_t)) != 0)
+            return -1;
+    }
+
+    *out = blk;
+    return 0;
+}
+
+static int bmap(struct inode *inode, uint32_t idx, int write, uint32_t goal, uint32_t *out)
+{
+    return bmap_walk(inode, idx, write, goal, 0, NULL, 0, out);
+}
+
 int block_write(uint32_t blk, uint32_t off, const void *buf, uint32_t size)
 {
-    return g_bdev->write(g_bdev->ctx, blk, off, buf, size);
+    return bcache_write(blk, off, buf, size);
 }
 
+/*
+ * Bitmaps, erase counters and inodes into the blocks g_sb->meta names, they reach
+ * flash on the next bcache_flush().
+ */
+static int meta_store(void)
+{
+    if (bcache_write(g_sb->meta[META_INODE_BITMAP], 0, InodeBitmap, sizeof(InodeBitmap)) != 0)
+        return -1;
+    if (bcache_write(g_sb->meta[META_BLOCK_BITMAP], 0, BlockBitmap, sizeof(BlockBitmap)) != 0)
+        return -1;
+    if (bcache_write(g_sb->meta[META_BLOCK_BITMAP], sizeof(BlockBitmap),
+                     EraseCount, sizeof(EraseCount)) != 0)
+        return -1;
+    if (bcache_write(g_sb->meta[META_INODES], 0, DInodeArray, sizeof(DInodeArray)) != 0)
+        return -1;
+    return 0;
+}
+
+/*
+ * Metadata journal, one block appended to with plain programs.
+ * A close or sync logs the inodes and bitmaps it changed as records and ends them
+ * with a commit record, no erase. Only when the block is full do the bitmaps and
+ * inodes go to their own blocks (a checkpoint) and the journal starts over.
+ * Every journal opens with a head record holding the superblock seq of its
+ * checkpoint, so records are never replayed over any other checkpoint.
+ * Mount replays every record up to the last intact commit on top of the checkpoint.
+ * Records hold whole values, so replaying one twice does no harm.
+ * Erase counters are not logged, they are saved on checkpoints and unmount.
+ */
+#define JREC_END      0xFFFF        /* erased flash */
+#define JREC_INODE    1
+#define JREC_IMAP     2
+#define JREC_BMAP     3
+#define JREC_COMMIT   4
+#define JREC_HEAD     5             /* payload: uint32_t seq */
+
+struct jrec {
+    uint16_t type;
+    uint16_t len;                   /* payload bytes */
+    uint32_t crc;                   /* of header and payload, crc taken as 0 */
+};
+
+#define JREC_SIZE(len)  ((sizeof(struct jrec) + (len) + 3) & ~3U)
+#define JREC_INODE_LEN  (sizeof(uint32_t) + sizeof(struct dinode))
+
+static uint32_t JournalOff;
+static uint8_t jbuf[JREC_SIZE(JREC_INODE_LEN + sizeof(BlockBitmap) + sizeof(InodeBitmap))];
+
+static uint32_t journal_crc(const uint8_t *p, uint32_t len)
+{
+    uint32_t crc = 0xFFFFFFFF;
+
+    while (len--) {
+        crc ^= *p++;
+        for (int k = 0; k < 8; k++)
+            crc = (crc >> 1) ^ (0xEDB88320U & (0U - (crc & 1U)));
+    }
+    return ~crc;
+}
+
+static void journal_mark_clean(void)
+{
+    memcpy(JournalImap, InodeBitmap, sizeof(InodeBitmap));
+    memcpy(JournalBmap, BlockBitmap, sizeof(BlockBitmap));
+    InodeDirty = 0;
+}
+
+static int journal_append(uint16_t type, const void *a, uint32_t alen, const void *b, uint32_t blen)
+{
+    struct jrec *rec = (struct jrec *)jbuf;
+    uint32_t size = JREC_SIZE(alen + blen);
+
+    memset(jbuf, 0xFF, size);
+    rec->type = type;
+    rec->len = (uint16_t)(alen + blen);
+    rec->crc = 0;
+    if (alen)
+        memcpy(jbuf + sizeof(struct jrec), a, alen);
+    if (blen)
+        memcpy(jbuf + sizeof(struct jrec) + alen, b, blen);
+    rec->crc = journal_crc(jbuf, size);
+
+    if (g_bdev->write(g_bdev->ctx, g_sb->meta[META_JOURNAL], JournalOff, jbuf, size) != 0)
+        return -1;
+    JournalOff += size;
+    return 0;
+}
+
+/*
+ * The superblock is a log of records in block 0 and in sb->mirror. A checkpoint
+ * appends the next record, seq one up, to the erased slot after the one in use,
+ * with plain programs. Only when the block is full does it erase the other and
+ * start over there, the record in use is never erased. Mount takes the valid
+ * record with the highest seq, a torn one fails its crc.
+ * Superblocks from before have no crc and no mirror, only the record in slot 0
+ * of block 0. They append there too, and erase it in place when full, until a
+ * checkpoint finds SB_MIRROR free and claims it.
+ */
+#define SB_MIRROR 1
+#define SB_SLOT   64U
+#define SB_SLOTS  (FS_BLOCK_SIZE / SB_SLOT)
+static uint32_t SbBlock;            /* holding the record in use */
+static uint32_t SbNext;             /* slot after it */
+
+_Static_assert(sizeof(struct superblock) <= SB_SLOT, "superblock must fit its slot");
+
+static uint32_t sb_crc(const struct superblock *sb)
+{
+    return journal_crc((const uint8_t *)sb, offsetof(struct superblock, crc));
+}
+
+static int sb_load(struct superblock *sb)
+{
+    struct superblock copy;
+    int best = 0;                   /* 1 from before the mirror, 2 with a valid crc */
+
+    for (uint32_t blk = 0; blk <= SB_MIRROR; blk++) {
+        for (uint32_t slot = 0; slot < SB_SLOTS; slot++) {
+            int rank = 0;
+
+            if (bcache_read(blk, slot * SB_SLOT, &copy, sizeof(copy)) != 0)
+                return -1;
+            if (copy.magic != 0x12345678)
+                continue;
+            if (copy.crc == sb_crc(&copy))
+                rank = 2;
+            else if (blk == 0 && slot == 0 && copy.crc == 0xFFFFFFFF && copy.mirror == META_NONE)
+                rank = 1;
+            if (rank > best || (rank == 2 && copy.seq > sb->seq)) {
+                *sb = copy;
+                SbBlock = blk;
+                SbNext = slot + 1;
+                best = rank;
+            }
+        }
+    }
+    return best ? 0 : -2;
+}
+
+static int sb_write(void)
+{
+    uint32_t blk = SbBlock, slot = SbNext;
+    uint8_t probe[SB_SLOT];
+
+    //past a torn record to the next erased slot
+    for (; slot < SB_SLOTS; slot++) {
+        uint32_t k;
+
+        if (bcache_read(blk, slot * SB_SLOT, probe, sizeof(probe)) != 0)
+            return -1;
+        for (k = 0; k < sizeof(probe) && probe[k] == 0xFF; k++)
+            ;
+        if (k == sizeof(probe))
+            break;
+    }
+    g_sb->crc = sb_crc(g_sb);
+    if (slot == SB_SLOTS) {
+        blk = (g_sb->mirror != META_NONE && SbBlock == 0) ? g_sb->mirror : 0;
+        slot = 0;
+        if (bcache_fill(blk, 0xFF) != 0)
+            return -1;
+    }
+    if (bcache_write(blk, slot * SB_SLOT, g_sb, sizeof(struct superblock)) != 0)
+        return -1;
+    if (bcache_flush() != 0)
+        return -1;
+    SbBlock = blk;
+    SbNext = slot + 1;
+    return 0;
+}
+
+/*
+ * Copy on write: the metadata goes to fresh blocks and the journal starts over in
+ * another erased one, headed by the next seq. Nothing the superblock points at is
+ * touched, so power lost before it is rewritten leaves the last checkpoint and its
+ * journal as they were. The old blocks are free once it is.
+ */
+static int journal_checkpoint(void)
+{
+    uint32_t old[META_COUNT];
+    uint32_t off = JournalOff, last = g_sb->seq, mirror = g_sb->mirror;
+    uint32_t seq = (last == SEQ_NONE) ? 1 : last + 1;
+    int i;
+
+    if (mirror == META_NONE && block_usable(SB_MIRROR) && block_spare()) {
+        block_take(SB_MIRROR);
+        g_sb->mirror = SB_MIRROR;
+    }
+    memcpy(old, g_sb->meta, sizeof(old));
+    for (i = 0; i < META_COUNT; i++) {
+        int blk = block_choose(BLOCK_NONE);
+        int erased;
+
+        if (blk < 0)
+            goto fail;
+        erased = bitmap_is_free(ErasedBitmap, blk);
+        block_take(blk);
+        g_sb->meta[i] = (uint32_t)blk;
+        if (i != META_JOURNAL) {
+            if (bcache_fill(blk, 0xFF) != 0)
+                goto fail;
+        } else if (!erased) {
+            if (g_bdev->erase(g_bdev->ctx, blk) != 0)
+                goto fail;
+            wear_erased(blk);
+        }
+    }
+    //stored free, they stay unusable until the superblock no longer needs them
+    for (i = 0; i < META_COUNT; i++) {
+        if (old[i] != META_NONE)
+            block_free(old[i]);
+    }
+
+    JournalOff = 0;
+    if (meta_store() != 0 || journal_append(JREC_HEAD, &seq, sizeof(seq), NULL, 0) != 0)
+        goto fail;
+    if (bcache_flush() != 0)
+        goto fail;
+    g_sb->seq = seq;
+    if (sb_write() != 0)
+        goto fail;
+    if (g_bdev->sync)
+        g_bdev->sync(g_bdev->ctx);
+    journal_mark_clean();
+    return 0;
+
+fail:
+    for (i = 0; i < META_COUNT; i++) {
+        if (g_sb->meta[i] != old[i]) {
+            block_free(g_sb->meta[i]);
+            if (old[i] != META_NONE)
+                block_take(old[i]);
+        }
+    }
+    if (g_sb->mirror != mirror)
+        block_free(SB_MIRROR);
+    memcpy(g_sb->meta, old, sizeof(old));
+    g_sb->seq = last;
+    g_sb->mirror = mirror;
+    JournalOff = off;
+    return -1;
+}
+
+/*
+ * Data blocks first, then the metadata pointing at them.
+ */
+static int journal_commit(void)
+{
+    int imap = memcmp(JournalImap, InodeBitmap, sizeof(InodeBitmap)) != 0;
+    int bmap = memcmp(JournalBmap, BlockBitmap, sizeof(BlockBitmap)) != 0;
+    uint32_t need = JREC_SIZE(0);
+
+    if (bcache_flush() != 0)
+        return -1;
+    if (!InodeDirty && !imap && !bmap)
+        return 0;
+
+    for (uint32_t ino = 0; ino < DINODE_COUNT; ino++) {
+        if (InodeDirty & (1U << ino))
+            need += JREC_SIZE(JREC_INODE_LEN);
+    }
+    if (imap)
+        need += JREC_SIZE(sizeof(InodeBitmap));
+    if (bmap)
+        need += JREC_SIZE(sizeof(BlockBitmap));
+    if (JournalOff + need > FS_BLOCK_SIZE)
+        return journal_checkpoint();
+
+    for (uint32_t ino = 0; ino < DINODE_COUNT; ino++) {
+        if ((InodeDirty & (1U << ino)) &&
+            journal_append(JREC_INODE, &ino, sizeof(ino), &DInodeArray[ino], sizeof(struct dinode)) != 0)
+            return -1;
+    }
+    if (imap && journal_append(JREC_IMAP, InodeBitmap, sizeof(InodeBitmap), NULL, 0) != 0)
+        return -1;
+    if (bmap && journal_append(JREC_BMAP, BlockBitmap, sizeof(BlockBitmap), NULL, 0) != 0)
+        return -1;
+    if (journal_append(JREC_COMMIT, NULL, 0, NULL, 0) != 0)
+        return -1;
+    if (g_bdev->sync)
+        g_bdev->sync(g_bdev->ctx);
+    journal_mark_clean();
+    return 0;
+}
+
+static void journal_apply(const struct jrec *rec, const uint8_t *payload)
+{
+    uint32_t ino;
+
+    switch (rec->type) {
+    case JREC_INODE:
+        memcpy(&ino, payload, sizeof(ino));
+        if (rec->len == JREC_INODE_LEN && ino < DINODE_COUNT)
+            memcpy(&DInodeArray[ino], payload + sizeof(ino), sizeof(struct dinode));
+        break;
+    case JREC_IMAP:
+        if (rec->len == sizeof(InodeBitmap))
+            memcpy(InodeBitmap, payload, sizeof(InodeBitmap));
+        break;
+    case JREC_BMAP:
+        if (rec->len == sizeof(BlockBitmap))
+            memcpy(BlockBitmap, payload, sizeof(BlockBitmap));
+        break;
+    default:
+        break;
+    }
+}
+
+/*
+ * The first pass finds the end of the last commit, the second applies what lies
+ * before it. A record cut short by power loss fails its crc, nothing after it is
+ * trusted. Returns 1 when anything but erased flash follows the last commit: a torn
+ * record, or records whose commit never made it. Appending behind those would hide
+ * every later commit from the next replay, the caller checkpoints instead. So it
+ * does for a journal not headed by the seq of the superblock, nothing in it is
+ * applied.
+ */
+static int journal_replay(void)
+{
+    uint32_t jblk = g_sb->meta[META_JOURNAL];
+    uint32_t commit = 0, end = 0;
+    int torn = 0;
+    struct jrec *rec = (struct jrec *)jbuf;
+
+    for (int pass = 0; pass < 2; pass++) {
+        uint32_t off = 0;
+
+        while (off + sizeof(struct jrec) <= FS_BLOCK_SIZE && (pass == 0 || off < commit)) {
+            uint32_t size, crc;
+
+            if (g_bdev->read(g_bdev->ctx, jblk, off, jbuf, sizeof(struct jrec)) != 0)
+                return -1;
+            if (rec->type == JREC_END)
+                break;
+            size = JREC_SIZE(rec->len);
+            if (size > sizeof(jbuf) || off + size > FS_BLOCK_SIZE) {
+                torn = 1;
+                break;
+            }
+            if (g_bdev->read(g_bdev->ctx, jblk, off, jbuf, size) != 0)
+                return -1;
+            crc = rec->crc;
+            rec->crc = 0;
+            if (journal_crc(jbuf, size) != crc) {
+                torn = 1;
+                break;
+            }
+            if (off == 0 && g_sb->seq != SEQ_NONE &&
+                (rec->type != JREC_HEAD || rec->len != sizeof(uint32_t) ||
+                 memcmp(jbuf + sizeof(struct jrec), &g_sb->seq, sizeof(uint32_t)) != 0))
+                break;
+            off += size;
+            if (pass == 0 && (rec->type == JREC_COMMIT || rec->type == JREC_HEAD))
+                commit = off;
+            if (pass == 1)
+                journal_apply(rec, jbuf + sizeof(struct jrec));
+        }
+        if (pass == 0)
+            end = off;
+    }
+    torn |= end != commit || (g_sb->seq != SEQ_NONE && commit == 0);
+    JournalOff = commit;
+    return torn;
+}
+
+
+/*
+ * Inode ino from the inode cache with a reference taken, iput() gives it back.
+ */
+static struct inode *iget(uint32_t ino)
+{
+    int fresh;
+    struct inode *inode = icache_get(ino, &fresh);
+
+    if (inode && fresh)
+        inode->din = DInodeArray[ino];
+    return inode;
+}
+
+static void iput(struct inode *inode)
+{
+    if (inode)
+        icache_put(inode);
+}
 
 int inode_alloc(struct inode **out)
 {
-    int i = bitmap_find_free(InodeBitmap, INODE_BITMAP_COUNT);
-    if (i < 0) return -1;
-    bitmap_set_used(InodeBitmap, i);
+    int i = bitmap_find_free(InodeBitmap, INODE_BITMAP_WORDS);
+    if (i < 0 || i >= (int)INODE_BITMAP_COUNT) return -1;
 
-    struct inode *ino = malloc(sizeof(struct inode));
+    struct inode *ino = iget(i);
     if (!ino) return -1;
-    ino->ino = i;
-    ino->refcnt = 1;
+    bitmap_set_used(InodeBitmap, i);
+    memset(&ino->din, 0xFF, sizeof(ino->din));
+    ino->din.mode = 0;
+    ino->din.size = 0;
     *out = ino;
     return 0;
 }
 
 int inode_free(struct inode *inode)
 {
-    free(inode);
+    iput(inode);
     return 0;
 }
 
 
+static int dir_scrub(void);
+
 int fs_mount(struct superblock *sb, struct fs_blkdev *bdev)
 {
+    int rc;
+
     g_bdev = bdev;
-    if (g_bdev->read(g_bdev->ctx, 0, 0, sb, sizeof(struct superblock)) != 0)
+    g_sb = sb;
+    bcache_init(bdev, wear_erased);
+    lookup_cache_init();
+    memset(ErasedBitmap, 0, sizeof(ErasedBitmap));
+    rc = sb_load(sb);
+    if (rc != 0)
+        return rc;
+    //written before the metadata could move: erased words, fixed places
+    if (sb->meta[0] == META_NONE) {
+        for (int i = 0; i < META_JOURNAL; i++)
+            sb->meta[i] = 1 + i;
+    }
+    if (bcache_read(sb->meta[META_INODE_BITMAP], 0, InodeBitmap, sizeof(InodeBitmap)) != 0)
         return -1;
-    if (sb->magic != 0x12345678)
-        return -2;
-    if (g_bdev->read(g_bdev->ctx, 1, 0, InodeBitmap, sizeof(InodeBitmap)) != 0)
+    if (bcache_read(sb->meta[META_BLOCK_BITMAP], 0, BlockBitmap, sizeof(BlockBitmap)) != 0)
         return -1;
-    if (g_bdev->read(g_bdev->ctx, 2, 0, BlockBitmap, sizeof(BlockBitmap)) != 0)
+    if (bcache_read(sb->meta[META_BLOCK_BITMAP], sizeof(BlockBitmap), EraseCount, sizeof(EraseCount)) != 0)
         return -1;
-    if (g_bdev->read(g_bdev->ctx, 3, 0, DInodeArray, sizeof(DInodeArray)) != 0)
+    for (uint32_t i = 0; i < FS_BLOCK_COUNT; i++) {
+        if (EraseCount[i] == 0xFFFFFFFF)
+            EraseCount[i] = 0;
+    }
+    if (bcache_read(sb->meta[META_INODES], 0, DInodeArray, sizeof(DInodeArray)) != 0)
         return -1;
-    g_root = malloc(sizeof(struct inode));
-    g_root->ino = 0;
-    g_root->refcnt = 1;
-    g_root->din = DInodeArray[0];
+    journal_mark_clean();
+
+    if (sb->meta[META_JOURNAL] == META_NONE) {
+        //no journal yet, the checkpoint makes one
+        if (journal_checkpoint() != 0)
+            return -1;
+    } else {
+        int torn = journal_replay();
+
+        if (torn < 0)
+            return -1;
+        journal_mark_clean();
+        if (torn && journal_checkpoint() != 0)
+            return -1;
+    }
+    //from before the mirror, with the metadata in SB_MIRROR one checkpoint moves it
+    //off and the next claims the block
+    if (sb->mirror == META_NONE) {
+        for (int i = 0; i < META_COUNT; i++) {
+            if (sb->meta[i] == SB_MIRROR && journal_checkpoint() != 0)
+                return -1;
+        }
+        if (block_usable(SB_MIRROR) && journal_checkpoint() != 0)
+            return -1;
+    }
+    journal_mark_clean();
+    if (dir_scrub() != 0)
+        return -1;
+
+    g_root = iget(0);
     return 0;
 }
 
@@ -126,7 +854,7 @@ int fs_unmount(struct superblock *sb)
         inode_free(g_root);
         g_root = NULL;
     }
-    if (g_bdev->sync) g_bdev->sync(g_bdev->ctx);
+    journal_checkpoint();
     g_bdev = NULL;
     return 0;
 }
@@ -134,153 +862,368 @@ int fs_unmount(struct superblock *sb)
 int fs_format(struct superblock *sb)
 {
     uint32_t i;
+    struct superblock old;
+
+    //keep the wear history of a formatted device
+    memset(EraseCount, 0, sizeof(EraseCount));
+    bcache_init(g_bdev, wear_erased);
+    if (sb_load(&old) == 0) {
+        uint32_t blk = (old.meta[0] == 0xFFFFFFFF) ? 2 : old.meta[META_BLOCK_BITMAP];
+        if (blk < FS_BLOCK_COUNT &&
+            g_bdev->read(g_bdev->ctx, blk, sizeof(BlockBitmap), EraseCount, sizeof(EraseCount)) == 0) {
+            for (i = 0; i < FS_BLOCK_COUNT; i++) {
+                if (EraseCount[i] == 0xFFFFFFFF)
+                    EraseCount[i] = 0;
+            }
+        }
+    }
+
     bitmap_init(BlockBitmap, BLOCK_BITMAP_COUNT);
-    bitmap_init(InodeBitmap, INODE_BITMAP_COUNT);
+    bitmap_init(InodeBitmap, INODE_BITMAP_WORDS);
+    journal_mark_clean();
     sb->magic = 0x12345678;
     sb->block_size = g_bdev->block_size;
     sb->total_blocks = g_bdev->block_count;
     sb->inode_start = 1;
     sb->inode_count = sb->block_size / sizeof(struct inode);
     sb->data_start = sb->inode_start + 1;
-
+    for (i = 0; i < META_COUNT; i++)
+        sb->meta[i] = META_NONE;
+    sb->seq = 0;
+    sb->mirror = SB_MIRROR;
+    SbBlock = 0;
+    SbNext = 0;
+    g_sb = sb;
+
+    bcache_init(g_bdev, wear_erased);
+    lookup_cache_init();
+    memset(ErasedBitmap, 0, sizeof(ErasedBitmap));
     if (g_bdev->erase) {
         for (i = 0; i < 8; i++) {
             g_bdev->erase(g_bdev->ctx, i);
+            wear_erased(i);
+            bitmap_set_free(ErasedBitmap, i);
         }
     }
-    for (i = 0; i < 4; i++) {
-        bitmap_set_used(BlockBitmap, i);
-    }
+    block_take(0);
+    block_take(SB_MIRROR);
 
     inode_alloc(&g_root);
+    g_root->din.mode = FILE_TYPE_DIR;
     g_root->din.size = sb->block_size;
     g_root->din.direct[0] = block_alloc();
-    DInodeArray[g_root->ino] = g_root->din;
+    bcache_fill(g_root->din.direct[0], 0xFF);
+    inode_store(g_root->ino, &g_root->din);
 
-    if (g_bdev->write(g_bdev->ctx, 0, 0, sb, sizeof(struct superblock))) {
-        return -1;
-    }
-    if (g_bdev->write(g_bdev->ctx, 1, 0, InodeBitmap, sizeof(InodeBitmap))) {
-        return -1;
-    }
-    if (g_bdev->write(g_bdev->ctx, 2, 0, BlockBitmap, sizeof(BlockBitmap))) {
-        return -1;
-    }
-    if (g_bdev->write(g_bdev->ctx, 3, 0, DInodeArray, sizeof(DInodeArray))) {
-        return -1;
-    }
+    JournalOff = 0;
 
-    return 0;
+    //the first checkpoint places the metadata and the journal
+    return journal_checkpoint();
 }
 
 int fs_sync(void)
 {
-    if (g_bdev->write(g_bdev->ctx, 1, 0, InodeBitmap, sizeof(InodeBitmap)) != 0)
-        return -1;
-    if (g_bdev->write(g_bdev->ctx, 2, 0, BlockBitmap, sizeof(BlockBitmap)) != 0)
-        return -1;
-    if (g_bdev->write(g_bdev->ctx, 3, 0, DInodeArray, sizeof(DInodeArray)) != 0)
-        return -1;
-
-    if (g_bdev->sync)
-        g_bdev->sync(g_bdev->ctx);
-
-    return 0;
+    return journal_commit();
 }
 
 #define DIR_COUNT_MAX (FS_BLOCK_SIZE / sizeof(struct dirent))
 static struct dirent ents[DIR_COUNT_MAX];
-int dir_is_exist(uint32_t blk, char *token, struct dirent *out)
+
+/*
+ * Directory blocks reach flash before the journal commit that allocates their
+ * inodes, power lost in between leaves entries naming a free inode. They are not
+ * live, and dir_scrub() drops them at mount.
+ */
+static int dirent_orphan(const struct dirent *e)
+{
+    return e->ino >= DINODE_COUNT || bitmap_is_free(InodeBitmap, e->ino);
+}
+
+static uint32_t dirent_hash(const char *name)
 {
-    memset(ents, 0, sizeof(ents));
-    if (g_bdev->read(g_bdev->ctx, blk, 0, ents, sizeof(ents)) != 0)
+    uint32_t h = 2166136261U;   /* FNV-1a */
+
+    for (uint32_t i = 0; i < NAME_MAX - 1 && name[i]; i++)
+        h = (h ^ (uint8_t)name[i]) * 16777619U;
+    return (h == DIRENT_HASH_NONE) ? h - 1 : h;
+}
+
+static int dirent_live(const struct dirent *e)
+{
+    return (uint8_t)e->name[0] != 0xFF && e->dropped == 0xFFFF && !dirent_orphan(e);
+}
+
+static uint32_t dir_block_count(const struct inode *dir)
+{
+    uint32_t n = (dir->din.size + FS_BLOCK_SIZE - 1) / FS_BLOCK_SIZE;
+    return n ? n : 1;
+}
+
+/*
+ * Flash block and offset of directory slot slot, slots count across the blocks.
+ */
+static int dir_slot(struct inode *dir, uint32_t slot, uint32_t *blk, uint32_t *off)
+{
+    if (bmap(dir, slot / DIR_COUNT_MAX, 0, BLOCK_NONE, blk) != 0 || *blk == BLOCK_NONE)
         return -1;
+    *off = (slot % DIR_COUNT_MAX) * sizeof(struct dirent);
+    return 0;
+}
 
-    for (uint32_t i = 0; i < DIR_COUNT_MAX; i++) {
-        if (ents[i].name[0] == 0xFF)
-            continue;
+/*
+ * Drops the orphans a power cut left behind. Kept, they would come back to life
+ * naming whatever file gets their inode next. Only the dropped halfword is
+ * programmed, still erased in every entry, so the block is not erased and
+ * rewritten with the committed entries in it. The directory blocks reach flash
+ * before the next commit, which is the first that could reuse those inodes.
+ */
+static int dir_scrub(void)
+{
+    for (uint32_t ino = 0; ino < DINODE_COUNT; ino++) {
+        struct inode *dir;
+        uint32_t slots;
 
-        if (strcmp(ents[i].name, token) == 0) {
-            if (out)
-                memcpy(out, &ents[i], sizeof(struct dirent));
-            return 1;
+        if (bitmap_is_free(InodeBitmap, ino) || DInodeArray[ino].mode != FILE_TYPE_DIR)
+            continue;
+        dir = iget(ino);
+        if (!dir)
+            return -1;
+        slots = dir_block_count(dir) * DIR_COUNT_MAX;
+        for (uint32_t slot = 0; slot < slots; slot++) {
+            uint32_t blk, off;
+            struct dirent e;
+
+            if (dir_slot(dir, slot, &blk, &off) != 0)
+                break;
+            if (bcache_read(blk, off, &e, sizeof(e)) != 0) {
+                iput(dir);
+                return -1;
+            }
+            if ((uint8_t)e.name[0] == 0xFF || e.dropped != 0xFFFF || !dirent_orphan(&e))
+                continue;
+            e.dropped = 0;
+            if (bcache_write(blk, off + offsetof(struct dirent, dropped),
+                             &e.dropped, sizeof(e.dropped)) != 0) {
+                iput(dir);
+                return -1;
+            }
         }
+        iput(dir);
     }
-
     return 0;
 }
 
+/*
+ * Hashed index of a directory: DIR_INDEX_SLOTS slot numbers in one block, placed
+ * by name hash with linear probing. A lookup reads the index and the one dirent it
+ * points at, instead of every directory block. Entries are never taken out, a
+ * stale one just fails the hash compare.
+ * Small directories have none, big ones drop it once they could fill it past 3/4.
+ */
+#define DIR_INDEX_SLOTS   (FS_BLOCK_SIZE / sizeof(uint16_t))
+#define DIR_INDEX_MAX     (DIR_INDEX_SLOTS * 3 / 4)
+#define DIR_INDEX_EMPTY   0xFFFF
+
+static int dir_index_insert(struct inode *dir, uint32_t hash, uint32_t slot)
+{
+    uint16_t v;
+
+    for (uint32_t n = 0, i = hash % DIR_INDEX_SLOTS; n < DIR_INDEX_SLOTS; n++, i = (i + 1) % DIR_INDEX_SLOTS) {
+        if (bcache_read(dir->din.dir_index, i * sizeof(v), &v, sizeof(v)) != 0)
+            return -1;
+        if (v == DIR_INDEX_EMPTY) {
+            v = (uint16_t)slot;
+            return bcache_write(dir->din.dir_index, i * sizeof(v), &v, sizeof(v));
+        }
+    }
+    return -1;
+}
 
-int dir_creat(uint32_t blk, char *token, uint32_t size)
+static void dir_index_drop(struct inode *dir)
 {
-    if (g_bdev->write(g_bdev->ctx, blk, 0, token, size) != 0)
-        return -1;
-    return 0;
+    if (dir->din.dir_index == BLOCK_NONE)
+        return;
+    block_free(dir->din.dir_index);
+    dir->din.dir_index = BLOCK_NONE;
+    inode_store(dir->ino, &dir->din);
 }
 
-static struct dirent fuck[DIR_COUNT_MAX];
-int dir_add_entry(struct inode *dir, const char *name, uint32_t ino, uint8_t type)
+static int dir_index_build(struct inode *dir)
 {
-    uint32_t blk = dir->din.direct[0];
-    int count = DIR_COUNT_MAX;
+    uint32_t slots = dir_block_count(dir) * DIR_COUNT_MAX;
+    int blk = block_alloc();
 
-    if (g_bdev->read(g_bdev->ctx, blk, 0, ents, sizeof(ents)) != 0)
+    if (blk < 0)
         return -1;
+    if (bcache_fill(blk, 0xFF) != 0)
+        return -1;
+    dir->din.dir_index = blk;
+    inode_store(dir->ino, &dir->din);
+
+    for (uint32_t slot = 0; slot < slots; slot++) {
+        uint32_t dblk, off;
+        struct dirent e;
 
-    for (int i = 0; i < count; i++) {
-        if (strcmp(ents[i].name, name) == 0)
+        if (dir_slot(dir, slot, &dblk, &off) != 0 || bcache_read(dblk, off, &e, sizeof(e)) != 0)
+            return -1;
+        if (dirent_live(&e) && dir_index_insert(dir, dirent_hash(e.name), slot) != 0)
             return -1;
+    }
+    return 0;
+}
 
-        if (ents[i].name[0] == 0xFF) {
-            strncpy(ents[i].name, name, NAME_MAX);
-            ents[i].name[NAME_MAX - 1] = '\0';
+/*
+ * Entries written before names were hashed have DIRENT_HASH_NONE and are compared
+ * by name only.
+ */
+static int dirent_match(const struct dirent *e, const char *name, uint32_t hash)
+{
+    if (!dirent_live(e))
+        return 0;
+    if (e->hash != DIRENT_HASH_NONE && e->hash != hash)
+        return 0;
+    return strcmp(e->name, name) == 0;
+}
 
-            ents[i].ino = ino;
-            ents[i].type = type;
-            if (g_bdev->erase(g_bdev->ctx, blk) != 0)
-                return -1;
-            if (g_bdev->write(g_bdev->ctx, blk, 0, ents, sizeof(ents)) != 0)
-                return -1;
+int dir_lookup(struct inode *dir, const char *name, struct dirent *out)
+{
+    uint32_t hash = dirent_hash(name);
+    uint32_t nblk = dir_block_count(dir);
+
+    if (dir->din.dir_index != BLOCK_NONE) {
+        uint16_t v;
+
+        for (uint32_t n = 0, i = hash % DIR_INDEX_SLOTS; n < DIR_INDEX_SLOTS; n++, i = (i + 1) % DIR_INDEX_SLOTS) {
+            uint32_t blk, off;
+            struct dirent e;
+
+            if (bcache_read(dir->din.dir_index, i * sizeof(v), &v, sizeof(v)) != 0)
+                return 0;
+            if (v == DIR_INDEX_EMPTY)
+                return 0;
+            if (dir_slot(dir, v, &blk, &off) != 0 || bcache_read(blk, off, &e, sizeof(e)) != 0)
+                return 0;
+            if (dirent_match(&e, name, hash)) {
+                if (out)
+                    memcpy(out, &e, sizeof(struct dirent));
+                return 1;
+            }
+        }
+        return 0;
+    }
 
+    for (uint32_t b = 0; b < nblk; b++) {
+        uint32_t blk;
+
+        if (bmap(dir, b, 0, BLOCK_NONE, &blk) != 0 || blk == BLOCK_NONE)
+            return 0;
+        if (bcache_read(blk, 0, ents, sizeof(ents)) != 0)
             return 0;
+        for (uint32_t i = 0; i < DIR_COUNT_MAX; i++) {
+            if (dirent_match(&ents[i], name, hash)) {
+                if (out)
+                    memcpy(out, &ents[i], sizeof(struct dirent));
+                return 1;
+            }
         }
     }
 
-    return -1;
+    return 0;
 }
 
 
+int dir_creat(uint32_t blk, char *token, uint32_t size)
+{
+    if (bcache_write(blk, 0, token, size) != 0)
+        return -1;
+    return 0;
+}
 
-int dir_lookup(struct inode *dir, const char *name, struct dirent *out)
+static struct dirent fuck[DIR_COUNT_MAX];
+
+/*
+ * The first erased slot, or a new block at the end of the directory. The index is
+ * built once the directory outgrows one block and dropped when it gets too big.
+ */
+int dir_add_entry(struct inode *dir, const char *name, uint32_t ino, uint8_t type)
 {
-    uint32_t blk = dir->din.direct[0];
-    int count = FS_BLOCK_SIZE / sizeof(struct dirent);
+    uint32_t nblk = dir_block_count(dir);
+    uint32_t slot, blk, off;
+    struct dirent e;
 
-    if (g_bdev->read(g_bdev->ctx, blk, 0, ents, FS_BLOCK_SIZE) != 0)
-        return 0;
+    if (dir_lookup(dir, name, NULL))
+        return -1;
 
-    for (int i = 0; i < count; i++) {
-        if (ents[i].name[0] == '\0')
-            continue;
+    for (slot = 0; slot < nblk * DIR_COUNT_MAX; slot++) {
+        if (dir_slot(dir, slot, &blk, &off) != 0 || bcache_read(blk, off, &e, sizeof(e)) != 0)
+            return -1;
+        //only erased slots, a used one would cost erasing the block under its neighbours
+        if ((uint8_t)e.name[0] == 0xFF)
+            break;
+    }
 
-        if (strcmp(ents[i].name, name) == 0) {
-            if (out)
-                memcpy(out, &ents[i], sizeof(struct dirent));
-            return 1;
-        }
+    if (slot == nblk * DIR_COUNT_MAX) {
+        if (bmap(dir, nblk, 1, blk + 1, &blk) != 0)
+            return -1;
+        if (bcache_fill(blk, 0xFF) != 0)
+            return -1;
+        dir->din.size = (nblk + 1) * FS_BLOCK_SIZE;
+        inode_store(dir->ino, &dir->din);
+        off = 0;
+        nblk++;
+        if (nblk * DIR_COUNT_MAX > DIR_INDEX_MAX)
+            dir_index_drop(dir);
+    }
+
+    memset(&e, 0xFF, sizeof(e));
+    strncpy(e.name, name, NAME_MAX);
+    e.name[NAME_MAX - 1] = '\0';
+    e.ino = ino;
+    e.type = type;
+    e.hash = dirent_hash(e.name);
+    if (bcache_write(blk, off, &e, sizeof(struct dirent)) != 0)
+        return -1;
+    dcache_insert(dir->ino, e.name, e.hash, ino);
+
+    if (dir->din.dir_index != BLOCK_NONE) {
+        if (dir_index_insert(dir, e.hash, slot) != 0)
+            dir_index_drop(dir);
+    } else if (FS_DIR_INDEX && nblk > 1 && nblk * DIR_COUNT_MAX <= DIR_INDEX_MAX) {
+        if (dir_index_build(dir) != 0)
+            dir_index_drop(dir);
     }
 
     return 0;
 }
 
 
+
 #define PATH_LEN_MAX  64
 static char path_copy[PATH_LEN_MAX];
+/*
+ * name in directory dir, through the dentry cache. *out gets a reference.
+ */
+static int dir_walk(struct inode *dir, const char *name, struct inode **out)
+{
+    uint32_t hash = dirent_hash(name);
+    uint32_t ino;
+    struct dirent de;
+
+    if (!dcache_lookup(dir->ino, name, hash, &ino)) {
+        if (!dir_lookup(dir, name, &de))
+            return -1;
+        ino = de.ino;
+        dcache_insert(dir->ino, name, hash, ino);
+    }
+    *out = iget(ino);
+    return *out ? 0 : -1;
+}
+
 int fs_mkdir(const char *path, struct inode **ino)
 {
-    if (path == NULL || path[0] == '/') {
-        *ino = g_root;
-        return 0;
+    if (path == NULL || strcmp(path, "/") == 0) {
+        *ino = iget(g_root->ino);
+        return *ino ? 0 : -1;
     }
 
     memset(path_copy, 0, PATH_LEN_MAX);
@@ -289,47 +1232,47 @@ int fs_mkdir(const char *path, struct inode **ino)
     char *saveptr;
     char *token = strtok_r(path_copy, "/", &saveptr);
 
-    struct inode *cur = malloc(sizeof(struct inode));
-    *cur = *g_root;
-    struct inode *parent = NULL;
-    struct dirent dir;
+    struct inode *cur = iget(g_root->ino);
+    struct inode *next;
+    if (!cur) return -1;
 
     while (token) {
-        parent = cur;
-        *ino = parent;
-        uint32_t data_blk = parent->din.direct[0];
-
-        if (dir_is_exist(data_blk, token, &dir)) {
-            cur->din = DInodeArray[dir.ino];
-            cur->ino = dir.ino;
-            token = strtok_r(NULL, "/", &saveptr);
-            *ino = cur;
-            continue;
-        }
-
-        break;
+        if (dir_walk(cur, token, &next) != 0)
+            break;
+        iput(cur);
+        cur = next;
+        token = strtok_r(NULL, "/", &saveptr);
     }
 
-    if (!token) return 0;
-
-    struct inode *new_inode;
     while (token) {
-        if (inode_alloc(&new_inode)) {
+        if (inode_alloc(&next)) {
+            iput(cur);
             return -1;
         }
 
-        uint32_t blk = block_alloc();
-        new_inode->din.direct[0] = blk;
-        DInodeArray[new_inode->ino] = new_inode->din;
-
-        if (dir_add_entry(parent, token, new_inode->ino, FILE_TYPE_DIR) < 0)
+        int blk = block_alloc();
+        if (blk < 0 || bcache_fill(blk, 0xFF) != 0) {
+            iput(next);
+            iput(cur);
             return -1;
+        }
+        next->din.mode = FILE_TYPE_DIR;
+        next->din.size = FS_BLOCK_SIZE;
+        next->din.direct[0] = blk;
+        inode_store(next->ino, &next->din);
+
+        if (dir_add_entry(cur, token, next->ino, FILE_TYPE_DIR) < 0) {
+            iput(next);
+            iput(cur);
+            return -1;
+        }
 
-        parent = new_inode;
+        iput(cur);
+        cur = next;
 
         token = strtok_r(NULL, "/", &saveptr);
     }
-    *ino = new_inode;
+    *ino = cur;
     return 0;
 }
 
@@ -343,10 +1286,9 @@ int fs_rmdir(struct superblock *sb, const char *path)
 
 static int fs_lookup_path(const char *path, struct inode **out)
 {
-    if (strcmp(path, "/") == 0) {
-        *out = g_root;
-        return 0;
-    }
+    struct inode *cur = iget(g_root->ino);
+    struct inode *next;
+    if (!cur) return -1;
 
     char tmp[PATH_LEN_MAX];
     memset(tmp, 0, sizeof(tmp));
@@ -356,20 +1298,13 @@ static int fs_lookup_path(const char *path, struct inode **out)
     char *save_ptr;
     char *token = strtok_r(tmp, "/", &save_ptr);
 
-    struct inode *cur = malloc(sizeof(struct inode));
-    if (!cur) return -1;
-    *cur = *g_root;
-
-    struct dirent de;
-
     while (token) {
-        if (!dir_lookup(cur, token, &de)) {
-            free(cur);
+        if (dir_walk(cur, token, &next) != 0) {
+            iput(cur);
             return -1;
         }
-
-        cur->din = DInodeArray[de.ino];
-        cur->ino = de.ino;
+        iput(cur);
+        cur = next;
 
         token = strtok_r(NULL, "/", &save_ptr);
     }
@@ -386,22 +1321,26 @@ int fs_readdir(const char *path, struct dirent *buf, int max, int *nread)
     if (fs_lookup_path(path, &dir_ino) < 0)
         return -1;
 
-    uint32_t blk = dir_ino->din.direct[0];
-    if (g_bdev->read(g_bdev->ctx, blk, 0, ents, sizeof(ents)) != 0) {
-        free(dir_ino);
-        return -1;
-    }
-
     int count = 0;
-    for (uint32_t i = 0; ((i < DIR_COUNT_MAX) && (count < max)); i++) {
-        if ((uint8_t)ents[i].name[0] == 0xFF)
-            continue;
+    uint32_t nblk = dir_block_count(dir_ino);
+    for (uint32_t b = 0; b < nblk && count < max; b++) {
+        uint32_t blk;
+        if (bmap(dir_ino, b, 0, BLOCK_NONE, &blk) != 0 || blk == BLOCK_NONE ||
+            bcache_read(blk, 0, ents, sizeof(ents)) != 0) {
+            iput(dir_ino);
+            return -1;
+        }
 
-        buf[count++] = ents[i];
+        for (uint32_t i = 0; ((i < DIR_COUNT_MAX) && (count < max)); i++) {
+            if (!dirent_live(&ents[i]))
+                continue;
+
+            buf[count++] = ents[i];
+        }
     }
 
     *nread = count;
-    free(dir_ino);
+    iput(dir_ino);
     return 0;
 }
 
@@ -436,40 +1375,43 @@ int fs_open(const char *path, int flags, struct inode **out)
     if (fs_mkdir(parent_path, &parent) < 0)
         return -1;
 
-    uint32_t data_blk = parent->din.direct[0];
-    struct dirent dir;
+    struct inode *node;
 
-    if (dir_is_exist(data_blk, filename, &dir)) {
+    if (dir_walk(parent, filename, &node) == 0) {
+        iput(parent);
         if ((flags & O_EXCL) && (flags & O_CREAT)) {
+            iput(node);
             return -1;
         }
 
-        struct inode *node = malloc(sizeof(struct inode));
-        if (!node) return -1;
-        node->din = DInodeArray[dir.ino];
-        node->ino = dir.ino;
-        node->refcnt++;
         *out = node;
         return 0;
     }
 
     if (!(flags & O_CREAT)) {
+        iput(parent);
         return -1;
     }
 
     struct inode *newfile;
-    inode_alloc(&newfile);
+    if (inode_alloc(&newfile)) {
+        iput(parent);
+        return -1;
+    }
 
+    //blocks come with the first write
     newfile->din.mode = FILE_TYPE_REG;
     newfile->din.size = 0;
-    newfile->din.direct[0] = block_alloc();
 
-    DInodeArray[newfile->ino] = newfile->din;
+    inode_store(newfile->ino, &newfile->din);
 
-    if (dir_add_entry(parent, filename, newfile->ino, FILE_TYPE_REG) < 0)
+    if (dir_add_entry(parent, filename, newfile->ino, FILE_TYPE_REG) < 0) {
+        iput(newfile);
+        iput(parent);
         return -1;
+    }
 
-    newfile->refcnt++;
+    iput(parent);
     *out = newfile;
 
     return 0;
@@ -493,21 +1435,32 @@ int fs_read(struct inode *inode, uint32_t off, void *buf, uint32_t len)
         uint32_t blk_index = pos / FS_BLOCK_SIZE;
         uint32_t blk_off   = pos % FS_BLOCK_SIZE;
 
-        if (blk_index >= NDIRECT)
-            break;
-
-        uint32_t blkno = inode->din.direct[blk_index];
-
-        if (blkno == 0xFFFFFFFF)
-            break;
+        uint32_t blkno;
+        if (bmap(inode, blk_index, 0, BLOCK_NONE, &blkno) != 0)
+            return -1;
 
         uint32_t chunk = FS_BLOCK_SIZE - blk_off;
         if (chunk > len - total)
             chunk = len - total;
 
-        if (g_bdev->read(g_bdev->ctx, blkno, blk_off,
-                         dst + total, chunk) != 0)
+        if (blkno == BLOCK_NONE) {
+            memset(dst + total, 0, chunk);      //never written
+        } else if (chunk == FS_BLOCK_SIZE) {
+            //whole blocks lying one after the other on flash are read in one go
+            uint32_t run = 1, next;
+            while ((run + 1) * FS_BLOCK_SIZE <= len - total) {
+                if (bmap(inode, blk_index + run, 0, BLOCK_NONE, &next) != 0)
+                    return -1;
+                if (next != blkno + run)
+                    break;
+                run++;
+            }
+            chunk = run * FS_BLOCK_SIZE;
+            if (bcache_read_blocks(blkno, run, dst + total) != 0)
+                return -1;
+        } else if (bcache_read(blkno, blk_off, dst + total, chunk) != 0) {
             return -1;
+        }
 
         total += chunk;
     }
@@ -515,43 +1468,174 @@ int fs_read(struct inode *inode, uint32_t off, void *buf, uint32_t len)
     return (int)total;
 }
 
-static uint8_t block_cache[FS_BLOCK_SIZE];
+/*
+ * Where the file data at off lies in memory mapped flash, for reading it in place.
+ * *len covers the blocks lying one after the other on flash, up to the end of the file,
+ * 0 at or past the end. Changes still in the cache are written back first.
+ * The pointer is good until the file is written, truncated or its blocks move.
+ * Returns -1 when the device has no map or off falls in a hole, fs_read() does both.
+ */
+int fs_read_map(struct inode *inode, uint32_t off, const void **ptr, uint32_t *len)
+{
+    uint32_t file_size = inode->din.size;
+    uint32_t blk_index = off / FS_BLOCK_SIZE;
+    uint32_t blk_off = off % FS_BLOCK_SIZE;
+    uint32_t blkno, next, run;
+
+    *ptr = NULL;
+    *len = 0;
+    if (!g_bdev->map)
+        return -1;
+    if (off >= file_size)
+        return 0;
+
+    if (bmap(inode, blk_index, 0, BLOCK_NONE, &blkno) != 0 || blkno == BLOCK_NONE ||
+        bcache_clean(blkno) != 0)
+        return -1;
+    for (run = 1; (blk_index + run) * FS_BLOCK_SIZE < file_size; run++) {
+        if (bmap(inode, blk_index + run, 0, BLOCK_NONE, &next) != 0)
+            return -1;
+        if (next != blkno + run)
+            break;
+        if (bcache_clean(next) != 0)
+            return -1;
+    }
+
+    *ptr = g_bdev->map(g_bdev->ctx, blkno, blk_off);
+    if (!*ptr)
+        return -1;
+    *len = run * FS_BLOCK_SIZE - blk_off;
+    if (*len > file_size - off)
+        *len = file_size - off;
+    return 0;
+}
+
+static int block_zero(uint32_t blkno, uint32_t off, uint32_t len)
+{
+    static const uint8_t zeros[32];
+
+    for (uint32_t i = 0; i < len; i += sizeof(zeros)) {
+        uint32_t chunk = (len - i < sizeof(zeros)) ? len - i : sizeof(zeros);
+        if (bcache_write(blkno, off + i, zeros, chunk) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+/*
+ * A block copied by a write keeps what an uncommitted write left past the end of
+ * the file, erased again here so appends to the copy need no erase.
+ */
+static int block_trim(uint32_t blkno, uint32_t size, uint32_t end)
+{
+    uint8_t ones[32];
+    uint32_t from = (size > end) ? size : end;
+
+    memset(ones, 0xFF, sizeof(ones));
+    for (uint32_t i = from; i < FS_BLOCK_SIZE; i += sizeof(ones)) {
+        uint32_t chunk = (FS_BLOCK_SIZE - i < sizeof(ones)) ? FS_BLOCK_SIZE - i : sizeof(ones);
+        if (bcache_write(blkno, i, ones, chunk) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+/*
+ * A write past the end leaves a gap which has to read as zeros. Data blocks start out
+ * erased, so the parts of the gap sharing a block with data are zeroed here, whole
+ * blocks in between stay holes.
+ */
+static int file_zero_gap(struct inode *inode, uint32_t from, uint32_t to)
+{
+    while (from < to) {
+        uint32_t blk_off = from % FS_BLOCK_SIZE;
+        uint32_t n = FS_BLOCK_SIZE - blk_off;
+        uint32_t blkno;
+
+        if (n > to - from)
+            n = to - from;
+        if (n == FS_BLOCK_SIZE) {
+            from += n;
+            continue;
+        }
+        if (bmap_walk(inode, from / FS_BLOCK_SIZE, 1, BLOCK_NONE, blk_off, NULL, n, &blkno) != 0)
+            return -1;
+        if (block_zero(blkno, blk_off, n) != 0)
+            return -1;
+        from += n;
+    }
+    return 0;
+}
+
+/*
+ * Blocks copied away since the last commit are only free after the next one. A
+ * write that runs out of room commits what it has so far and goes on, -1 when that
+ * would free nothing.
+ */
+static int file_reclaim(struct inode *inode)
+{
+    uint32_t freed = 0;
+
+    for (uint32_t i = 0; i < BLOCK_BITMAP_COUNT; i++)
+        freed |= BlockBitmap[i] & ~JournalBmap[i];
+    if (!freed)
+        return -1;
+    inode_store(inode->ino, &inode->din);
+    return journal_commit();
+}
+
 int fs_write(struct inode *inode, uint32_t off, const void *buf, uint32_t len)
 {
     const uint8_t *src = (const uint8_t *)buf;
     uint32_t total = 0;
+    uint32_t prev = BLOCK_NONE;
+
+    if (off > inode->din.size && file_zero_gap(inode, inode->din.size, off) != 0)
+        return -1;
+    if (off / FS_BLOCK_SIZE > 0 && bmap(inode, off / FS_BLOCK_SIZE - 1, 0, BLOCK_NONE, &prev) != 0)
+        return -1;
 
     while (total < len) {
         uint32_t pos = off + total;
         uint32_t blk_index = pos / FS_BLOCK_SIZE;
         uint32_t blk_off   = pos % FS_BLOCK_SIZE;
 
-        if (blk_index >= NDIRECT)
-            break;
-
-        uint32_t blkno = inode->din.direct[blk_index];
+        uint32_t start = blk_index * FS_BLOCK_SIZE;
+        uint32_t blkno, old = 0;
 
-        if (blkno == 0xFFFFFFFF)
+        //a hole inside the file gets an erased block, what the write leaves of it reads as zeros
+        if (start < inode->din.size && bmap(inode, blk_index, 0, BLOCK_NONE, &old) != 0)
             break;
-
         uint32_t chunk = FS_BLOCK_SIZE - blk_off;
         if (chunk > len - total)
             chunk = len - total;
 
-        memcpy(block_cache + blk_off, src + total, chunk);
-
-        if (g_bdev->erase(g_bdev->ctx, blkno) != 0)
-            return -1;
+        if (bmap_walk(inode, blk_index, 1, prev == BLOCK_NONE ? BLOCK_NONE : prev + 1,
+                      blk_off, src + total, chunk, &blkno) != 0 &&
+            (file_reclaim(inode) != 0 ||
+             bmap_walk(inode, blk_index, 1, prev == BLOCK_NONE ? BLOCK_NONE : prev + 1,
+                       blk_off, src + total, chunk, &blkno) != 0))
+            break;
+        prev = blkno;
+        if (old == BLOCK_NONE) {
+            uint32_t n = inode->din.size - start;
+            if (block_zero(blkno, 0, (n < FS_BLOCK_SIZE) ? n : FS_BLOCK_SIZE) != 0)
+                break;
+        } else if (start < inode->din.size && old != blkno &&
+                   block_trim(blkno, inode->din.size - start, blk_off + chunk) != 0) {
+            break;
+        }
 
-        if (g_bdev->write(g_bdev->ctx, blkno, 0, block_cache, FS_BLOCK_SIZE) != 0)
+        if (bcache_write(blkno, blk_off, src + total, chunk) != 0)
             return -1;
 
         total += chunk;
     }
-    inode->din.size = total;
-    DInodeArray[inode->ino] = inode->din;
+    if (off + total > inode->din.size)
+        inode->din.size = off + total;
+    inode_store(inode->ino, &inode->din);
 
-    return (int)total;
+    return (total || !len) ? (int)total : -1;
 }
 
 
@@ -566,21 +1650,8 @@ int fs_close(struct inode *inode)
     if (!inode)
         return -1;
 
-    if (--inode->refcnt == 0)
-        free(inode);
-    for (int i = 1; i < 4; i++) {
-        g_bdev->erase(g_bdev->ctx, i);
-    }
-    if (g_bdev->write(g_bdev->ctx, 1, 0, InodeBitmap, sizeof(InodeBitmap))) {
-        return -1;
-    }
-    if (g_bdev->write(g_bdev->ctx, 2, 0, BlockBitmap, sizeof(BlockBitmap))) {
-        return -1;
-    }
-    if (g_bdev->write(g_bdev->ctx, 3, 0, DInodeArray, sizeof(DInodeArray))) {
-        return -1;
-    }
+    iput(inode);
 
-    return 0;
+    return journal_commit();
 }
 
@@ -45,11 +45,22 @@
 #define FS_BLOCK_SIZE     1024   /* STM32F1 page size */
 #define FS_PROG_SIZE      2U
 #define FS_READ_SIZE      2U
-#define FS_CACHE_SIZE     64U
+#define FS_CACHE_SIZE     (4U * FS_BLOCK_SIZE)   /* bytes, whole blocks */
 #define FS_LOOKAHEAD_SIZE 32U
 #define FS_BLOCK_CYCLES   100U
+#define FS_DIR_INDEX      1     /* hashed index block for directories over one block */
+#define FS_DCACHE_SIZE    16U   /* path components remembered */
+#define FS_ICACHE_SIZE    8U    /* inodes in memory, open ones included */
+#define FS_ERASE_POOL     4U    /* free blocks fs_erase_step() keeps erased */
 
 
+/* where the metadata lives now, every checkpoint copies it to fresh blocks */
+#define META_INODE_BITMAP   0
+#define META_BLOCK_BITMAP   1   /* block bitmap, then the erase counters */
+#define META_INODES         2
+#define META_JOURNAL        3   /* appended to, replaced on a checkpoint */
+#define META_COUNT          4
+
 struct superblock {
     uint32_t magic;
     uint32_t block_size;
@@ -57,17 +68,27 @@ struct superblock {
     uint32_t inode_start;
     uint32_t data_start;
     uint32_t inode_count;
+    uint32_t meta[META_COUNT];
+    uint32_t seq;           /* checkpoints so far, heads the journal */
+    uint32_t mirror;        /* block of the second copy */
+    uint32_t crc;           /* of everything before it */
 };
 
 /*
  * for flash
  * */
 #define NDIRECT 8
+#ifndef NINDIRECT            /* bench/fs/fstest.c shrinks it to reach dindirect */
+#define NINDIRECT (FS_BLOCK_SIZE / sizeof(uint32_t))
+#endif
+#define FILE_BLOCKS_MAX (NDIRECT + NINDIRECT + NINDIRECT * NINDIRECT)
 struct dinode {
     uint16_t mode;
     uint32_t size;
     uint32_t direct[NDIRECT];
-    uint32_t indirect;
+    uint32_t indirect;      /* block of NINDIRECT block numbers */
+    uint32_t dindirect;     /* block of NINDIRECT indirect blocks */
+    uint32_t dir_index;     /* directories: hashed index block, or 0xFFFFFFFF */
 } __attribute__((aligned(64)));
 
 /*
@@ -80,10 +101,13 @@ struct inode {
 };
 
 #define NAME_MAX 32
+#define DIRENT_HASH_NONE 0xFFFFFFFF
 struct dirent {
     uint8_t type;
     uint32_t ino;
     char name[NAME_MAX];
+    uint32_t hash;          /* of name, compared before it */
+    uint16_t dropped;       /* 0xFFFF, programmed to 0 to drop the entry */
 }__attribute__((aligned(64)));
 
 struct mount_min {
@@ -121,26 +145,32 @@ struct fs_blkdev {
     uint32_t read_size;
     void *ctx;
 
+    /* len may run past the end of blk into the blocks after it */
     int (*read)(void *ctx, uint32_t blk, uint32_t off, void *buf, uint32_t len);
     int (*write)(void *ctx, uint32_t blk, uint32_t off, const void *buf, uint32_t len);
     int (*erase)(void *ctx, uint32_t blk);
     int (*sync)(void *ctx);
+    /* memory mapped flash only, else NULL; blocks one after the other map one after the other */
+    const void *(*map)(void *ctx, uint32_t blk, uint32_t off);
 };
 
 int fs_mount(struct superblock *sb, struct fs_blkdev *bdev);
 int fs_unmount(struct superblock *sb);
 int fs_format(struct superblock *sb);
 
+/* *out of fs_mkdir() and fs_open() holds a reference, fs_close() drops it */
 int fs_mkdir(const char *path, struct inode **out);
 int fs_readdir(const char *path, struct dirent *buf, int max, int *nread);
 
 int fs_open(const char *path, int flags, struct inode **out);
 int fs_read(struct inode *inode, uint32_t off, void *buf, uint32_t len);
 int fs_write(struct inode *inode, uint32_t off, const void *buf, uint32_t len);
+int fs_read_map(struct inode *inode, uint32_t off, const void **ptr, uint32_t *len);
 int fs_close(struct inode *inode);
 
 int fs_truncate(struct inode *inode, uint32_t newsize);
 int fs_sync(void);
+int fs_erase_step(void);
 
 
 
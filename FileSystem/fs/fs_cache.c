@@ -0,0 +1,436 @@
+#include <string.h>
+#include "fs_cache.h"
+
+#define BCACHE_NONE 0xFFFFFFFF
+#define BCACHE_CHUNK 64         /* bytes of flash compared at a time */
+
+struct bcache_block {
+    uint32_t blk;
+    uint32_t stamp;
+    uint8_t dirty;
+    uint32_t lo, hi;            /* dirty bytes */
+    uint8_t data[FS_BLOCK_SIZE];
+};
+
+static struct fs_blkdev *bc_dev;
+static bcache_erase_fn bc_on_erase;
+static struct bcache_block bcache[FS_CACHE_BLOCKS];
+static struct bcache_stats bc_stats;
+static uint32_t bc_clock;
+
+void bcache_init(struct fs_blkdev *bdev, bcache_erase_fn on_erase)
+{
+    bc_dev = bdev;
+    bc_on_erase = on_erase;
+    bc_clock = 0;
+    memset(&bc_stats, 0, sizeof(bc_stats));
+    for (uint32_t i = 0; i < FS_CACHE_BLOCKS; i++) {
+        bcache[i].blk = BCACHE_NONE;
+        bcache[i].stamp = 0;
+        bcache[i].dirty = 0;
+    }
+}
+
+static void bcache_touch(struct bcache_block *b, uint32_t off, uint32_t len)
+{
+    if (!b->dirty || off < b->lo)
+        b->lo = off;
+    if (!b->dirty || off + len > b->hi)
+        b->hi = off + len;
+    b->dirty = 1;
+}
+
+static int bcache_erased(const uint8_t *p, uint32_t len)
+{
+    while (len--) {
+        if (*p++ != 0xFF)
+            return 0;
+    }
+    return 1;
+}
+
+/*
+ * NOR flash programs erased units without an erase. The first pass checks that every
+ * prog_size unit of the dirty range which differs from flash is still erased there,
+ * the second programs each run of differing units.
+ * Returns 1 when done that way, 0 when the block needs an erase first, as it always
+ * does for a prog_size larger than BCACHE_CHUNK.
+ */
+static int bcache_program(struct bcache_block *b)
+{
+    uint32_t unit = bc_dev->prog_size ? bc_dev->prog_size : 1;
+    uint32_t chunk = BCACHE_CHUNK / unit * unit;    //whole units only
+    uint32_t lo = b->lo / unit * unit;
+    uint32_t hi = (b->hi + unit - 1) / unit * unit;
+    uint8_t old[BCACHE_CHUNK];
+
+    if (unit > BCACHE_CHUNK)
+        return 0;
+    for (int pass = 0; pass < 2; pass++) {
+        uint32_t run = BCACHE_NONE;
+
+        for (uint32_t off = lo; off < hi; off += chunk) {
+            uint32_t len = (hi - off < chunk) ? hi - off : chunk;
+
+            if (bc_dev->read(bc_dev->ctx, b->blk, off, old, len) != 0)
+                return -1;
+            for (uint32_t u = 0; u < len; u += unit) {
+                int changed = memcmp(old + u, b->data + off + u, unit) != 0;
+
+                if (pass == 0) {
+                    if (changed && !bcache_erased(old + u, unit))
+                        return 0;
+                } else if (changed && run == BCACHE_NONE) {
+                    run = off + u;
+                } else if (!changed && run != BCACHE_NONE) {
+                    if (bc_dev->write(bc_dev->ctx, b->blk, run, b->data + run, off + u - run) != 0)
+                        return -1;
+                    run = BCACHE_NONE;
+                }
+            }
+        }
+        if (run != BCACHE_NONE &&
+            bc_dev->write(bc_dev->ctx, b->blk, run, b->data + run, hi - run) != 0)
+            return -1;
+    }
+    return 1;
+}
+
+static int bcache_writeback(struct bcache_block *b)
+{
+    int done;
+
+    if (!b->dirty)
+        return 0;
+    done = bcache_program(b);
+    if (done < 0)
+        return -1;
+    if (done) {
+        bc_stats.programs++;
+    } else {
+        if (bc_dev->erase(bc_dev->ctx, b->blk) != 0)
+            return -1;
+        if (bc_on_erase)
+            bc_on_erase(b->blk);
+        if (bc_dev->write(bc_dev->ctx, b->blk, 0, b->data, FS_BLOCK_SIZE) != 0)
+            return -1;
+    }
+    b->dirty = 0;
+    bc_stats.writebacks++;
+    return 0;
+}
+
+/*
+ * The slot holding blk, or the least recently used one refilled with it.
+ * fill = 0 when the caller overwrites the whole block anyway.
+ */
+static struct bcache_block *bcache_get(uint32_t blk, int fill)
+{
+    struct bcache_block *victim = &bcache[0];
+
+    for (uint32_t i = 0; i < FS_CACHE_BLOCKS; i++) {
+        if (bcache[i].blk == blk) {
+            bc_stats.hits++;
+            bcache[i].stamp = ++bc_clock;
+            return &bcache[i];
+        }
+        //empty slots have stamp 0, so they go before any block
+        if (bcache[i].stamp < victim->stamp)
+            victim = &bcache[i];
+    }
+
+    bc_stats.misses++;
+    if (bcache_writeback(victim) != 0)
+        return NULL;
+    victim->blk = BCACHE_NONE;
+    victim->stamp = 0;
+    if (fill && bc_dev->read(bc_dev->ctx, blk, 0, victim->data, FS_BLOCK_SIZE) != 0)
+        return NULL;
+    victim->blk = blk;
+    victim->stamp = ++bc_clock;
+    return victim;
+}
+
+int bcache_read(uint32_t blk, uint32_t off, void *buf, uint32_t len)
+{
+    struct bcache_block *b;
+
+    if (off + len > FS_BLOCK_SIZE)
+        return FS_ERR_INVAL;
+    b = bcache_get(blk, 1);
+    if (!b)
+        return FS_ERR_IO;
+    memcpy(buf, b->data + off, len);
+    return FS_ERR_OK;
+}
+
+int bcache_write(uint32_t blk, uint32_t off, const void *buf, uint32_t len)
+{
+    struct bcache_block *b;
+
+    if (off + len > FS_BLOCK_SIZE)
+        return FS_ERR_INVAL;
+    b = bcache_get(blk, (off != 0) || (len != FS_BLOCK_SIZE));
+    if (!b)
+        return FS_ERR_IO;
+    memcpy(b->data + off, buf, len);
+    bcache_touch(b, off, len);
+    return FS_ERR_OK;
+}
+
+/*
+ * A freshly allocated block, set to val without reading what was there.
+ */
+int bcache_fill(uint32_t blk, uint8_t val)
+{
+    struct bcache_block *b = bcache_get(blk, 0);
+
+    if (!b)
+        return FS_ERR_IO;
+    memset(b->data, val, FS_BLOCK_SIZE);
+    bcache_touch(b, 0, FS_BLOCK_SIZE);
+    return FS_ERR_OK;
+}
+
+/*
+ * Whether len bytes of buf (zeros for NULL) written at off would reach flash the
+ * way bcache_program() writes, every prog_size unit they change still erased on
+ * flash. The cached copy supplies the rest of each unit, changes already waiting
+ * in it included.
+ */
+int bcache_programmable(uint32_t blk, uint32_t off, const void *buf, uint32_t len)
+{
+    uint32_t unit = bc_dev->prog_size ? bc_dev->prog_size : 1;
+    uint32_t chunk = BCACHE_CHUNK / unit * unit;
+    uint32_t lo = off / unit * unit;
+    uint32_t hi = (off + len + unit - 1) / unit * unit;
+    const uint8_t *src = buf;
+    uint8_t old[BCACHE_CHUNK], now[BCACHE_CHUNK];
+    struct bcache_block *b;
+
+    if (unit > BCACHE_CHUNK || off + len > FS_BLOCK_SIZE)
+        return 0;
+    b = bcache_get(blk, 1);
+    if (!b)
+        return 0;
+    for (uint32_t at = lo; at < hi; at += chunk) {
+        uint32_t n = (hi - at < chunk) ? hi - at : chunk;
+
+        if (bc_dev->read(bc_dev->ctx, blk, at, old, n) != 0)
+            return 0;
+        for (uint32_t i = 0; i < n; i++) {
+            uint32_t pos = at + i;
+
+            if (pos < off || pos >= off + len)
+                now[i] = b->data[pos];
+            else
+                now[i] = src ? src[pos - off] : 0;
+        }
+        for (uint32_t u = 0; u < n; u += unit) {
+            if (memcmp(old + u, now + u, unit) != 0 && !bcache_erased(old + u, unit))
+                return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * count whole blocks starting at blk, for sequential file reads.
+ * Blocks in the cache are copied from it, each run of the others is one device read
+ * and does not go into the cache, so streaming a file leaves the metadata cached.
+ */
+int bcache_read_blocks(uint32_t blk, uint32_t count, void *buf)
+{
+    uint8_t *dst = buf;
+    uint32_t run = 0;
+
+    for (uint32_t n = 0; n <= count; n++) {
+        struct bcache_block *b = NULL;
+
+        for (uint32_t i = 0; n < count && i < FS_CACHE_BLOCKS; i++) {
+            if (bcache[i].blk == blk + n)
+                b = &bcache[i];
+        }
+        if (n < count && !b) {
+            bc_stats.misses++;
+            run++;
+            continue;
+        }
+        if (run && bc_dev->read(bc_dev->ctx, blk + n - run, 0,
+                                dst + (n - run) * FS_BLOCK_SIZE, run * FS_BLOCK_SIZE) != 0)
+            return FS_ERR_IO;
+        run = 0;
+        if (b) {
+            bc_stats.hits++;
+            memcpy(dst + n * FS_BLOCK_SIZE, b->data, FS_BLOCK_SIZE);
+        }
+    }
+    return FS_ERR_OK;
+}
+
+int bcache_flush(void)
+{
+    int err = FS_ERR_OK;
+
+    for (uint32_t i = 0; i < FS_CACHE_BLOCKS; i++) {
+        if (bcache[i].blk != BCACHE_NONE && bcache_writeback(&bcache[i]) != 0)
+            err = FS_ERR_IO;
+    }
+    if (bc_dev->sync)
+        bc_dev->sync(bc_dev->ctx);
+    return err;
+}
+
+/*
+ * Write blk back if the cache holds changes to it, so flash can be read in place.
+ */
+int bcache_clean(uint32_t blk)
+{
+    for (uint32_t i = 0; i < FS_CACHE_BLOCKS; i++) {
+        if (bcache[i].blk == blk && bcache_writeback(&bcache[i]) != 0)
+            return FS_ERR_IO;
+    }
+    return FS_ERR_OK;
+}
+
+/*
+ * Forget blk without writing it back, for blocks that were freed or erased.
+ */
+void bcache_drop(uint32_t blk)
+{
+    for (uint32_t i = 0; i < FS_CACHE_BLOCKS; i++) {
+        if (bcache[i].blk == blk) {
+            bcache[i].blk = BCACHE_NONE;
+            bcache[i].stamp = 0;
+            bcache[i].dirty = 0;
+        }
+    }
+}
+
+/*
+ * The contents of block from become dirty block to, from is left as it is on flash.
+ * Moving a block costs no copy buffer, the cached copy just changes its number.
+ */
+int bcache_move(uint32_t from, uint32_t to)
+{
+    struct bcache_block *b;
+
+    bcache_drop(to);
+    b = bcache_get(from, 1);
+    if (!b)
+        return FS_ERR_IO;
+    b->blk = to;
+    bcache_touch(b, 0, FS_BLOCK_SIZE);
+    return FS_ERR_OK;
+}
+
+void bcache_get_stats(struct bcache_stats *stats)
+{
+    *stats = bc_stats;
+}
+
+
+struct dcache_entry {
+    uint32_t parent;
+    uint32_t hash;
+    uint32_t ino;
+    char name[NAME_MAX];
+};
+
+struct icache_entry {
+    struct inode inode;
+    uint32_t stamp;
+};
+
+static struct dcache_entry dcache[FS_DCACHE_SIZE];
+static struct icache_entry icache[FS_ICACHE_SIZE];
+static struct lookup_stats lk_stats;
+static uint32_t ic_clock;
+
+void lookup_cache_init(void)
+{
+    for (uint32_t i = 0; i < FS_DCACHE_SIZE; i++)
+        dcache[i].parent = BCACHE_NONE;
+    for (uint32_t i = 0; i < FS_ICACHE_SIZE; i++) {
+        icache[i].inode.ino = BCACHE_NONE;
+        icache[i].inode.refcnt = 0;
+        icache[i].stamp = 0;
+    }
+    ic_clock = 0;
+    memset(&lk_stats, 0, sizeof(lk_stats));
+}
+
+static struct dcache_entry *dcache_slot(uint32_t parent, uint32_t hash)
+{
+    uint32_t x = (hash + parent) * 0x9E3779B1U;
+
+    //the multiply leaves the low bits of an FNV hash poor, fold the high ones in
+    return &dcache[(x ^ (x >> 16)) % FS_DCACHE_SIZE];
+}
+
+int dcache_lookup(uint32_t parent, const char *name, uint32_t hash, uint32_t *ino)
+{
+    struct dcache_entry *d = dcache_slot(parent, hash);
+
+    if (d->parent == parent && d->hash == hash && strcmp(d->name, name) == 0) {
+        lk_stats.dentry_hits++;
+        *ino = d->ino;
+        return 1;
+    }
+    lk_stats.dentry_misses++;
+    return 0;
+}
+
+//names too long for a dirent never resolve, so they are not entered either
+void dcache_insert(uint32_t parent, const char *name, uint32_t hash, uint32_t ino)
+{
+    struct dcache_entry *d = dcache_slot(parent, hash);
+
+    if (strlen(name) >= NAME_MAX)
+        return;
+    strcpy(d->name, name);
+    d->parent = parent;
+    d->hash = hash;
+    d->ino = ino;
+}
+
+/*
+ * The cached inode ino with a reference taken, NULL when every slot is referenced.
+ * *fresh = 1 when the slot was just taken for ino and its din still has to be loaded.
+ */
+struct inode *icache_get(uint32_t ino, int *fresh)
+{
+    struct icache_entry *victim = NULL;
+
+    for (uint32_t i = 0; i < FS_ICACHE_SIZE; i++) {
+        if (icache[i].inode.ino == ino) {
+            lk_stats.inode_hits++;
+            icache[i].inode.refcnt++;
+            icache[i].stamp = ++ic_clock;
+            *fresh = 0;
+            return &icache[i].inode;
+        }
+        if (icache[i].inode.refcnt == 0 && (!victim || icache[i].stamp < victim->stamp))
+            victim = &icache[i];
+    }
+
+    lk_stats.inode_misses++;
+    if (!victim)
+        return NULL;
+    victim->inode.ino = ino;
+    victim->inode.refcnt = 1;
+    victim->stamp = ++ic_clock;
+    *fresh = 1;
+    return &victim->inode;
+}
+
+void icache_put(struct inode *inode)
+{
+    if (inode->refcnt)
+        inode->refcnt--;
+}
+
+void lookup_get_stats(struct lookup_stats *stats)
+{
+    *stats = lk_stats;
+}
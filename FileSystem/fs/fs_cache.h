@@ -0,0 +1,60 @@
+#ifndef FS_CACHE_H
+#define FS_CACHE_H
+
+#include <stdint.h>
+#include "fs.h"
+
+/*
+ * Write-back block cache between fs.c and the fs_blkdev.
+ * FS_CACHE_BLOCKS whole blocks, least recently used goes first. Writes only touch the
+ * cached copy, a dirty block is written back when it is evicted or flushed, however
+ * many writes went into it. Changes that only land on erased flash, like appends,
+ * program just the changed prog_size units, anything else costs an erase and a
+ * program of the whole block.
+ */
+#define FS_CACHE_BLOCKS   (FS_CACHE_SIZE / FS_BLOCK_SIZE)
+
+struct bcache_stats {
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t writebacks;
+    uint32_t programs;      /* writebacks done without an erase */
+};
+
+typedef void (*bcache_erase_fn)(uint32_t blk);
+
+void bcache_init(struct fs_blkdev *bdev, bcache_erase_fn on_erase);
+int bcache_read(uint32_t blk, uint32_t off, void *buf, uint32_t len);
+int bcache_write(uint32_t blk, uint32_t off, const void *buf, uint32_t len);
+int bcache_fill(uint32_t blk, uint8_t val);
+int bcache_programmable(uint32_t blk, uint32_t off, const void *buf, uint32_t len);
+int bcache_read_blocks(uint32_t blk, uint32_t count, void *buf);
+int bcache_flush(void);
+int bcache_clean(uint32_t blk);
+void bcache_drop(uint32_t blk);
+int bcache_move(uint32_t from, uint32_t to);
+void bcache_get_stats(struct bcache_stats *stats);
+
+/*
+ * Path lookup caches, both reset on mount.
+ * The dentry cache maps (parent ino, name) to an ino, FS_DCACHE_SIZE entries placed
+ * by name hash, so resolving a hot path reads no directory blocks.
+ * The inode cache holds FS_ICACHE_SIZE struct inode, shared by everyone who opened
+ * the same ino and counted by refcnt. Unreferenced ones stay until their slot is
+ * needed, least recently used first.
+ */
+struct lookup_stats {
+    uint32_t dentry_hits;
+    uint32_t dentry_misses;
+    uint32_t inode_hits;
+    uint32_t inode_misses;
+};
+
+void lookup_cache_init(void);
+int dcache_lookup(uint32_t parent, const char *name, uint32_t hash, uint32_t *ino);
+void dcache_insert(uint32_t parent, const char *name, uint32_t hash, uint32_t ino);
+struct inode *icache_get(uint32_t ino, int *fresh);
+void icache_put(struct inode *inode);
+void lookup_get_stats(struct lookup_stats *stats);
+
+#endif
@@ -1,6 +1,9 @@
 #include "fs_port.h"
 #include "fs.h"
 #include <memory.h>
+#ifdef FS_ERASER_TASK
+#include "schedule.h"
+#endif
 
 static int fs_bd_read(void *ctx, uint32_t block,
                       uint32_t off, void *buffer, uint32_t size) {
@@ -46,6 +49,10 @@ static int fs_bd_sync(void *ctx) {
     return FS_ERR_OK;
 }
 
+static const void *fs_bd_map(void *ctx, uint32_t block, uint32_t off) {
+    return (const void*)(FS_FLASH_BASE + block * FS_BLOCK_SIZE + off);
+}
+
 struct fs_blkdev fs_dev;
 extern struct fs_blkdev *g_bdev;
 void fs_port_init(void) {
@@ -55,6 +62,7 @@ void fs_port_init(void) {
     fs_dev.write = fs_bd_write;
     fs_dev.erase = fs_bd_erase;
     fs_dev.sync  = fs_bd_sync;
+    fs_dev.map   = fs_bd_map;
 
     fs_dev.read_size   = FS_READ_SIZE;
     fs_dev.prog_size   = FS_PROG_SIZE;
@@ -62,18 +70,92 @@ void fs_port_init(void) {
     fs_dev.block_count = FS_BLOCK_COUNT;
 }
 
+#ifdef FS_ERASER_TASK
+#define FS_ERASER_PRIORITY  1
+#define FS_ERASER_STACK     128
+#define FS_ERASER_IDLE      100     /* ticks between checks once the pool is full */
+
+Mutex_Handle fs_port_lock;
+static volatile int fs_port_mounted;    /* the eraser keeps off the bitmaps until then */
+
+//no lock before fs_port_eraser_start(), nothing else touches the fs yet
+static void fs_port_hold(void)
+{
+    if (fs_port_lock)
+        while (!mutex_lock(fs_port_lock, FS_ERASER_IDLE))
+            ;
+}
+
+static void fs_port_release(void)
+{
+    if (fs_port_lock)
+        mutex_unlock(fs_port_lock);
+}
+#else
+#define fs_port_hold()
+#define fs_port_release()
+#endif
+
 int fs_port_mount(struct superblock *sb)
 {
+    fs_port_hold();
     int err = fs_mount(sb, &fs_dev);
     if (err) {
         err = fs_format(sb);
-        if (err) return err;
-        err = fs_mount(sb, &fs_dev);
+        if (!err)
+            err = fs_mount(sb, &fs_dev);
     }
+#ifdef FS_ERASER_TASK
+    fs_port_mounted = !err;
+#endif
+    fs_port_release();
     return err;
 }
 
 void fs_port_deinit(struct superblock *sb)
 {
+    fs_port_hold();
+#ifdef FS_ERASER_TASK
+    fs_port_mounted = 0;
+#endif
     fs_unmount(sb);
+    fs_port_release();
+}
+
+
+#ifdef FS_ERASER_TASK
+/*
+ * Low priority task keeping FS_ERASE_POOL free pages erased, so allocation finds
+ * them ready and fs_write()/fs_close() only program. A page erase stalls flash
+ * fetches on the F1 either way, this moves it to when nothing else wants to run.
+ * Every fs call has to hold fs_port_lock, the eraser takes it per page. It erases
+ * nothing while unmounted, the free map is only valid between mount and unmount.
+ */
+static TaskHandle_t fs_eraser_tcb;
+
+static void fs_eraser(void *arg)
+{
+    (void)arg;
+    for (;;) {
+        int more;
+
+        //the wait ends up in TaskDelay(), which takes 16 bits; on a timeout we do not own the lock
+        if (!mutex_lock(fs_port_lock, FS_ERASER_IDLE))
+            continue;
+        more = fs_port_mounted ? fs_erase_step() : 0;
+        mutex_unlock(fs_port_lock);
+        TaskDelay(more ? 1 : FS_ERASER_IDLE);
+    }
+}
+
+void fs_port_eraser_start(void)
+{
+    fs_port_lock = mutex_creat();
+    TaskCreate((TaskFunction_t)fs_eraser,
+                FS_ERASER_STACK,
+                NULL,
+                FS_ERASER_PRIORITY,
+                &fs_eraser_tcb,
+                0);
 }
+#endif
@@ -3,6 +3,9 @@
 
 #include "stm32f1xx_hal.h"
 #include "fs.h"
+#ifdef FS_ERASER_TASK
+#include "mutex.h"
+#endif
 
 #define FS_FLASH_BASE     0x0800C000U
 
@@ -11,4 +14,9 @@ void fs_port_init(void);
 int fs_port_mount(struct superblock *sb);
 void fs_port_deinit(struct superblock *sb);
 
+#ifdef FS_ERASER_TASK
+extern Mutex_Handle fs_port_lock;     /* held around every fs call, the port calls take it themselves */
+void fs_port_eraser_start(void);
+#endif
+
 #endif
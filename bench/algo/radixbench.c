@@ -0,0 +1,147 @@
+/*
+ * Radix sort and run merge against quickSort(), runs on the host.
+ *
+ * Build (from the repository root):
+ *   gcc -O2 -Ilib/algorithm/include bench/algo/radixbench.c lib/algorithm/source/radixsort.c \
+ *       lib/algorithm/source/sort.c lib/algorithm/source/quicksort.c -o radixbench
+ *
+ * Usage:
+ *   radixbench [n]     keys per run, default 50000
+ *
+ * quickSort() sorts int, so the 32-bit keys stay below 2^31 for it to compare the same.
+ * "ticks" are timestamps within a 2^20 tick window, the upper bytes skip their passes.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "radixsort.h"
+#include "sort.h"
+#include "quicksort.h"
+
+#define RUNS    8
+
+#define u64_less(a, b)  ((a) < (b))
+SORT_DEFINE(sort_u64, uint64_t, u64_less)
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint64_t rand64(void)
+{
+    return ((uint64_t)rand() << 62) ^ ((uint64_t)rand() << 31) ^ (uint64_t)rand();
+}
+
+static size_t n;
+
+static void report(const char *set, const char *name, uint64_t t0, uint64_t t1)
+{
+    printf("%-7s %-12s %7.1f ns/key\n", set, name, (double)(t1 - t0) / n);
+}
+
+static void bench32(const char *set, const uint32_t *input)
+{
+    uint32_t *keys = malloc(n * sizeof(uint32_t));
+    uint32_t *scratch = malloc(n * sizeof(uint32_t));
+    void **values = malloc(n * sizeof(void *));
+    void **value_scratch = malloc(n * sizeof(void *));
+    size_t bounds[RUNS + 1];
+    uint64_t t0, t1;
+    size_t i;
+
+    memcpy(keys, input, n * sizeof(uint32_t));
+    t0 = now_ns();
+    quickSort((int *)keys, 0, (int)n - 1);
+    t1 = now_ns();
+    report(set, "quickSort", t0, t1);
+
+    memcpy(keys, input, n * sizeof(uint32_t));
+    t0 = now_ns();
+    radix_sort_u32(keys, scratch, n);
+    t1 = now_ns();
+    report(set, "radix", t0, t1);
+
+    memcpy(keys, input, n * sizeof(uint32_t));
+    for (i = 0; i < n; i++)
+        values[i] = (void *)(uintptr_t)i;
+    t0 = now_ns();
+    radix_sort_u32_kv(keys, values, scratch, value_scratch, n);
+    t1 = now_ns();
+    report(set, "radix kv", t0, t1);
+
+    //RUNS sorted runs, as from several sensors, merged into one
+    memcpy(keys, input, n * sizeof(uint32_t));
+    for (i = 0; i <= RUNS; i++)
+        bounds[i] = n * i / RUNS;
+    for (i = 0; i < RUNS; i++)
+        radix_sort_u32(keys + bounds[i], scratch, bounds[i + 1] - bounds[i]);
+    t0 = now_ns();
+    merge_runs_u32(scratch, keys, bounds, RUNS);
+    t1 = now_ns();
+    report(set, "merge 8 runs", t0, t1);
+
+    for (i = 1; i < n; i++) {
+        if (scratch[i - 1] > scratch[i]) {
+            printf("%s: merge out of order at %zu\n", set, i);
+            exit(1);
+        }
+    }
+    free(keys);
+    free(scratch);
+    free(values);
+    free(value_scratch);
+}
+
+static void bench64(const char *set, const uint64_t *input)
+{
+    uint64_t *keys = malloc(n * sizeof(uint64_t));
+    uint64_t *scratch = malloc(n * sizeof(uint64_t));
+    uint64_t t0, t1;
+
+    memcpy(keys, input, n * sizeof(uint64_t));
+    t0 = now_ns();
+    sort_u64(keys, n);
+    t1 = now_ns();
+    report(set, "introsort", t0, t1);
+
+    memcpy(keys, input, n * sizeof(uint64_t));
+    t0 = now_ns();
+    radix_sort_u64(keys, scratch, n);
+    t1 = now_ns();
+    report(set, "radix", t0, t1);
+
+    free(keys);
+    free(scratch);
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t *k32;
+    uint64_t *k64;
+    size_t i;
+
+    n = (argc > 1) ? strtoul(argv[1], NULL, 0) : 50000;
+    k32 = malloc(n * sizeof(uint32_t));
+    k64 = malloc(n * sizeof(uint64_t));
+    srand(1);
+
+    for (i = 0; i < n; i++)
+        k32[i] = (uint32_t)rand64() & 0x7fffffff;
+    bench32("random", k32);
+
+    for (i = 0; i < n; i++)
+        k32[i] = 0x40000000u + ((uint32_t)rand64() & 0xfffff);
+    bench32("ticks", k32);
+
+    for (i = 0; i < n; i++)
+        k64[i] = rand64();
+    bench64("u64", k64);
+
+    return 0;
+}
@@ -0,0 +1,136 @@
+/*
+ * Sort time per element for a few input patterns, runs on the host.
+ *
+ * Build (from the repository root):
+ *   gcc -O2 -Ilib/algorithm/include bench/algo/sortbench.c lib/algorithm/source/sort.c \
+ *       lib/algorithm/source/quicksort.c -o sortbench
+ *
+ * Usage:
+ *   sortbench [n]      elements per run, default 100000
+ *
+ * "old" is the previous recursive quickSort(), kept here for comparison. It takes the
+ * last element as pivot, so sorted input costs O(n^2) time and O(n) stack; it only
+ * runs on those patterns up to OLD_MAX elements.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "sort.h"
+#include "quicksort.h"
+
+#define OLD_MAX     20000
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void old_swap(int *a, int *b)
+{
+    int tmp = *a;
+    *a = *b;
+    *b = tmp;
+}
+
+static int old_part(int *arr, int low, int high)
+{
+    int value = arr[high];
+    int i = low - 1;
+    int j = high;
+    while(1) {
+        while(arr[++i] < value);
+        while(arr[--j] > value && j > low);
+        if (i < j) {
+            old_swap(&arr[i], &arr[j]);
+        } else {
+            break;
+        }
+    }
+    old_swap(&arr[i], &arr[high]);
+    return i;
+}
+
+static void old_quickSort(int *arr, int low, int high)
+{
+    if (low < high) {
+        int i = old_part(arr, low, high);
+        old_quickSort(arr, low, i -1);
+        old_quickSort(arr, i+1, high);
+    }
+}
+
+static int cmp_int(const void *a, const void *b)
+{
+    int x = *(const int *)a, y = *(const int *)b;
+    return (x > y) - (x < y);
+}
+
+static int *input, *work;
+static size_t n;
+
+static void fill(const char *pattern)
+{
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        if (strcmp(pattern, "random") == 0)
+            input[i] = rand();
+        else if (strcmp(pattern, "sorted") == 0)
+            input[i] = (int)i;
+        else if (strcmp(pattern, "reversed") == 0)
+            input[i] = (int)(n - i);
+        else if (strcmp(pattern, "organ") == 0)
+            input[i] = (int)((i < n / 2) ? i : n - i);
+        else
+            input[i] = rand() % 16;
+    }
+}
+
+static void check(const char *name)
+{
+    for (size_t i = 1; i < n; i++) {
+        if (work[i - 1] > work[i]) {
+            printf("%s: not sorted at %zu\n", name, i);
+            exit(1);
+        }
+    }
+}
+
+#define TIME(name, call)                                                    \
+    do {                                                                    \
+        uint64_t t0, t1;                                                    \
+        memcpy(work, input, n * sizeof(int));                               \
+        t0 = now_ns();                                                      \
+        call;                                                               \
+        t1 = now_ns();                                                      \
+        check(name);                                                        \
+        printf("  %-9s %7.1f ns/elem\n", name, (double)(t1 - t0) / n);      \
+    } while (0)
+
+int main(int argc, char **argv)
+{
+    static const char *patterns[] = { "random", "sorted", "reversed", "organ", "few" };
+
+    n = (argc > 1) ? strtoul(argv[1], NULL, 0) : 100000;
+    input = malloc(n * sizeof(int));
+    work = malloc(n * sizeof(int));
+    srand(1);
+
+    for (size_t p = 0; p < sizeof(patterns) / sizeof(patterns[0]); p++) {
+        fill(patterns[p]);
+        printf("%s, n = %zu\n", patterns[p], n);
+        if (p == 0 || p == 4 || n <= OLD_MAX)
+            TIME("old", old_quickSort(work, 0, (int)n - 1));
+        else
+            printf("  %-9s skipped, O(n^2)\n", "old");
+        TIME("quickSort", quickSort(work, 0, (int)n - 1));
+        TIME("sort", sort(work, n, sizeof(int), cmp_int));
+        TIME("qsort", qsort(work, n, sizeof(int), cmp_int));
+    }
+    return 0;
+}
@@ -0,0 +1,259 @@
+/*
+ * struct hashmap (chained) against struct ohashmap (open addressing), runs on the host.
+ *
+ * Build (from the repository root):
+ *   gcc -O2 -Ibench/port -Ikernel/MemAlgorithm/include -Ikernel/rbtree/include -Ilib/DataStruct/include \
+ *       bench/ds/hashbench.c lib/DataStruct/source/hashmap.c lib/DataStruct/source/ohashmap.c \
+ *       kernel/MemAlgorithm/source/heap.c lib/DataStruct/source/link_list.c -o hashbench
+ *
+ * Usage:
+ *   hashbench [n]      n keys, default 100000
+ *
+ * The chained map starts with n/4 buckets, which is what a caller sizing it by guess would do,
+ * it never grows. The open map starts at 8 slots and grows on its own.
+ * The typed row is HASHMAP_DEFINE() with uint32_t keys and values, int keys only.
+ * The growth rows time every put on its own and show the worst one: the open map rehashes
+ * everything at once, the chained map in incremental mode moves a few buckets per call.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "hashmap.h"
+#include "ohashmap.h"
+#include "hashmap_gen.h"
+#include "heap.h"
+
+#define HEAP_EXTRA  (64 * 1024 * 1024)
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void **keys;
+static void **miss;
+static size_t n;
+static volatile uintptr_t sink;
+
+static void report(const char *map, const char *op, uint64_t t0, uint64_t t1)
+{
+    printf("  %-8s %-8s %8.1f ns/op\n", map, op, (double)(t1 - t0) / n);
+}
+
+static void run_chained(int key_type)
+{
+    struct hashmap map;
+    uint64_t t0, t1;
+    size_t i;
+
+    hashmap_init(&map, n / 4, key_type);
+
+    t0 = now_ns();
+    for (i = 0; i < n; i++)
+        hashmap_put(&map, keys[i], keys[i]);
+    t1 = now_ns();
+    report("chained", "put", t0, t1);
+
+    t0 = now_ns();
+    for (i = 0; i < n; i++)
+        sink += (uintptr_t)hashmap_get(&map, keys[i]);
+    t1 = now_ns();
+    report("chained", "hit", t0, t1);
+
+    t0 = now_ns();
+    for (i = 0; i < n; i++)
+        sink += (uintptr_t)hashmap_get(&map, miss[i]);
+    t1 = now_ns();
+    report("chained", "miss", t0, t1);
+
+    t0 = now_ns();
+    for (i = 0; i < n; i++)
+        hashmap_remove(&map, keys[i]);
+    t1 = now_ns();
+    report("chained", "remove", t0, t1);
+
+    printf("  %-8s %zu bytes (+ malloc overhead per entry)\n", "chained",
+           (size_t)map.bucket_count * sizeof(struct list_node) + n * sizeof(struct hashmap_entry));
+    free(map.buckets);
+}
+
+static void run_open(int key_type)
+{
+    struct ohashmap map;
+    uint64_t t0, t1;
+    size_t i, bytes;
+
+    if (ohashmap_init(&map, 0, key_type) != 0) {
+        printf("ohashmap_init failed\n");
+        return;
+    }
+
+    t0 = now_ns();
+    for (i = 0; i < n; i++)
+        ohashmap_put(&map, keys[i], keys[i]);
+    t1 = now_ns();
+    report("open", "put", t0, t1);
+    bytes = (size_t)map.capacity * sizeof(struct ohashmap_entry);
+
+    t0 = now_ns();
+    for (i = 0; i < n; i++)
+        sink += (uintptr_t)ohashmap_get(&map, keys[i]);
+    t1 = now_ns();
+    report("open", "hit", t0, t1);
+
+    t0 = now_ns();
+    for (i = 0; i < n; i++)
+        sink += (uintptr_t)ohashmap_get(&map, miss[i]);
+    t1 = now_ns();
+    report("open", "miss", t0, t1);
+
+    t0 = now_ns();
+    for (i = 0; i < n; i++)
+        ohashmap_remove(&map, keys[i]);
+    t1 = now_ns();
+    report("open", "remove", t0, t1);
+
+    printf("  %-8s %zu bytes\n", "open", bytes);
+    ohashmap_destroy(&map);
+}
+
+HASHMAP_DEFINE(u32map, uint32_t, uint32_t, hashmap_hash_u32, HASHMAP_EQ)
+
+static void run_typed(void)
+{
+    u32map map;
+    uint64_t t0, t1;
+    size_t i, bytes;
+
+    if (u32map_init(&map, 0) != 0) {
+        printf("u32map_init failed\n");
+        return;
+    }
+
+    t0 = now_ns();
+    for (i = 0; i < n; i++)
+        u32map_put(&map, (uint32_t)(uintptr_t)keys[i], (uint32_t)i);
+    t1 = now_ns();
+    report("typed", "put", t0, t1);
+
+    t0 = now_ns();
+    for (i = 0; i < n; i++)
+        sink += *u32map_get(&map, (uint32_t)(uintptr_t)keys[i]);
+    t1 = now_ns();
+    report("typed", "hit", t0, t1);
+
+    t0 = now_ns();
+    for (i = 0; i < n; i++)
+        sink += u32map_contains(&map, (uint32_t)(uintptr_t)miss[i]);
+    t1 = now_ns();
+    report("typed", "miss", t0, t1);
+
+    bytes = (size_t)map.capacity * sizeof(u32map_entry);
+
+    t0 = now_ns();
+    for (i = 0; i < n; i++)
+        u32map_remove(&map, (uint32_t)(uintptr_t)keys[i]);
+    t1 = now_ns();
+    report("typed", "remove", t0, t1);
+
+    printf("  %-8s %zu bytes\n", "typed", bytes);
+
+    u32map_destroy(&map);
+}
+
+/*
+ * Best of GROWTH_RUNS: a rehash spike shows up in every run, a preempted put does not.
+ */
+#define GROWTH_RUNS     5
+
+static uint64_t growth_chained(int key_type)
+{
+    struct hashmap map;
+    uint64_t t0, t1, worst = 0;
+    size_t i;
+
+    hashmap_init(&map, 8, key_type);
+    hashmap_set_incremental(&map, 100, HASHMAP_REHASH_BUDGET);
+    for (i = 0; i < n; i++) {
+        t0 = now_ns();
+        hashmap_put(&map, keys[i], keys[i]);
+        t1 = now_ns();
+        worst = (t1 - t0 > worst) ? t1 - t0 : worst;
+    }
+    for (i = 0; i < n; i++)
+        hashmap_remove(&map, keys[i]);
+    while (!hashmap_rehash_step(&map, 64))
+        ;
+    free(map.buckets);
+    return worst;
+}
+
+static uint64_t growth_open(int key_type)
+{
+    struct ohashmap map;
+    uint64_t t0, t1, worst = 0;
+    size_t i;
+
+    if (ohashmap_init(&map, 0, key_type) != 0)
+        return 0;
+    for (i = 0; i < n; i++) {
+        t0 = now_ns();
+        ohashmap_put(&map, keys[i], keys[i]);
+        t1 = now_ns();
+        worst = (t1 - t0 > worst) ? t1 - t0 : worst;
+    }
+    ohashmap_destroy(&map);
+    return worst;
+}
+
+static void run_growth(int key_type)
+{
+    uint64_t inc = UINT64_MAX, open = UINT64_MAX, t;
+
+    for (int r = 0; r < GROWTH_RUNS; r++) {
+        t = growth_chained(key_type);
+        inc = (t < inc) ? t : inc;
+        t = growth_open(key_type);
+        open = (t < open) ? t : open;
+    }
+    printf("  %-8s %-8s worst %llu ns\n", "inc", "put", (unsigned long long)inc);
+    printf("  %-8s %-8s worst %llu ns\n", "open", "put", (unsigned long long)open);
+}
+
+int main(int argc, char **argv)
+{
+    size_t i;
+
+    n = (argc > 1) ? strtoul(argv[1], NULL, 0) : 100000;
+    keys = malloc(n * sizeof(void *));
+    miss = malloc(n * sizeof(void *));
+    heap_add_region(malloc(HEAP_EXTRA), HEAP_EXTRA, HEAP_NORMAL);
+    srand(1);
+
+    printf("int keys, n = %zu\n", n);
+    for (i = 0; i < n; i++) {
+        keys[i] = (void *)(uintptr_t)(i * 2 + 1);
+        miss[i] = (void *)(uintptr_t)(i * 2 + 2);
+    }
+    run_chained(HASHMAP_KEY_INT);
+    run_open(HASHMAP_KEY_INT);
+    run_typed();
+    run_growth(HASHMAP_KEY_INT);
+
+    printf("string keys, n = %zu\n", n);
+    for (i = 0; i < n; i++) {
+        keys[i] = malloc(24);
+        miss[i] = malloc(24);
+        snprintf(keys[i], 24, "key-%08x-%u", rand(), (unsigned)i);
+        snprintf(miss[i], 24, "miss-%08x-%u", rand(), (unsigned)i);
+    }
+    run_chained(HASHMAP_KEY_STRING);
+    run_open(HASHMAP_KEY_STRING);
+    run_growth(HASHMAP_KEY_STRING);
+
+    return (int)(sink & 0);
+}
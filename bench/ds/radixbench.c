@@ -0,0 +1,129 @@
+/*
+ * Radix tree memory per key and lookup time, runs on the host.
+ *
+ * Build (from the repository root), once per RADIX_TREE_SKIP setting to compare:
+ *   gcc -O2 -DRADIX_TREE_SKIP=1 -Ibench/port -Ikernel/MemAlgorithm/include -Ikernel/rbtree/include \
+ *       -Ilib/DataStruct/include bench/ds/radixbench.c lib/DataStruct/source/radix.c \
+ *       kernel/MemAlgorithm/source/heap.c -o radixbench
+ *
+ * Usage:
+ *   radixbench [n]     n keys per key set, default 50000
+ *
+ * Memory per key counts the nodes in the tree, the node pool keeps freed nodes for the
+ * next key set, so heap usage would only show the growth over the previous run.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "radix.h"
+#include "heap.h"
+
+#define HEAP_EXTRA  (256 * 1024 * 1024)
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint64_t rand64(void)
+{
+    return ((uint64_t)rand() << 62) ^ ((uint64_t)rand() << 31) ^ (uint64_t)rand();
+}
+
+static size_t *keys;
+static size_t n;
+static volatile uintptr_t sink;
+
+static void run(const char *name)
+{
+    struct radix_tree_root root;
+    void *results[64];
+    uint64_t t0, t1;
+    size_t i, index, found;
+    unsigned int got;
+
+    radix_tree_init(&root);
+
+    t0 = now_ns();
+    for (i = 0; i < n; i++)
+        radix_tree_insert(&root, keys[i], (void *)(uintptr_t)(i + 1));
+    t1 = now_ns();
+    printf("%-9s insert %7.1f ns/op  %6.1f bytes/key  %u nodes\n", name, (double)(t1 - t0) / n,
+           (double)root.count * sizeof(struct radix_tree_node) / n, root.count);
+
+    //look up in a different order than inserted
+    t0 = now_ns();
+    for (i = 0; i < n; i++)
+        sink += (uintptr_t)radix_tree_lookup(&root, keys[(i * 7919) % n]);
+    t1 = now_ns();
+    printf("%-9s lookup %7.1f ns/op\n", name, (double)(t1 - t0) / n);
+
+    found = 0;
+    index = 0;
+    t0 = now_ns();
+    while ((got = radix_tree_gang_lookup(&root, results, NULL, index, 64)) != 0) {
+        found += got;
+        sink += (uintptr_t)results[got - 1];
+        index = keys[found - 1] + 1;
+        if (found == n || index == 0)
+            break;
+    }
+    t1 = now_ns();
+    printf("%-9s gang   %7.1f ns/item (%zu items)\n", name, (double)(t1 - t0) / (found ? found : 1), found);
+
+    for (i = 0; i < n; i++)
+        radix_tree_delete(&root, keys[i]);
+}
+
+static int cmp_key(const void *a, const void *b)
+{
+    size_t x = *(const size_t *)a, y = *(const size_t *)b;
+    return (x > y) - (x < y);
+}
+
+//sorted and unique, so the gang pass can find its restart index in keys[]
+static void unique(void)
+{
+    size_t i, m = 0;
+
+    qsort(keys, n, sizeof(size_t), cmp_key);
+    for (i = 0; i < n; i++) {
+        if (m == 0 || keys[m - 1] != keys[i])
+            keys[m++] = keys[i];
+    }
+    n = m;
+}
+
+int main(int argc, char **argv)
+{
+    size_t count = (argc > 1) ? strtoul(argv[1], NULL, 0) : 50000;
+    size_t i;
+
+    keys = malloc(count * sizeof(size_t));
+    heap_add_region(malloc(HEAP_EXTRA), HEAP_EXTRA, HEAP_NORMAL);
+    srand(1);
+    printf("RADIX_TREE_SKIP=%d, node %zu bytes\n", RADIX_TREE_SKIP, sizeof(struct radix_tree_node));
+
+    n = count;
+    for (i = 0; i < n; i++)
+        keys[i] = i;
+    run("dense");
+
+    n = count;
+    for (i = 0; i < n; i++)
+        keys[i] = (uint32_t)rand64();
+    unique();
+    run("sparse32");
+
+    n = count;
+    for (i = 0; i < n; i++)
+        keys[i] = (size_t)rand64();
+    unique();
+    run("sparse64");
+
+    return (int)(sink & 0);
+}
@@ -0,0 +1,184 @@
+/*
+ * B+tree against the red-black tree at growing sizes, runs on the host.
+ *
+ * Build (from the repository root):
+ *   gcc -O2 -Ibench/port -Ikernel/MemAlgorithm/include -Ikernel/rbtree/include \
+ *       -Ilib/DataStruct/include bench/ds/treebench.c lib/DataStruct/source/rbtree.c \
+ *       lib/DataStruct/source/bptree.c kernel/MemAlgorithm/source/heap.c -o treebench
+ *
+ * Usage:
+ *   treebench [max]    largest key count, default 1000000, sizes go up by 10 from 1000
+ *
+ * Both trees index the same objects. The rb_node lives in the object, so its bytes per
+ * key are sizeof(rb_node); the B+tree counts its own nodes.
+ * B+tree remove includes heap_free() of merged nodes, heap.c walks its address ordered
+ * free list there, so at large sizes that time is mostly the allocator's.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "rbtree.h"
+#include "bptree.h"
+#include "heap.h"
+
+#define HEAP_EXTRA  (256 * 1024 * 1024)
+
+Class(obj)
+{
+    rb_node node;
+    uint64_t key;
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint64_t rand64(void)
+{
+    return ((uint64_t)rand() << 62) ^ ((uint64_t)rand() << 31) ^ (uint64_t)rand();
+}
+
+static obj *objs;
+static uint64_t *probe;
+static size_t n;
+static volatile uintptr_t sink;
+
+static void report(const char *tree, const char *op, uint64_t t0, uint64_t t1)
+{
+    printf("%8zu %-5s %-8s %7.1f ns/op\n", n, tree, op, (double)(t1 - t0) / n);
+}
+
+static void run_rb(void)
+{
+    rb_root root;
+    rb_node *node;
+    uint64_t t0, t1;
+    size_t i;
+
+    rb_root_init(&root);
+    for (i = 0; i < n; i++) {
+        rb_node_init(&objs[i].node);
+        objs[i].node.value = objs[i].key;
+    }
+
+    t0 = now_ns();
+    for (i = 0; i < n; i++)
+        rb_Insert_node(&root, &objs[i].node);
+    t1 = now_ns();
+    report("rb", "insert", t0, t1);
+
+    t0 = now_ns();
+    for (i = 0; i < n; i++)
+        sink += (uintptr_t)rb_first_greater(&root, probe[i]);
+    t1 = now_ns();
+    report("rb", "search", t0, t1);
+
+    t0 = now_ns();
+    for (node = rb_first(&root); node; node = rb_next(node))
+        sink += node->value;
+    t1 = now_ns();
+    report("rb", "iterate", t0, t1);
+
+    t0 = now_ns();
+    for (i = 0; i < n; i++)
+        rb_remove_node(&root, &objs[i].node);
+    t1 = now_ns();
+    report("rb", "remove", t0, t1);
+    printf("%8zu %-5s %-8s %7.1f bytes/key\n", n, "rb", "memory", (double)sizeof(rb_node));
+}
+
+static int cmp_obj(const void *a, const void *b)
+{
+    const obj *x = *(obj * const *)a, *y = *(obj * const *)b;
+
+    if (x->key != y->key)
+        return (x->key > y->key) - (x->key < y->key);
+    return (x > y) - (x < y);
+}
+
+static void run_bpt(void)
+{
+    bpt_root tree;
+    bpt_iter it;
+    bpt_key_t *keys;
+    void **items;
+    void *item;
+    uint64_t t0, t1;
+    size_t i;
+
+    bpt_root_init(&tree);
+
+    t0 = now_ns();
+    for (i = 0; i < n; i++)
+        bpt_insert(&tree, objs[i].key, &objs[i]);
+    t1 = now_ns();
+    report("bpt", "insert", t0, t1);
+
+    t0 = now_ns();
+    for (i = 0; i < n; i++)
+        sink += (uintptr_t)bpt_first_greater(&tree, probe[i], &it);
+    t1 = now_ns();
+    report("bpt", "search", t0, t1);
+
+    t0 = now_ns();
+    for (item = bpt_first(&tree, &it); item; item = bpt_next(&it))
+        sink += bpt_iter_key(&it);
+    t1 = now_ns();
+    report("bpt", "iterate", t0, t1);
+    printf("%8zu %-5s %-8s %7.1f bytes/key  %u nodes, height %u\n", n, "bpt", "memory",
+           (double)tree.nodes * BPT_NODE_SIZE / n, tree.nodes, tree.height);
+
+    t0 = now_ns();
+    for (i = 0; i < n; i++)
+        bpt_remove(&tree, objs[i].key, &objs[i]);
+    t1 = now_ns();
+    report("bpt", "remove", t0, t1);
+
+    //bulk load from sorted input, sorting is not timed
+    keys = malloc(n * sizeof(bpt_key_t));
+    items = malloc(n * sizeof(void *));
+    for (i = 0; i < n; i++)
+        items[i] = &objs[i];
+    qsort(items, n, sizeof(void *), cmp_obj);
+    for (i = 0; i < n; i++)
+        keys[i] = ((obj *)items[i])->key;
+
+    t0 = now_ns();
+    bpt_bulk_load(&tree, keys, items, n);
+    t1 = now_ns();
+    report("bpt", "bulk", t0, t1);
+    printf("%8zu %-5s %-8s %7.1f bytes/key  %u nodes, height %u\n", n, "bpt", "memory",
+           (double)tree.nodes * BPT_NODE_SIZE / n, tree.nodes, tree.height);
+
+    bpt_clear(&tree);
+    free(keys);
+    free(items);
+}
+
+int main(int argc, char **argv)
+{
+    size_t max = (argc > 1) ? strtoul(argv[1], NULL, 0) : 1000000;
+    size_t i;
+
+    objs = malloc(max * sizeof(obj));
+    probe = malloc(max * sizeof(uint64_t));
+    heap_add_region(malloc(HEAP_EXTRA), HEAP_EXTRA, HEAP_NORMAL);
+    printf("B+tree node %d bytes, %zu keys per leaf, %zu children per inner node\n",
+           BPT_NODE_SIZE, (size_t)BPT_LEAF_MAX, (size_t)BPT_INNER_MAX);
+
+    for (n = 1000; n <= max; n *= 10) {
+        srand(1);
+        for (i = 0; i < n; i++) {
+            objs[i].key = rand64() >> 16;
+            probe[i] = rand64() >> 16;
+        }
+        run_rb();
+        run_bpt();
+    }
+
+    return (int)(sink & 0);
+}
@@ -0,0 +1,429 @@
+/*
+ * Filesystem workloads on a simulated NOR flash, runs on the host.
+ *
+ * Build (from the repository root):
+ *   gcc -O2 -funsigned-char -IFileSystem/fs -Ibench/fs bench/fs/fsbench.c bench/fs/nor_sim.c \
+ *       FileSystem/fs/fs.c FileSystem/fs/fs_cache.c -o fsbench
+ *
+ * Usage:
+ *   fsbench                 every workload, 20 rounds each
+ *   fsbench -n 100          100 rounds each
+ *   fsbench -w seqwrite     one workload only (seqwrite, rewrite, seqread, mapread,
+ *                           randread, randwrite, create, lookup, meta, metaodd,
+ *                           metaidle)
+ *   fsbench -l              loose programming: rewrite a unit as long as no bit goes 0 -> 1
+ *   fsbench -e 40000        erase time in us, default 20000
+ *   fsbench -c 1000         endurance in erases per block, 0 for no limit
+ *
+ * The device defaults to the STM32F103 internal flash, FS_BLOCK_COUNT pages of
+ * FS_BLOCK_SIZE, so the numbers match what the board would see for the same fs.h.
+ * Each workload starts from a freshly formatted device, the format is not counted.
+ * host ops/s is how fast fs.c runs here; sim us/op is the flash time per operation on
+ * the target and usually the one to watch, with the erase count next to it.
+ * -funsigned-char matches the target, fs.c compares plain chars with 0xFF.
+ *
+ * Nothing truncates, fs_truncate() is a stub: rewrite and a wrapped meta log write
+ * over blocks the file already has, seqwrite is the only fresh sequential write.
+ * metaodd appends 15 bytes, so every other append starts inside a programmed
+ * halfword. metaidle is meta with fs_erase_step() run between the appends.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "fs.h"
+#include "nor_sim.h"
+
+#define CHUNK        256
+#define FILE_SIZE    (16 * 1024)
+#define SMALL_FILES  12         /* DINODE_COUNT less the root, the directory and spares */
+#define SMALL_SIZE   100
+#define META_WRITE   16
+#define META_ODD     15         /* every other append starts inside a programmed halfword */
+
+extern struct fs_blkdev *g_bdev;
+
+struct bench_meter {
+    uint64_t ops;
+    uint64_t host_ns;
+    struct nor_sim_stats sim;
+    uint64_t t0;
+    struct nor_sim_stats s0;
+};
+
+struct bench {
+    const char *name;
+    int (*run)(struct nor_sim *sim, struct bench_meter *m, uint32_t rounds);
+};
+
+static struct superblock g_bench_sb;
+static uint32_t g_rand = 2463534242U;
+
+static uint32_t bench_rand(void)
+{
+    g_rand ^= g_rand << 13;
+    g_rand ^= g_rand >> 17;
+    g_rand ^= g_rand << 5;
+    return g_rand;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void meter_start(struct nor_sim *sim, struct bench_meter *m)
+{
+    m->s0 = sim->stats;
+    m->t0 = now_ns();
+}
+
+static void meter_stop(struct nor_sim *sim, struct bench_meter *m, uint64_t ops)
+{
+    m->host_ns += now_ns() - m->t0;
+    m->ops += ops;
+    m->sim.reads += sim->stats.reads - m->s0.reads;
+    m->sim.read_bytes += sim->stats.read_bytes - m->s0.read_bytes;
+    m->sim.programs += sim->stats.programs - m->s0.programs;
+    m->sim.prog_bytes += sim->stats.prog_bytes - m->s0.prog_bytes;
+    m->sim.erases += sim->stats.erases - m->s0.erases;
+    m->sim.violations += sim->stats.violations - m->s0.violations;
+    m->sim.time_ns += sim->stats.time_ns - m->s0.time_ns;
+}
+
+static int bench_format(struct nor_sim *sim)
+{
+    g_bdev = &sim->dev;
+    if (fs_format(&g_bench_sb) != 0 || fs_mount(&g_bench_sb, &sim->dev) != 0) {
+        fprintf(stderr, "format failed\n");
+        return -1;
+    }
+    return 0;
+}
+
+//seed changes the data, rewriting what is already on flash would program nothing
+static int write_file(const char *path, uint32_t size, uint8_t seed)
+{
+    static uint8_t buf[CHUNK];
+    struct inode *f;
+
+    if (fs_open(path, O_CREAT | O_RDWR, &f) != 0)
+        return -1;
+    for (uint32_t off = 0; off < size; off += CHUNK) {
+        memset(buf, (uint8_t)(off / CHUNK + seed), CHUNK);
+        if (fs_write(f, off, buf, CHUNK) != CHUNK)
+            return -1;
+    }
+    return fs_close(f);
+}
+
+//a new file on an empty device, every round formats again like create
+static int bench_seqwrite(struct nor_sim *sim, struct bench_meter *m, uint32_t rounds)
+{
+    for (uint32_t r = 0; r < rounds; r++) {
+        if (bench_format(sim) != 0)
+            return -1;
+        meter_start(sim, m);
+        if (write_file("/seq", FILE_SIZE, (uint8_t)r) != 0)
+            return -1;
+        meter_stop(sim, m, FILE_SIZE / CHUNK);
+    }
+    return 0;
+}
+
+//the same file written over from the start each round, fs_truncate() does nothing yet
+static int bench_rewrite(struct nor_sim *sim, struct bench_meter *m, uint32_t rounds)
+{
+    if (bench_format(sim) != 0)
+        return -1;
+    for (uint32_t r = 0; r < rounds; r++) {
+        meter_start(sim, m);
+        if (write_file("/seq", FILE_SIZE, (uint8_t)r) != 0)
+            return -1;
+        meter_stop(sim, m, FILE_SIZE / CHUNK);
+    }
+    return 0;
+}
+
+static int bench_seqread(struct nor_sim *sim, struct bench_meter *m, uint32_t rounds)
+{
+    uint8_t buf[CHUNK];
+    struct inode *f;
+
+    if (bench_format(sim) != 0 || write_file("/seq", FILE_SIZE, 0) != 0 || fs_sync() != 0)
+        return -1;
+    for (uint32_t r = 0; r < rounds; r++) {
+        meter_start(sim, m);
+        if (fs_open("/seq", O_RDONLY, &f) != 0)
+            return -1;
+        for (uint32_t off = 0; off < FILE_SIZE; off += CHUNK) {
+            if (fs_read(f, off, buf, CHUNK) != CHUNK || buf[0] != (uint8_t)(off / CHUNK))
+                return -1;
+        }
+        fs_close(f);
+        meter_stop(sim, m, FILE_SIZE / CHUNK);
+    }
+    return 0;
+}
+
+//seqread through fs_read_map(), the file is checked in place instead of copied out
+static int bench_mapread(struct nor_sim *sim, struct bench_meter *m, uint32_t rounds)
+{
+    struct inode *f;
+
+    if (bench_format(sim) != 0 || write_file("/seq", FILE_SIZE, 0) != 0 || fs_sync() != 0)
+        return -1;
+    for (uint32_t r = 0; r < rounds; r++) {
+        meter_start(sim, m);
+        if (fs_open("/seq", O_RDONLY, &f) != 0)
+            return -1;
+        for (uint32_t off = 0; off < FILE_SIZE; off += CHUNK) {
+            const uint8_t *p;
+            uint32_t len;
+
+            if (fs_read_map(f, off, (const void **)&p, &len) != 0 || len < CHUNK ||
+                p[0] != (uint8_t)(off / CHUNK))
+                return -1;
+        }
+        fs_close(f);
+        meter_stop(sim, m, FILE_SIZE / CHUNK);
+    }
+    return 0;
+}
+
+static int bench_randread(struct nor_sim *sim, struct bench_meter *m, uint32_t rounds)
+{
+    uint8_t buf[CHUNK];
+    struct inode *f;
+
+    if (bench_format(sim) != 0 || write_file("/seq", FILE_SIZE, 0) != 0 || fs_sync() != 0)
+        return -1;
+    if (fs_open("/seq", O_RDONLY, &f) != 0)
+        return -1;
+    for (uint32_t r = 0; r < rounds; r++) {
+        meter_start(sim, m);
+        for (uint32_t i = 0; i < FILE_SIZE / CHUNK; i++) {
+            uint32_t off = bench_rand() % (FILE_SIZE - CHUNK);
+
+            if (fs_read(f, off, buf, CHUNK) != CHUNK)
+                return -1;
+        }
+        meter_stop(sim, m, FILE_SIZE / CHUNK);
+    }
+    return fs_close(f);
+}
+
+//every round ends with a sync, so the writes cannot all stay in the cache
+static int bench_randwrite(struct nor_sim *sim, struct bench_meter *m, uint32_t rounds)
+{
+    uint8_t buf[CHUNK];
+    struct inode *f;
+
+    if (bench_format(sim) != 0 || write_file("/seq", FILE_SIZE, 0) != 0 || fs_sync() != 0)
+        return -1;
+    if (fs_open("/seq", O_RDWR, &f) != 0)
+        return -1;
+    memset(buf, 0xA5, sizeof(buf));
+    for (uint32_t r = 0; r < rounds; r++) {
+        meter_start(sim, m);
+        for (uint32_t i = 0; i < 16; i++) {
+            uint32_t off = bench_rand() % (FILE_SIZE / CHUNK) * CHUNK;
+
+            if (fs_write(f, off, buf, CHUNK) != CHUNK)
+                return -1;
+        }
+        if (fs_sync() != 0)
+            return -1;
+        meter_stop(sim, m, 16);
+    }
+    return fs_close(f);
+}
+
+//there is no unlink, so every round formats again
+static int bench_create(struct nor_sim *sim, struct bench_meter *m, uint32_t rounds)
+{
+    char path[NAME_MAX + 4];
+
+    for (uint32_t r = 0; r < rounds; r++) {
+        if (bench_format(sim) != 0)
+            return -1;
+        meter_start(sim, m);
+        for (uint32_t i = 0; i < SMALL_FILES; i++) {
+            snprintf(path, sizeof(path), "/small%u", (unsigned)i);
+            if (write_file(path, SMALL_SIZE, (uint8_t)r) != 0)
+                return -1;
+        }
+        if (fs_sync() != 0)
+            return -1;
+        meter_stop(sim, m, SMALL_FILES);
+    }
+    return 0;
+}
+
+static int bench_lookup(struct nor_sim *sim, struct bench_meter *m, uint32_t rounds)
+{
+    char path[NAME_MAX + 8];
+    struct inode *f;
+
+    if (bench_format(sim) != 0 || fs_mkdir("/dir", &f) != 0)
+        return -1;
+    fs_close(f);
+    for (uint32_t i = 0; i < SMALL_FILES - 1; i++) {
+        snprintf(path, sizeof(path), "/dir/entry%u", (unsigned)i);
+        if (fs_open(path, O_CREAT | O_RDWR, &f) != 0)
+            return -1;
+        fs_close(f);
+    }
+    if (fs_sync() != 0)
+        return -1;
+    for (uint32_t r = 0; r < rounds; r++) {
+        meter_start(sim, m);
+        for (uint32_t i = 0; i < 100; i++) {
+            snprintf(path, sizeof(path), "/dir/entry%u", (unsigned)(bench_rand() % (SMALL_FILES - 1)));
+            if (fs_open(path, O_RDONLY, &f) != 0)
+                return -1;
+            fs_close(f);
+        }
+        meter_stop(sim, m, 100);
+    }
+    return 0;
+}
+
+/*
+ * open, a small append, close: the close commits the inode every time. At FILE_SIZE
+ * the log wraps and writes over itself from the start, there is no truncate.
+ * With idle set fs_erase_step() runs between the appends, as the port's eraser task
+ * would, and only the appends are metered; max wear still counts its erases.
+ */
+static int meta_appends(struct nor_sim *sim, struct bench_meter *m, uint32_t rounds, uint32_t size,
+                        int idle)
+{
+    uint8_t buf[META_WRITE];
+    struct inode *f;
+    uint32_t off = 0;
+
+    if (bench_format(sim) != 0)
+        return -1;
+    memset(buf, 'm', sizeof(buf));
+    for (uint32_t r = 0; r < rounds; r++) {
+        meter_start(sim, m);
+        for (uint32_t i = 0; i < 50; i++) {
+            if (fs_open("/log", O_CREAT | O_RDWR, &f) != 0)
+                return -1;
+            if (off + size > FILE_SIZE)
+                off = 0;
+            if (fs_write(f, off, buf, size) != (int)size)
+                return -1;
+            off += size;
+            if (fs_close(f) != 0)
+                return -1;
+            if (idle) {
+                meter_stop(sim, m, 0);
+                while (fs_erase_step() > 0)
+                    ;
+                meter_start(sim, m);
+            }
+        }
+        meter_stop(sim, m, 50);
+    }
+    return 0;
+}
+
+static int bench_meta(struct nor_sim *sim, struct bench_meter *m, uint32_t rounds)
+{
+    return meta_appends(sim, m, rounds, META_WRITE, 0);
+}
+
+static int bench_metaodd(struct nor_sim *sim, struct bench_meter *m, uint32_t rounds)
+{
+    return meta_appends(sim, m, rounds, META_ODD, 0);
+}
+
+static int bench_metaidle(struct nor_sim *sim, struct bench_meter *m, uint32_t rounds)
+{
+    return meta_appends(sim, m, rounds, META_WRITE, 1);
+}
+
+static const struct bench g_benches[] = {
+    { "seqwrite",  bench_seqwrite },
+    { "rewrite",   bench_rewrite },
+    { "seqread",   bench_seqread },
+    { "mapread",   bench_mapread },
+    { "randread",  bench_randread },
+    { "randwrite", bench_randwrite },
+    { "create",    bench_create },
+    { "lookup",    bench_lookup },
+    { "meta",      bench_meta },
+    { "metaodd",   bench_metaodd },
+    { "metaidle",  bench_metaidle },
+};
+
+static void report(const char *name, const struct bench_meter *m, uint32_t max_erases)
+{
+    double host_s = m->host_ns / 1e9;
+    double sim_us = m->ops ? m->sim.time_ns / 1e3 / m->ops : 0;
+
+    printf("%-10s %8llu %12.0f %10.1f %10.0f %8llu %9llu %10llu %9u %5llu\n", name,
+           (unsigned long long)m->ops, host_s > 0 ? m->ops / host_s : 0, sim_us,
+           sim_us > 0 ? 1e6 / sim_us : 0, (unsigned long long)m->sim.erases,
+           (unsigned long long)m->sim.programs, (unsigned long long)m->sim.prog_bytes,
+           max_erases, (unsigned long long)m->sim.violations);
+}
+
+int main(int argc, char **argv)
+{
+    struct nor_sim_config cfg = NOR_SIM_STM32F1;
+    const char *only = NULL;
+    uint32_t rounds = 20;
+    int ran = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+            rounds = (uint32_t)strtoul(argv[++i], NULL, 0);
+        else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc)
+            only = argv[++i];
+        else if (strcmp(argv[i], "-l") == 0)
+            cfg.strict = 0;
+        else if (strcmp(argv[i], "-e") == 0 && i + 1 < argc)
+            cfg.erase_ns = (uint32_t)strtoul(argv[++i], NULL, 0) * 1000;
+        else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc)
+            cfg.endurance = (uint32_t)strtoul(argv[++i], NULL, 0);
+        else {
+            fprintf(stderr, "usage: %s [-n rounds] [-w workload] [-l] [-e erase_us] [-c cycles]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    printf("%u blocks of %u, prog %u, erase %u us, %s\n", cfg.block_count, cfg.block_size,
+           cfg.prog_size, cfg.erase_ns / 1000, cfg.strict ? "strict" : "loose");
+    printf("%-10s %8s %12s %10s %10s %8s %9s %10s %9s %5s\n", "workload", "ops", "host ops/s",
+           "sim us/op", "sim ops/s", "erases", "programs", "prog bytes", "max wear", "bad");
+
+    for (size_t i = 0; i < sizeof(g_benches) / sizeof(g_benches[0]); i++) {
+        struct nor_sim sim;
+        struct bench_meter m;
+
+        if (only && strcmp(only, g_benches[i].name) != 0)
+            continue;
+        if (nor_sim_init(&sim, &cfg) != FS_ERR_OK) {
+            fprintf(stderr, "out of memory\n");
+            return 1;
+        }
+        memset(&m, 0, sizeof(m));
+        if (g_benches[i].run(&sim, &m, rounds) != 0)
+            fprintf(stderr, "%s: filesystem error after %llu ops\n", g_benches[i].name,
+                    (unsigned long long)m.ops);
+        report(g_benches[i].name, &m, nor_sim_max_erases(&sim));
+        nor_sim_free(&sim);
+        ran++;
+    }
+    if (!ran) {
+        fprintf(stderr, "no workload named %s\n", only);
+        return 2;
+    }
+    return 0;
+}
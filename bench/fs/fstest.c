@@ -0,0 +1,171 @@
+/*
+ * File block mapping checks on a simulated NOR flash, runs on the host.
+ *
+ * Build (from the repository root):
+ *   gcc -O2 -funsigned-char -DNINDIRECT=4 -IFileSystem/fs -Ibench/fs bench/fs/fstest.c \
+ *       bench/fs/nor_sim.c FileSystem/fs/fs.c FileSystem/fs/fs_cache.c -o fstest
+ *
+ * NINDIRECT=4 lets a file on the 32 block device run past direct[] and indirect into
+ * dindirect. Each check prints a line, the exit status is the number that failed.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "fs.h"
+#include "nor_sim.h"
+
+#define LONG_BLOCKS  (NDIRECT + NINDIRECT + 2)  /* the last 2 behind dindirect */
+#define FILL_CHUNK   700                        /* not a block, the last write is cut short */
+
+_Static_assert(LONG_BLOCKS <= FS_BLOCK_COUNT / 2, "build with -DNINDIRECT=4");
+
+extern struct fs_blkdev *g_bdev;
+
+static struct superblock g_test_sb;
+static uint8_t g_buf[LONG_BLOCKS * FS_BLOCK_SIZE];
+static int g_failed;
+
+static void check(int ok, const char *what)
+{
+    printf("%-52s %s\n", what, ok ? "ok" : "FAILED");
+    if (!ok)
+        g_failed++;
+}
+
+static uint8_t pattern(uint32_t pos)
+{
+    return (uint8_t)(pos / FS_BLOCK_SIZE * 31 + pos % 251);
+}
+
+static int check_pattern(const uint8_t *buf, uint32_t off, uint32_t len)
+{
+    for (uint32_t i = 0; i < len; i++) {
+        if (buf[i] != pattern(off + i))
+            return 0;
+    }
+    return 1;
+}
+
+static int remount(struct nor_sim *sim)
+{
+    return fs_unmount(&g_test_sb) == 0 && fs_mount(&g_test_sb, &sim->dev) == 0;
+}
+
+//a file reaching into dindirect, written a block at a time and read back after a remount
+static void test_dindirect(struct nor_sim *sim)
+{
+    struct inode *f;
+    uint32_t i, ok = 1;
+
+    for (i = 0; i < sizeof(g_buf); i++)
+        g_buf[i] = pattern(i);
+    if (fs_open("/long", O_CREAT | O_RDWR, &f) != 0) {
+        check(0, "dindirect: create");
+        return;
+    }
+    for (i = 0; i < LONG_BLOCKS && ok; i++)
+        ok = fs_write(f, i * FS_BLOCK_SIZE, g_buf + i * FS_BLOCK_SIZE, FS_BLOCK_SIZE) == FS_BLOCK_SIZE;
+    check(ok, "dindirect: write past direct and indirect");
+    check(f->din.dindirect != 0xFFFFFFFF, "dindirect: table allocated");
+    fs_close(f);
+
+    check(remount(sim), "dindirect: remount");
+    memset(g_buf, 0, sizeof(g_buf));
+    ok = fs_open("/long", O_RDWR, &f) == 0;
+    if (ok) {
+        ok = fs_read(f, 0, g_buf, sizeof(g_buf)) == (int)sizeof(g_buf) &&
+             check_pattern(g_buf, 0, sizeof(g_buf));
+        fs_close(f);
+    }
+    check(ok, "dindirect: read back");
+}
+
+//one block deep in the file costs the data and its two tables, not a walk from the start
+static void test_far_read(struct nor_sim *sim)
+{
+    struct inode *f;
+    uint32_t off = (LONG_BLOCKS - 1) * FS_BLOCK_SIZE;
+    uint64_t reads;
+    int ok;
+
+    check(remount(sim), "far read: remount, cache cold");
+    if (fs_open("/long", O_RDWR, &f) != 0) {
+        check(0, "far read: open");
+        return;
+    }
+    check(sim->stats.violations == 0, "dindirect: no program or endurance violations");
+    nor_sim_reset_stats(sim);
+    ok = fs_read(f, off, g_buf, FS_BLOCK_SIZE) == FS_BLOCK_SIZE && check_pattern(g_buf, off, FS_BLOCK_SIZE);
+    reads = sim->stats.reads;
+    fs_close(f);
+    check(ok, "far read: data");
+    printf("  %llu device reads for block %u\n", (unsigned long long)reads, LONG_BLOCKS - 1);
+    check(reads <= 3, "far read: dindirect, indirect and data only");
+}
+
+//filling the device ends in a short write, and what was there before survives it
+static void test_full(struct nor_sim *sim)
+{
+    struct inode *f;
+    uint8_t chunk[FILL_CHUNK];
+    uint32_t off = 0;
+    int rc = FILL_CHUNK;
+
+    if (fs_open("/fill", O_CREAT | O_RDWR, &f) != 0) {
+        check(0, "full: create");
+        return;
+    }
+    while (rc == FILL_CHUNK && off < FS_BLOCK_COUNT * FS_BLOCK_SIZE) {
+        for (uint32_t i = 0; i < FILL_CHUNK; i++)
+            chunk[i] = pattern(off + i);
+        rc = fs_write(f, off, chunk, FILL_CHUNK);
+        if (rc > 0)
+            off += rc;
+    }
+    printf("  %u bytes fit, last write returned %d\n", off, rc);
+    check(rc >= 0 && rc < FILL_CHUNK, "full: short write");
+    check(fs_write(f, off, chunk, FILL_CHUNK) == -1, "full: nothing more fits");
+    check(f->din.size == off, "full: size matches what was written");
+    fs_close(f);
+
+    check(remount(sim), "full: remount");
+    if (fs_open("/fill", O_RDWR, &f) != 0) {
+        check(0, "full: reopen");
+        return;
+    }
+    check(f->din.size == off && fs_read(f, 0, g_buf, off) == (int)off && check_pattern(g_buf, 0, off),
+          "full: filled file reads back");
+    fs_close(f);
+    if (fs_open("/long", O_RDWR, &f) != 0) {
+        check(0, "full: reopen long");
+        return;
+    }
+    check(fs_read(f, 0, g_buf, sizeof(g_buf)) == (int)sizeof(g_buf) && check_pattern(g_buf, 0, sizeof(g_buf)),
+          "full: earlier file untouched");
+    fs_close(f);
+}
+
+int main(void)
+{
+    struct nor_sim_config cfg = NOR_SIM_STM32F1;
+    struct nor_sim sim;
+
+    if (nor_sim_init(&sim, &cfg) != 0) {
+        fprintf(stderr, "no memory for the device\n");
+        return 1;
+    }
+    g_bdev = &sim.dev;
+    if (fs_format(&g_test_sb) != 0 || fs_mount(&g_test_sb, &sim.dev) != 0) {
+        fprintf(stderr, "format failed\n");
+        return 1;
+    }
+    printf("NDIRECT %u, NINDIRECT %u, file of %u blocks\n", NDIRECT, (unsigned)NINDIRECT, LONG_BLOCKS);
+    test_dindirect(&sim);
+    test_far_read(&sim);
+    test_full(&sim);
+    check(sim.stats.violations == 0, "full: no program or endurance violations");
+
+    fs_unmount(&g_test_sb);
+    nor_sim_free(&sim);
+    return g_failed;
+}
@@ -0,0 +1,144 @@
+#include <stdlib.h>
+#include <string.h>
+#include "nor_sim.h"
+
+static int nor_sim_range(struct nor_sim *sim, uint32_t blk, uint32_t off, uint32_t len)
+{
+    uint64_t end = (uint64_t)blk * sim->cfg.block_size + off + len;
+
+    return blk < sim->cfg.block_count &&
+           end <= (uint64_t)sim->cfg.block_size * sim->cfg.block_count;
+}
+
+//reads may run on into the next blocks, like memory mapped flash
+static int nor_sim_read(void *ctx, uint32_t blk, uint32_t off, void *buf, uint32_t len)
+{
+    struct nor_sim *sim = ctx;
+
+    if (!nor_sim_range(sim, blk, off, len))
+        return FS_ERR_INVAL;
+    memcpy(buf, sim->mem + (size_t)blk * sim->cfg.block_size + off, len);
+    sim->stats.reads++;
+    sim->stats.read_bytes += len;
+    sim->stats.time_ns += (uint64_t)len * sim->cfg.read_ns_per_byte;
+    return FS_ERR_OK;
+}
+
+static int nor_sim_write(void *ctx, uint32_t blk, uint32_t off, const void *buf, uint32_t len)
+{
+    struct nor_sim *sim = ctx;
+    uint32_t unit = sim->cfg.prog_size;
+    uint8_t *dst;
+    const uint8_t *src = buf;
+
+    if (!nor_sim_range(sim, blk, off, len) || off + len > sim->cfg.block_size ||
+        off % unit || len % unit)
+        return FS_ERR_INVAL;
+    dst = sim->mem + (size_t)blk * sim->cfg.block_size + off;
+
+    //checked before anything changes, a failed write leaves the flash as it was
+    for (uint32_t i = 0; i < len; i += unit) {
+        for (uint32_t k = i; k < i + unit; k++) {
+            if ((dst[k] & src[k]) != src[k] || (sim->cfg.strict && dst[k] != 0xFF)) {
+                sim->stats.violations++;
+                return FS_ERR_IO;
+            }
+        }
+    }
+    for (uint32_t i = 0; i < len; i++)
+        dst[i] &= src[i];
+
+    sim->stats.programs++;
+    sim->stats.prog_bytes += len;
+    sim->stats.time_ns += (uint64_t)(len / unit) * sim->cfg.prog_ns;
+    return FS_ERR_OK;
+}
+
+static int nor_sim_erase(void *ctx, uint32_t blk)
+{
+    struct nor_sim *sim = ctx;
+
+    if (blk >= sim->cfg.block_count)
+        return FS_ERR_INVAL;
+    if (sim->cfg.endurance && sim->erase_count[blk] >= sim->cfg.endurance) {
+        sim->stats.violations++;
+        return FS_ERR_IO;
+    }
+    memset(sim->mem + (size_t)blk * sim->cfg.block_size, 0xFF, sim->cfg.block_size);
+    sim->erase_count[blk]++;
+    sim->stats.erases++;
+    sim->stats.time_ns += sim->cfg.erase_ns;
+    return FS_ERR_OK;
+}
+
+static int nor_sim_sync(void *ctx)
+{
+    (void)ctx;
+    return FS_ERR_OK;
+}
+
+//reads through the pointer are not counted, like code reading mapped flash
+static const void *nor_sim_map(void *ctx, uint32_t blk, uint32_t off)
+{
+    struct nor_sim *sim = ctx;
+
+    if (!nor_sim_range(sim, blk, off, 0))
+        return NULL;
+    return sim->mem + (size_t)blk * sim->cfg.block_size + off;
+}
+
+/*
+ * A new part: every block erased once at the factory, which is not counted.
+ */
+int nor_sim_init(struct nor_sim *sim, const struct nor_sim_config *cfg)
+{
+    size_t size = (size_t)cfg->block_size * cfg->block_count;
+
+    if (!cfg->prog_size || cfg->block_size % cfg->prog_size)
+        return FS_ERR_INVAL;
+    memset(sim, 0, sizeof(*sim));
+    sim->cfg = *cfg;
+    sim->mem = malloc(size);
+    sim->erase_count = calloc(cfg->block_count, sizeof(uint32_t));
+    if (!sim->mem || !sim->erase_count) {
+        nor_sim_free(sim);
+        return FS_ERR_NOMEM;
+    }
+    memset(sim->mem, 0xFF, size);
+
+    sim->dev.block_size = cfg->block_size;
+    sim->dev.block_count = cfg->block_count;
+    sim->dev.prog_size = cfg->prog_size;
+    sim->dev.read_size = 1;
+    sim->dev.ctx = sim;
+    sim->dev.read = nor_sim_read;
+    sim->dev.write = nor_sim_write;
+    sim->dev.erase = nor_sim_erase;
+    sim->dev.sync = nor_sim_sync;
+    sim->dev.map = nor_sim_map;
+    return FS_ERR_OK;
+}
+
+void nor_sim_free(struct nor_sim *sim)
+{
+    free(sim->mem);
+    free(sim->erase_count);
+    sim->mem = NULL;
+    sim->erase_count = NULL;
+}
+
+void nor_sim_reset_stats(struct nor_sim *sim)
+{
+    memset(&sim->stats, 0, sizeof(sim->stats));
+}
+
+uint32_t nor_sim_max_erases(const struct nor_sim *sim)
+{
+    uint32_t max = 0;
+
+    for (uint32_t i = 0; i < sim->cfg.block_count; i++) {
+        if (sim->erase_count[i] > max)
+            max = sim->erase_count[i];
+    }
+    return max;
+}
@@ -0,0 +1,54 @@
+#ifndef NOR_SIM_H
+#define NOR_SIM_H
+
+#include <stdint.h>
+#include "fs.h"
+
+/*
+ * NOR flash in host memory behind a struct fs_blkdev, for running the filesystem on
+ * a Linux box. Erase sets a block to 0xFF, program can only clear bits. With strict
+ * set every prog_size unit written must still be erased, as on the STM32F1 where a
+ * halfword can only be programmed from 0xFFFF. A write breaking those rules fails
+ * with FS_ERR_IO and counts as a violation, so does erasing a block past endurance.
+ *
+ * Every access adds its cost to a simulated clock, so two runs can be compared by
+ * flash time as well as by counts.
+ */
+struct nor_sim_config {
+    uint32_t block_size;
+    uint32_t block_count;
+    uint32_t prog_size;
+    uint32_t read_ns_per_byte;
+    uint32_t prog_ns;               /* per prog_size unit */
+    uint32_t erase_ns;              /* per block */
+    uint32_t endurance;             /* erases per block, 0 for no limit */
+    int strict;
+};
+
+struct nor_sim_stats {
+    uint64_t reads;
+    uint64_t read_bytes;
+    uint64_t programs;
+    uint64_t prog_bytes;
+    uint64_t erases;
+    uint64_t violations;
+    uint64_t time_ns;
+};
+
+struct nor_sim {
+    struct fs_blkdev dev;           /* ctx points back here */
+    struct nor_sim_config cfg;
+    struct nor_sim_stats stats;
+    uint8_t *mem;
+    uint32_t *erase_count;
+};
+
+//STM32F103 internal flash: 1 KB pages, halfword program, 10k cycles
+#define NOR_SIM_STM32F1 { FS_BLOCK_SIZE, FS_BLOCK_COUNT, 2, 14, 52500, 20000000, 10000, 1 }
+
+int nor_sim_init(struct nor_sim *sim, const struct nor_sim_config *cfg);
+void nor_sim_free(struct nor_sim *sim);
+void nor_sim_reset_stats(struct nor_sim *sim);
+uint32_t nor_sim_max_erases(const struct nor_sim *sim);
+
+#endif
@@ -0,0 +1,532 @@
+/*
+ * Allocator trace replay benchmark, runs on the host.
+ *
+ * Build (from the repository root):
+ *   gcc -O2 -Ibench/port -Ikernel/MemAlgorithm/include -Ikernel/rbtree/include -Ilib/DataStruct/include \
+ *       bench/mem/membench.c kernel/MemAlgorithm/source/heap.c kernel/MemAlgorithm/source/memalloc.c \
+ *       kernel/MemAlgorithm/source/mempool.c kernel/MemAlgorithm/source/membit.c \
+ *       lib/DataStruct/source/rbtree.c lib/DataStruct/source/link_list.c -o membench
+ *
+ * Usage:
+ *   membench trace.bin          replay a trace recorded with configMemTrace
+ *   membench -g 100000          replay a synthetic trace of 100000 operations
+ *   membench -g 100000 -w f     also write the synthetic trace to f
+ *   membench -a heap trace.bin  replay against one allocator only (heap, mem, pool, bit)
+ *
+ * Every allocator runs in its own child process, so each one starts from a fresh heap.
+ * Latency includes one clock_gettime() call, compare allocators with each other, not with zero.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "memtrace.h"
+#include "heap.h"
+#include "mempool.h"
+#include "membit.h"
+
+/* memalloc.h carries its own heap config, keep it out of this unit. */
+void *mem_malloc(size_t WantSize);
+void mem_free(void *xReturn);
+
+#define FRAG_SAMPLES    20
+
+Class(bench_op)
+{
+    uint32_t id;
+    uint32_t size;
+    uint8_t op;
+};
+
+Class(bench_trace)
+{
+    bench_op *ops;
+    uint32_t count;
+    uint32_t ids;
+};
+
+Class(bench_live)
+{
+    void *ptr;
+    void *cookie;
+    uint32_t size;
+};
+
+Class(bench_backend)
+{
+    const char *name;
+    void *(*alloc)(size_t size, void **cookie);
+    void (*release)(void *ptr, void *cookie);
+};
+
+
+/*
+ * heap.c and memalloc.c
+ */
+static void *heap_alloc_op(size_t size, void **cookie)
+{
+    *cookie = NULL;
+    return heap_malloc(size);
+}
+
+static void heap_release_op(void *ptr, void *cookie)
+{
+    heap_free(ptr);
+}
+
+static void *mem_alloc_op(size_t size, void **cookie)
+{
+    *cookie = NULL;
+    return mem_malloc(size);
+}
+
+static void mem_release_op(void *ptr, void *cookie)
+{
+    mem_free(ptr);
+}
+
+
+/*
+ * mempool.c and membit.c only hand out one block size, so they are replayed as
+ * segregated size classes: one growing set of pools per class, anything bigger
+ * than the last class goes to heap_malloc.
+ */
+#define CLASS_COUNT     6
+#define CLASS_POOLS     512
+static const uint16_t ClassSize[CLASS_COUNT] = {16, 32, 64, 128, 256, 512};
+
+Class(pool_class)
+{
+    PoolHeadHandle pool[CLASS_POOLS];
+    uint8_t remain[CLASS_POOLS];
+    uint16_t count;
+};
+
+static pool_class PoolClass[CLASS_COUNT];
+
+Class(pool_ops)
+{
+    uint8_t amount;
+    PoolHeadHandle (*creat)(uint16_t size, uint8_t amount);
+    void *(*alloc)(PoolHeadHandle ThePool);
+    void (*release)(PoolHeadHandle ThePool, void *address);
+};
+
+static const pool_ops MemPoolOps = {
+        .amount = 64,
+        .creat = memPool_creat,
+        .alloc = memPool_apl,
+        .release = memPool_free
+};
+
+static const pool_ops MemBitOps = {
+        .amount = 32,
+        .creat = mempool_creat,
+        .alloc = mempool_alloc,
+        .release = mempool_free
+};
+
+static const pool_ops *PoolOps;
+
+static int size_class(size_t size)
+{
+    for (int i = 0; i < CLASS_COUNT; i++) {
+        if (size <= ClassSize[i]) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* cookie is pool index + 1 in its class, NULL means the block came from heap_malloc. */
+static void *pool_alloc_op(size_t size, void **cookie)
+{
+    int c = size_class(size);
+    pool_class *pc;
+    void *ptr;
+
+    *cookie = NULL;
+    if (c < 0) {
+        return heap_malloc(size);
+    }
+
+    pc = &PoolClass[c];
+    for (uint16_t i = 0; i < pc->count; i++) {
+        if (pc->remain[i]) {
+            ptr = PoolOps->alloc(pc->pool[i]);
+            if (ptr) {
+                pc->remain[i]--;
+                *cookie = (void *)(size_t)(i + 1);
+                return ptr;
+            }
+        }
+    }
+
+    if (pc->count == CLASS_POOLS) {
+        return NULL;
+    }
+    pc->pool[pc->count] = PoolOps->creat(ClassSize[c], PoolOps->amount);
+    if (!pc->pool[pc->count]) {
+        return NULL;
+    }
+    pc->remain[pc->count] = PoolOps->amount - 1;
+    ptr = PoolOps->alloc(pc->pool[pc->count]);
+    pc->count++;
+    *cookie = (void *)(size_t)pc->count;
+    return ptr;
+}
+
+static void pool_release_op(void *ptr, void *cookie, size_t size)
+{
+    pool_class *pc;
+    size_t i;
+
+    if (!cookie) {
+        heap_free(ptr);
+        return;
+    }
+    pc = &PoolClass[size_class(size)];
+    i = (size_t)cookie - 1;
+    PoolOps->release(pc->pool[i], ptr);
+    pc->remain[i]++;
+}
+
+
+static const bench_backend Backends[] = {
+        {"heap", heap_alloc_op, heap_release_op},
+        {"mem",  mem_alloc_op,  mem_release_op},
+        {"pool", pool_alloc_op, NULL},
+        {"bit",  pool_alloc_op, NULL},
+};
+#define BACKEND_COUNT (sizeof(Backends) / sizeof(Backends[0]))
+
+
+/*
+ * Trace loading: addresses are turned into dense ids, so replay does not care
+ * where the target allocator put the blocks.
+ */
+Class(addr_slot)
+{
+    uint32_t addr;
+    uint32_t id;
+};
+
+static uint32_t addr_hash(uint32_t addr, uint32_t mask)
+{
+    return ((addr >> 3) * 0x9e3779b1U) & mask;
+}
+
+static addr_slot *addr_find(addr_slot *tab, uint32_t mask, uint32_t addr)
+{
+    uint32_t i = addr_hash(addr, mask);
+    while (tab[i].addr && tab[i].addr != addr) {
+        i = (i + 1) & mask;
+    }
+    return &tab[i];
+}
+
+/* Linear probing delete: pull the rest of the cluster back so lookups still find them. */
+static void addr_erase(addr_slot *tab, uint32_t mask, addr_slot *slot)
+{
+    uint32_t i = slot - tab;
+    uint32_t j = i;
+
+    tab[i].addr = 0;
+    for (;;) {
+        j = (j + 1) & mask;
+        if (!tab[j].addr) {
+            return;
+        }
+        uint32_t k = addr_hash(tab[j].addr, mask);
+        if ((i <= j) ? ((i < k) && (k <= j)) : ((i < k) || (k <= j))) {
+            continue;
+        }
+        tab[i] = tab[j];
+        tab[j].addr = 0;
+        i = j;
+    }
+}
+
+static int trace_load(const char *path, bench_trace *trace)
+{
+    FILE *fp = fopen(path, "rb");
+    memtrace_head head;
+    memtrace_rec rec;
+    addr_slot *tab;
+    uint32_t cap = 1024;
+    uint32_t mask;
+    long total;
+
+    if (!fp) {
+        perror(path);
+        return -1;
+    }
+    if (fread(&head, sizeof(head), 1, fp) != 1 || head.magic != MEMTRACE_MAGIC
+        || head.version != MEMTRACE_VERSION) {
+        fprintf(stderr, "%s: not a memtrace file\n", path);
+        fclose(fp);
+        return -1;
+    }
+
+    fseek(fp, 0, SEEK_END);
+    total = (ftell(fp) - (long)sizeof(head)) / (long)sizeof(memtrace_rec);
+    fseek(fp, sizeof(head), SEEK_SET);
+    while (cap < (uint32_t)total * 2) {
+        cap <<= 1;
+    }
+    mask = cap - 1;
+
+    trace->ops = malloc(sizeof(bench_op) * (total ? total : 1));
+    tab = calloc(cap, sizeof(addr_slot));
+    trace->count = 0;
+    trace->ids = 0;
+
+    while (fread(&rec, sizeof(rec), 1, fp) == 1) {
+        addr_slot *slot;
+        if (!rec.addr) {
+            continue;   //failed on the target, it did not change the heap
+        }
+        slot = addr_find(tab, mask, rec.addr);
+        if (MEMTRACE_OP(rec.info) == MEMTRACE_MALLOC) {
+            slot->addr = rec.addr;
+            slot->id = trace->ids++;
+            trace->ops[trace->count++] = (bench_op){slot->id, MEMTRACE_SIZE(rec.info), MEMTRACE_MALLOC};
+        } else if (slot->addr) {
+            trace->ops[trace->count++] = (bench_op){slot->id, 0, MEMTRACE_FREE};
+            addr_erase(tab, mask, slot);
+        }
+    }
+
+    free(tab);
+    fclose(fp);
+    return 0;
+}
+
+
+/*
+ * Synthetic workload: mostly small objects, a few buffers, about 1000 live blocks.
+ */
+static uint32_t rand_state = 0x12345678;
+static uint32_t xorshift32(void)
+{
+    rand_state ^= rand_state << 13;
+    rand_state ^= rand_state >> 17;
+    rand_state ^= rand_state << 5;
+    return rand_state;
+}
+
+static void trace_synth(uint32_t count, bench_trace *trace)
+{
+    uint32_t *live = malloc(sizeof(uint32_t) * count);
+    uint32_t live_count = 0;
+
+    trace->ops = malloc(sizeof(bench_op) * count);
+    trace->count = 0;
+    trace->ids = 0;
+
+    while (trace->count < count) {
+        uint32_t r = xorshift32();
+        if (live_count && ((r % 2048) < live_count)) {
+            uint32_t k = xorshift32() % live_count;
+            trace->ops[trace->count++] = (bench_op){live[k], 0, MEMTRACE_FREE};
+            live[k] = live[--live_count];
+        } else {
+            uint32_t size = (r & 0xF) ? (8 + (xorshift32() % 120)) : (256 + (xorshift32() % 1792));
+            live[live_count++] = trace->ids;
+            trace->ops[trace->count++] = (bench_op){trace->ids++, size, MEMTRACE_MALLOC};
+        }
+    }
+    free(live);
+}
+
+static int trace_write(const char *path, const bench_trace *trace)
+{
+    FILE *fp = fopen(path, "wb");
+    memtrace_head head = {MEMTRACE_MAGIC, MEMTRACE_VERSION};
+
+    if (!fp) {
+        perror(path);
+        return -1;
+    }
+    fwrite(&head, sizeof(head), 1, fp);
+    for (uint32_t i = 0; i < trace->count; i++) {
+        memtrace_rec rec = {
+                .addr = (trace->ops[i].id + 1) << 3,
+                .info = MEMTRACE_INFO(trace->ops[i].op, trace->ops[i].size)
+        };
+        fwrite(&rec, sizeof(rec), 1, fp);
+    }
+    fclose(fp);
+    return 0;
+}
+
+
+/*
+ * Replay
+ */
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+static void print_latency(const char *what, uint32_t *lat, uint32_t n)
+{
+    if (!n) {
+        printf("  %-6s        -        -        -", what);
+        return;
+    }
+    qsort(lat, n, sizeof(uint32_t), cmp_u32);
+    printf("  %-6s %8u %8u %8u", what, lat[n / 2], lat[(uint32_t)((uint64_t)n * 99 / 100)], lat[n - 1]);
+}
+
+/*
+ * Footprint is the address span the allocator touched, fragmentation is the share
+ * of the current live span that is not occupied by live data.
+ */
+static void replay(const bench_backend *be, const bench_trace *trace)
+{
+    bench_live *live = calloc(trace->ids ? trace->ids : 1, sizeof(bench_live));
+    uint32_t *alloc_lat = malloc(sizeof(uint32_t) * (trace->count + 1));
+    uint32_t *free_lat = malloc(sizeof(uint32_t) * (trace->count + 1));
+    uint32_t alloc_n = 0, free_n = 0, fail = 0;
+    size_t live_bytes = 0;
+    size_t low = SIZE_MAX, high = 0;
+    uint32_t step = trace->count / FRAG_SAMPLES ? trace->count / FRAG_SAMPLES : 1;
+    double frag[FRAG_SAMPLES + 1];
+    uint32_t frag_n = 0;
+    uint64_t total = 0;
+
+    if (strcmp(be->name, "pool") == 0) {
+        PoolOps = &MemPoolOps;
+    } else if (strcmp(be->name, "bit") == 0) {
+        PoolOps = &MemBitOps;
+    }
+
+    for (uint32_t i = 0; i < trace->count; i++) {
+        const bench_op *op = &trace->ops[i];
+        bench_live *l = &live[op->id];
+        uint64_t t0, t1;
+
+        if (op->op == MEMTRACE_MALLOC) {
+            t0 = now_ns();
+            l->ptr = be->alloc(op->size, &l->cookie);
+            t1 = now_ns();
+            alloc_lat[alloc_n++] = (uint32_t)(t1 - t0);
+            total += t1 - t0;
+            if (!l->ptr) {
+                fail++;
+            } else {
+                l->size = op->size;
+                live_bytes += op->size;
+                if ((size_t)l->ptr < low) low = (size_t)l->ptr;
+                if ((size_t)l->ptr + op->size > high) high = (size_t)l->ptr + op->size;
+            }
+        } else if (l->ptr) {
+            t0 = now_ns();
+            if (be->release) {
+                be->release(l->ptr, l->cookie);
+            } else {
+                pool_release_op(l->ptr, l->cookie, l->size);
+            }
+            t1 = now_ns();
+            free_lat[free_n++] = (uint32_t)(t1 - t0);
+            total += t1 - t0;
+            live_bytes -= l->size;
+            l->ptr = NULL;
+        }
+
+        if (((i + 1) % step == 0) && (frag_n < FRAG_SAMPLES)) {
+            size_t lo = SIZE_MAX, hi = 0;
+            for (uint32_t k = 0; k < trace->ids; k++) {
+                if (live[k].ptr) {
+                    if ((size_t)live[k].ptr < lo) lo = (size_t)live[k].ptr;
+                    if ((size_t)live[k].ptr + live[k].size > hi) hi = (size_t)live[k].ptr + live[k].size;
+                }
+            }
+            frag[frag_n++] = (hi > lo) ? 1.0 - (double)live_bytes / (double)(hi - lo) : 0.0;
+        }
+    }
+
+    printf("%-5s %10.0f", be->name, total ? (double)(alloc_n + free_n) * 1e9 / (double)total : 0.0);
+    print_latency("malloc", alloc_lat, alloc_n);
+    print_latency("free", free_lat, free_n);
+    printf(" %10zu %6u\n", high > low ? (high - low) / 1024 : 0, fail);
+    printf("      frag%%:");
+    for (uint32_t k = 0; k < frag_n; k++) {
+        printf(" %.0f", frag[k] * 100.0);
+    }
+    printf("\n");
+    fflush(stdout);
+
+    free(live);
+    free(alloc_lat);
+    free(free_lat);
+}
+
+
+int main(int argc, char **argv)
+{
+    bench_trace trace;
+    const char *only = NULL;
+    const char *out = NULL;
+    uint32_t synth = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "a:g:w:")) != -1) {
+        switch (opt) {
+            case 'a': only = optarg; break;
+            case 'g': synth = (uint32_t)strtoul(optarg, NULL, 0); break;
+            case 'w': out = optarg; break;
+            default:
+                fprintf(stderr, "usage: %s [-a heap|mem|pool|bit] [-g ops [-w out]] [trace]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    if (synth) {
+        trace_synth(synth, &trace);
+        if (out && trace_write(out, &trace)) {
+            return 1;
+        }
+    } else if (optind < argc) {
+        if (trace_load(argv[optind], &trace)) {
+            return 1;
+        }
+    } else {
+        fprintf(stderr, "need a trace file or -g\n");
+        return 1;
+    }
+
+    printf("%u operations, %u allocations\n", trace.count, trace.ids);
+    printf("%-5s %10s  %-6s %8s %8s %8s  %-6s %8s %8s %8s %10s %6s\n", "alloc", "ops/s",
+           "", "p50ns", "p99ns", "maxns", "", "p50ns", "p99ns", "maxns", "peak(KB)", "fail");
+
+    for (uint32_t i = 0; i < BACKEND_COUNT; i++) {
+        pid_t pid;
+        if (only && strcmp(only, Backends[i].name) != 0) {
+            continue;
+        }
+        fflush(stdout);
+        pid = fork();
+        if (pid == 0) {
+            replay(&Backends[i], &trace);
+            _exit(0);
+        }
+        waitpid(pid, NULL, 0);
+    }
+
+    free(trace.ops);
+    return 0;
+}
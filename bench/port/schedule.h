@@ -0,0 +1,23 @@
+/*
+ * Host stand-in for the kernel schedule.h.
+ * The benchmarks under bench/ put this directory first on the include path, so the
+ * kernel and lib sources which only need the config macros build on a Linux box.
+ */
+
+#ifndef SCHEDULE_H
+#define SCHEDULE_H
+
+
+#include <stddef.h>
+#include <stdint.h>
+#include "rbtree.h"
+
+#define true    1
+#define false   0
+
+#define alignment_byte               0x07
+#define config_heap   (4*1024*1024)
+
+
+
+#endif
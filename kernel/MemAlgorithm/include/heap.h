@@ -28,10 +28,51 @@
 #include "schedule.h"
 
 
-#define PTR_SIZE uint32_t
+#define PTR_SIZE uintptr_t
 
+/*
+ * Heap regions, the static heap is region 0, more can be added with heap_add_region().
+ */
+#ifndef configHeapRegion
+#define configHeapRegion    4
+#endif
+
+//requests no bigger than this prefer fast regions, 0 turns it off
+#ifndef configHeapFastSize
+#define configHeapFastSize  64
+#endif
+
+#define HEAP_NORMAL     0x00
+#define HEAP_FAST       0x01    //region: fast RAM, malloc: prefer fast RAM
+#define HEAP_FAST_ONLY  0x02    //malloc: must be in fast RAM
+
+//1: every block remembers who allocated it, heap_walk() reports it for leak hunting
+#ifndef configHeapTag
+#define configHeapTag       0
+#endif
+
+Class(heap_stats){
+    size_t FreeBytes;
+    size_t MinFreeBytes;        //low-water mark of FreeBytes
+    size_t LargestFree;         //from the last complete heap_walk(), approximate under churn
+    uint32_t FreeBlocks;        //from the last complete heap_walk(), approximate under churn
+    uint32_t MallocCount;
+    uint32_t FreeCount;
+    uint32_t FailCount;
+};
+
+typedef void (*heap_tag_hook)(void *tag, size_t size);
+typedef void (*heap_alarm_hook)(const heap_stats *stats);
+
+int heap_add_region(void *start, size_t size, uint8_t flags);
+void *heap_malloc_tagged(size_t WantSize, uint8_t flags, void *tag);
+void *heap_malloc_flags(size_t WantSize, uint8_t flags);
 void *heap_malloc(size_t WantSize);
 void heap_free(void *xReturn);
 
+void heap_get_stats(heap_stats *stats);
+uint8_t heap_walk(uint16_t budget, heap_tag_hook hook);
+void heap_set_alarm(size_t need, heap_alarm_hook hook);
+
 
 #endif
@@ -29,14 +29,51 @@
 #define MEMALLOC_H
 
 #include <stdio.h>
+#include <stdint.h>
 
 
 #define container_of(ptr, type, member) \
     ((type *)((char *)(ptr) - offsetof(type, member)))
 
+#define MEM_NORMAL      0x00
+#define MEM_FAST        0x01    //region: fast RAM, malloc: prefer fast RAM
+#define MEM_FAST_ONLY   0x02    //malloc: must be in fast RAM
+
+//requests no bigger than this prefer fast regions, 0 turns it off
+#ifndef configMemFastSize
+#define configMemFastSize  64
+#endif
+
+//1: every block remembers who allocated it, mem_walk() reports it for leak hunting
+#ifndef configMemTag
+#define configMemTag       0
+#endif
+
+typedef struct mem_stats {
+    size_t FreeBytes;
+    size_t MinFreeBytes;        //low-water mark of FreeBytes
+    size_t LargestFree;
+    uint32_t FreeBlocks;
+    uint32_t MallocCount;
+    uint32_t FreeCount;
+    uint32_t FailCount;
+} mem_stats;
+
+typedef void (*mem_tag_hook)(void *tag, size_t size);
+typedef void (*mem_alarm_hook)(const mem_stats *stats);
+
+int mem_add_region(void *start, size_t size, uint8_t flags);
+void *mem_malloc_tagged(size_t WantSize, uint8_t flags, void *tag);
+void *mem_malloc_flags(size_t WantSize, uint8_t flags);
 void *mem_malloc(size_t WantSize);
+void *mem_aligned_alloc(size_t align, size_t WantSize);
+void *mem_realloc(void *xReturn, size_t WantSize);
 void mem_free(void *xReturn);
 
+void mem_get_stats(mem_stats *stats);
+uint8_t mem_walk(uint16_t budget, mem_tag_hook hook);
+void mem_set_alarm(size_t need, mem_alarm_hook hook);
+
 #define PTR_SIZE uint64_t
 
 #define config_heap   (43*1024*1024)
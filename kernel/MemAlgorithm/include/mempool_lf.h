@@ -0,0 +1,44 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2024 skaiui2
+
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *  https://github.com/skaiui2/SKRTOS_sparrow
+ */
+
+#ifndef MEMPOOL_LF_H
+#define MEMPOOL_LF_H
+#include "class.h"
+
+/*
+ * Fixed-size block pool which can be used in task and interrupt.
+ * Create and delete it in task, alloc and free it anywhere.
+ */
+typedef struct LfPoolHead *LfPoolHandle;
+
+LfPoolHandle lfPool_creat(uint16_t size, uint16_t amount);
+void *lfPool_alloc(LfPoolHandle ThePool);
+void lfPool_free(LfPoolHandle ThePool, void *xRet);
+uint16_t lfPool_remain(LfPoolHandle ThePool);
+void lfPool_delete(LfPoolHandle ThePool);
+
+
+
+#endif
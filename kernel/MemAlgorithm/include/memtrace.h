@@ -0,0 +1,87 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2024 skaiui2
+
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *  https://github.com/skaiui2/SKRTOS_sparrow
+ */
+
+#ifndef MEMTRACE_H
+#define MEMTRACE_H
+#include <stddef.h>
+#include <stdint.h>
+#include "class.h"
+
+/*
+ * Allocation trace, build with -DconfigMemTrace=1 to record every
+ * heap_malloc/heap_free and mem_malloc/mem_free call.
+ * The records are kept in a small buffer and handed to a sink (uart, file...)
+ * when it is full or memtrace_flush() is called.
+ */
+#ifndef configMemTrace
+#define configMemTrace      0
+#endif
+
+#ifndef configMemTraceDepth
+#define configMemTraceDepth 64
+#endif
+
+#define MEMTRACE_MAGIC      0x4352544DU    /* "MTRC" */
+#define MEMTRACE_VERSION    1U
+
+#define MEMTRACE_MALLOC     0U
+#define MEMTRACE_FREE       1U
+
+/*
+ * Trace stream: one memtrace_head, then memtrace_rec until the end.
+ * info keeps the operation in the high 2 bits and the wanted size in the low 30 bits,
+ * addr is the low 32 bits of the returned/freed address, 0 means malloc failed.
+ */
+#define MEMTRACE_INFO(op, size)     (((uint32_t)(op) << 30) | ((uint32_t)(size) & 0x3FFFFFFFU))
+#define MEMTRACE_OP(info)           ((info) >> 30)
+#define MEMTRACE_SIZE(info)         ((info) & 0x3FFFFFFFU)
+
+Class(memtrace_head)
+{
+    uint32_t magic;
+    uint32_t version;
+};
+
+Class(memtrace_rec)
+{
+    uint32_t addr;
+    uint32_t info;
+};
+
+typedef void (*memtrace_sink)(const void *buf, size_t len);
+
+#if configMemTrace
+void memtrace_set_sink(memtrace_sink sink);
+void memtrace_record(uint32_t op, void *ptr, size_t size);
+void memtrace_flush(void);
+uint32_t memtrace_dropped(void);
+
+#define MEMTRACE(op, ptr, size)     memtrace_record(op, ptr, size)
+#else
+#define MEMTRACE(op, ptr, size)
+#endif
+
+
+#endif
@@ -24,73 +24,123 @@
  */
 
 #include "heap.h"
+#include "memtrace.h"
 
 #define MIN_size     ((size_t) (HeapStructSize << 1))
 
 Class(heap_node){
         heap_node *next;
         size_t BlockSize;
+#if configHeapTag
+        void *tag;
+#endif
 };
 
+/*
+ * Every region keeps its own address ordered free list, a block never merges across regions.
+ */
 Class(xheap){
         heap_node head;
         heap_node *tail;
         size_t AllSize;
+        uint8_t *start;
+        uint8_t flags;
 };
 
-static xheap TheHeap = {
-        .tail = NULL,
-        .AllSize = config_heap,
-};
+static xheap TheHeap[configHeapRegion];
+static uint8_t HeapCount = 0;
+
+/*
+ * Counters are kept on every call, the block walk is done piece by piece in heap_walk().
+ * malloc/free between two pieces do not restart it, a free merging away the block
+ * the walk stands on moves it back to the block which took it in.
+ */
+static heap_stats HeapStats;
+
+static struct {
+    uint8_t region;
+    heap_node *node;
+    size_t largest;
+    uint32_t blocks;
+} HeapWalk;
+
+static size_t AlarmNeed;
+static heap_alarm_hook AlarmHook;
 
 static  uint8_t AllHeap[config_heap];
 static const size_t HeapStructSize = (sizeof(heap_node) + (size_t)(alignment_byte)) &~(alignment_byte);
 
 
 
-void heap_init( void )
+static int heap_region_init(xheap *heap, uint8_t *start, size_t size, uint8_t flags)
 {
     heap_node *first_node;
     PTR_SIZE start_heap ,end_heap;
     //get start address
-    start_heap =(PTR_SIZE) AllHeap;
+    start_heap =(PTR_SIZE) start;
     if( (start_heap & alignment_byte) != 0){
         start_heap += alignment_byte ;
-        start_heap &= ~alignment_byte;
-        TheHeap.AllSize -=  (size_t)(start_heap - (PTR_SIZE)AllHeap);//byte alignment means move to high address,so sub it!
+        start_heap &= ~alignment_byte;//byte alignment means move to high address
     }
-    TheHeap.head.next = (heap_node *)start_heap;
-    TheHeap.head.BlockSize = (size_t)0;
-    end_heap = start_heap + (uint32_t)TheHeap.AllSize - (uint32_t)HeapStructSize;
+    end_heap = (PTR_SIZE)start + size - HeapStructSize;
     if( (end_heap & alignment_byte) != 0){
         end_heap &= ~alignment_byte;
-        TheHeap.AllSize =  (size_t)(end_heap - start_heap );
     }
-    TheHeap.tail = (heap_node *)end_heap;
-    TheHeap.tail->BlockSize  = 0;
-    TheHeap.tail->next =NULL;
+    if ((size < HeapStructSize + MIN_size) || (end_heap < start_heap + MIN_size)) {
+        return -1;
+    }
+    heap->head.next = (heap_node *)start_heap;
+    heap->head.BlockSize = (size_t)0;
+    heap->AllSize =  (size_t)(end_heap - start_heap );//the tail node is not a free block
+    heap->start = (uint8_t *)start_heap;
+    heap->flags = flags;
+    heap->tail = (heap_node *)end_heap;
+    heap->tail->BlockSize  = 0;
+    heap->tail->next =NULL;
     first_node = (heap_node *)start_heap;
-    first_node->next = TheHeap.tail;
-    first_node->BlockSize = TheHeap.AllSize;
+    first_node->next = heap->tail;
+    first_node->BlockSize = heap->AllSize;
+    return 0;
 }
 
-void *heap_malloc(size_t WantSize)
+void heap_init( void )
+{
+    heap_region_init(&TheHeap[0], AllHeap, config_heap, HEAP_NORMAL);
+    HeapCount = 1;
+    HeapStats.FreeBytes = TheHeap[0].AllSize;
+    HeapStats.MinFreeBytes = HeapStats.FreeBytes;
+    HeapWalk.node = NULL;
+}
+
+/*
+ * The static AllHeap is always region 0, the others are searched in the order they are added.
+ */
+int heap_add_region(void *start, size_t size, uint8_t flags)
+{
+    if (HeapCount == 0) {
+        heap_init();
+    }
+    if (HeapCount == configHeapRegion) {
+        return -1;
+    }
+    if (heap_region_init(&TheHeap[HeapCount], (uint8_t *)start, size, flags & HEAP_FAST) != 0) {
+        return -1;
+    }
+    HeapStats.FreeBytes += TheHeap[HeapCount].AllSize;
+    HeapStats.MinFreeBytes += TheHeap[HeapCount].AllSize;
+    HeapCount++;
+    return 0;
+}
+
+static void *heap_region_malloc(xheap *heap, size_t WantSize, void *tag)
 {
     heap_node *prev_node;
     heap_node *use_node;
     heap_node *new_node;
-    size_t alignment_require_size;
     void *xReturn = NULL;
-    WantSize += HeapStructSize;
-    if((WantSize & alignment_byte) != 0x00) {
-        alignment_require_size = (alignment_byte + 1) - (WantSize & alignment_byte);
-        WantSize += alignment_require_size;
-    }
-    if(TheHeap.tail== NULL ) {
-        heap_init();
-    }
-    prev_node = &TheHeap.head;
-    use_node = TheHeap.head.next;
+
+    prev_node = &heap->head;
+    use_node = heap->head.next;
     while((use_node->BlockSize) < WantSize) {//check the size is fit
         prev_node = use_node;
         use_node = use_node->next;
@@ -107,29 +157,111 @@ void *heap_malloc(size_t WantSize)
         new_node->next = prev_node->next;
         prev_node->next = new_node;
     }//Finish cutting
-    TheHeap.AllSize-= use_node->BlockSize;
-    use_node->next = NULL;
+    heap->AllSize-= use_node->BlockSize;
+    HeapStats.FreeBytes -= use_node->BlockSize;
+    use_node->next = NULL;//a used block is the one whose next is NULL, heap_walk() relies on it
+#if configHeapTag
+    use_node->tag = tag;
+#else
+    (void)tag;
+#endif
     return xReturn;
 }
 
-static void InsertFreeBlock(heap_node* xInsertBlock);
+/*
+ * First pass looks at the preferred kind of region, second pass at the rest.
+ * HEAP_FAST or a small request prefers fast regions, HEAP_FAST_ONLY never falls back.
+ */
+void *heap_malloc_tagged(size_t WantSize, uint8_t flags, void *tag)
+{
+    size_t alignment_require_size;
+    void *xReturn = NULL;
+    uint8_t prefer;
+#if configMemTrace
+    size_t TraceSize = WantSize;
+#endif
+
+    if ((flags & HEAP_FAST_ONLY) || (WantSize <= configHeapFastSize)) {
+        flags |= HEAP_FAST;
+    }
+    WantSize += HeapStructSize;
+    if((WantSize & alignment_byte) != 0x00) {
+        alignment_require_size = (alignment_byte + 1) - (WantSize & alignment_byte);
+        WantSize += alignment_require_size;
+    }
+    if(HeapCount == 0) {
+        heap_init();
+    }
+
+    prefer = flags & HEAP_FAST;
+    for (uint8_t pass = 0; (pass < 2) && (xReturn == NULL); pass++) {
+        for (uint8_t i = 0; i < HeapCount; i++) {
+            if ((TheHeap[i].flags & HEAP_FAST) != prefer) {
+                continue;
+            }
+            xReturn = heap_region_malloc(&TheHeap[i], WantSize, tag);
+            if (xReturn) {
+                break;
+            }
+        }
+        if (flags & HEAP_FAST_ONLY) {
+            break;
+        }
+        prefer ^= HEAP_FAST;
+    }
+
+    if (xReturn) {
+        HeapStats.MallocCount++;
+        if (HeapStats.FreeBytes < HeapStats.MinFreeBytes) {
+            HeapStats.MinFreeBytes = HeapStats.FreeBytes;
+        }
+    } else {
+        HeapStats.FailCount++;
+        if (AlarmHook) {
+            AlarmHook(&HeapStats);
+        }
+    }
+    MEMTRACE(MEMTRACE_MALLOC, xReturn, TraceSize);
+    return xReturn;
+}
+
+//the tag is the caller's return address
+void *heap_malloc_flags(size_t WantSize, uint8_t flags)
+{
+    return heap_malloc_tagged(WantSize, flags, __builtin_return_address(0));
+}
+
+void *heap_malloc(size_t WantSize)
+{
+    return heap_malloc_tagged(WantSize, HEAP_NORMAL, __builtin_return_address(0));
+}
+
+static void InsertFreeBlock(xheap *heap, heap_node* xInsertBlock);
 void heap_free(void *xReturn)
 {
     heap_node *xlink;
     uint8_t *xFree = (uint8_t*)xReturn;
 
+    MEMTRACE(MEMTRACE_FREE, xReturn, 0);
     xFree -= HeapStructSize;//get the start address of the heap struct
     xlink = (void*)xFree;
-    TheHeap.AllSize += xlink->BlockSize;
-    InsertFreeBlock((heap_node*)xlink);
+    for (uint8_t i = 0; i < HeapCount; i++) {
+        if ((xFree >= TheHeap[i].start) && (xFree < (uint8_t *)TheHeap[i].tail)) {
+            TheHeap[i].AllSize += xlink->BlockSize;
+            HeapStats.FreeBytes += xlink->BlockSize;
+            HeapStats.FreeCount++;
+            InsertFreeBlock(&TheHeap[i], (heap_node*)xlink);
+            return;
+        }
+    }
 }
 
-static void InsertFreeBlock(heap_node* xInsertBlock)
+static void InsertFreeBlock(xheap *heap, heap_node* xInsertBlock)
 {
     heap_node *first_fit_node;
     uint8_t* getaddr;
 
-    for(first_fit_node = &TheHeap.head;first_fit_node->next < xInsertBlock;first_fit_node = first_fit_node->next)
+    for(first_fit_node = &heap->head;first_fit_node->next < xInsertBlock;first_fit_node = first_fit_node->next)
     { /*finding the fit node*/ }
 
     xInsertBlock->next = first_fit_node->next;
@@ -137,16 +269,95 @@ static void InsertFreeBlock(heap_node* xInsertBlock)
 
     getaddr = (uint8_t*)xInsertBlock;
     if((getaddr + xInsertBlock->BlockSize) == (uint8_t*)(xInsertBlock->next)) {
-        if (xInsertBlock->next != TheHeap.tail) {
+        if (xInsertBlock->next != heap->tail) {
+            if (HeapWalk.node == xInsertBlock->next) {
+                HeapWalk.node = xInsertBlock;
+            }
             xInsertBlock->BlockSize += xInsertBlock->next->BlockSize;
             xInsertBlock->next = xInsertBlock->next->next;
         } else {
-            xInsertBlock->next = TheHeap.tail;
+            xInsertBlock->next = heap->tail;
         }
     }
     getaddr = (uint8_t*)first_fit_node;
     if((getaddr + first_fit_node->BlockSize) == (uint8_t*) xInsertBlock) {
+        if (HeapWalk.node == xInsertBlock) {
+            HeapWalk.node = first_fit_node;
+        }
         first_fit_node->BlockSize += xInsertBlock->BlockSize;
         first_fit_node->next = xInsertBlock->next;
     }
 }
+
+
+void heap_get_stats(heap_stats *stats)
+{
+    *stats = HeapStats;
+}
+
+/*
+ * need is the biggest block we must always be able to get, the hook runs when
+ * a finished walk finds no free block that big, and on every failed malloc.
+ */
+void heap_set_alarm(size_t need, heap_alarm_hook hook)
+{
+    AlarmNeed = need;
+    AlarmHook = hook;
+}
+
+/*
+ * Walk the blocks in address order, at most budget blocks per call, so it can run
+ * from the idle task. Returns true when a whole pass is done and LargestFree and
+ * FreeBlocks are updated. Under malloc/free churn the pass still ends, but each
+ * block is counted as it was when passed, so the two are approximate.
+ * hook, if any, gets every used block and its tag.
+ */
+uint8_t heap_walk(uint16_t budget, heap_tag_hook hook)
+{
+    heap_node *node;
+    xheap *heap;
+
+    if (HeapCount == 0) {
+        heap_init();
+    }
+    if (HeapWalk.node == NULL) {
+        HeapWalk.region = 0;
+        HeapWalk.node = (heap_node *)TheHeap[0].start;
+        HeapWalk.largest = 0;
+        HeapWalk.blocks = 0;
+    }
+
+    node = HeapWalk.node;
+    while (budget--) {
+        heap = &TheHeap[HeapWalk.region];
+        if (node == heap->tail) {
+            if (++HeapWalk.region == HeapCount) {
+                HeapStats.LargestFree = HeapWalk.largest;
+                HeapStats.FreeBlocks = HeapWalk.blocks;
+                HeapWalk.node = NULL;
+                if (AlarmHook && (HeapWalk.largest < AlarmNeed)) {
+                    AlarmHook(&HeapStats);
+                }
+                return true;
+            }
+            node = (heap_node *)TheHeap[HeapWalk.region].start;
+            continue;
+        }
+
+        if (node->next != NULL) {
+            HeapWalk.blocks++;
+            if (node->BlockSize - HeapStructSize > HeapWalk.largest) {
+                HeapWalk.largest = node->BlockSize - HeapStructSize;
+            }
+        } else if (hook) {
+#if configHeapTag
+            hook(node->tag, node->BlockSize - HeapStructSize);
+#else
+            hook(NULL, node->BlockSize - HeapStructSize);
+#endif
+        }
+        node = (heap_node *)((uint8_t *)node + node->BlockSize);
+    }
+    HeapWalk.node = node;
+    return false;
+}
@@ -25,9 +25,11 @@
  */
 
 
+#include <string.h>
 #include "memalloc.h"
 #include "rbtree.h"
 #include "link_list.h"
+#include "memtrace.h"
 
 #define MIN_size     ((size_t) (HeapStructSize << 1))
 
@@ -37,6 +39,10 @@ Class(heap_node){
     char    used;
     #define UnUse   0
     #define Used    1
+    uint8_t fast;
+#if configMemTag
+    void    *tag;
+#endif
 };
 
 Class(xheap){
@@ -53,9 +59,24 @@ static xheap TheHeap = {
 static  uint8_t AllHeap[config_heap];
 static const size_t HeapStructSize = (sizeof(heap_node) + (size_t)(alignment_byte)) & (~alignment_byte);
 
-static rb_root MemTree;
+/*
+ * Free blocks of normal regions live in MemTree[0], those of fast regions in MemTree[1].
+ */
+static rb_root MemTree[2];
 static void InsertFreeBlock(heap_node* free_node);
 
+/*
+ * Free bytes, largest block and block count come straight from TheHeap and the trees,
+ * only the tag walk needs to visit the blocks. MemGen changes on every malloc/free.
+ */
+static mem_stats MemStats;
+static uint32_t MemGen;
+static uint32_t WalkGen;
+static struct list_node *WalkNode;
+
+static size_t AlarmNeed;
+static mem_alarm_hook AlarmHook;
+
 /*
  *
  *
@@ -65,7 +86,8 @@ void mem_init( void )
     heap_node *first_node;
     PTR_SIZE start_heap;
 
-    rb_root_init(&MemTree);
+    rb_root_init(&MemTree[0]);
+    rb_root_init(&MemTree[1]);
     list_node_init(&(TheHeap.cache_node));
 
     start_heap = (PTR_SIZE) AllHeap;
@@ -83,83 +105,356 @@ void mem_init( void )
     rb_node_init(&(first_node->iter_node));
     first_node->iter_node.value = TheHeap.AllSize;
     first_node->used = UnUse;
-    rb_Insert_node(&MemTree, &(first_node->iter_node));
+    first_node->fast = 0;
+    rb_Insert_node(&MemTree[0], &(first_node->iter_node));
+    MemStats.MinFreeBytes = TheHeap.AllSize;
 }
 
 
+/*
+ * A region is one free block followed by a used end block, so merging in mem_free()
+ * stops at the region edge. It goes to the front of the block list, the end block
+ * then also separates it from the region behind it.
+ */
+int mem_add_region(void *start, size_t size, uint8_t flags)
+{
+    heap_node *first_node;
+    heap_node *end_node;
+    PTR_SIZE start_heap, end_heap;
+
+    if(TheHeap.cache_node.prev == NULL) {
+        mem_init();
+    }
+
+    start_heap = (PTR_SIZE)start;
+    if((start_heap & alignment_byte) != 0){
+        start_heap += alignment_byte ;
+        start_heap &= ~alignment_byte;
+    }
+    end_heap = ((PTR_SIZE)start + size - HeapStructSize) & ~((PTR_SIZE)alignment_byte);
+    if ((size < HeapStructSize + MIN_size) || (end_heap < start_heap + MIN_size)) {
+        return -1;
+    }
+
+    first_node = (heap_node *)start_heap;
+    end_node = (heap_node *)end_heap;
+
+    list_node_init(&(first_node->link_node));
+    list_add_next(&(TheHeap.cache_node), &(first_node->link_node));
+    list_node_init(&(end_node->link_node));
+    list_add_next(&(first_node->link_node), &(end_node->link_node));
+
+    rb_node_init(&(end_node->iter_node));
+    end_node->iter_node.value = HeapStructSize;
+    end_node->used = Used;
+    end_node->fast = (flags & MEM_FAST) ? 1 : 0;
+
+    rb_node_init(&(first_node->iter_node));
+    first_node->iter_node.value = end_heap - start_heap;
+    first_node->used = UnUse;
+    first_node->fast = end_node->fast;
+    rb_Insert_node(&MemTree[first_node->fast], &(first_node->iter_node));
+
+    TheHeap.AllSize += first_node->iter_node.value;
+    MemStats.MinFreeBytes += first_node->iter_node.value;
+    MemGen++;
+    return 0;
+}
+
+
+/*
+ * Search the preferred kind of region first, then the other one unless MEM_FAST_ONLY.
+ */
+static rb_node *FindBlock(size_t WantSize, uint8_t flags, rb_root **tree)
+{
+    rb_node *find_node = NULL;
+    uint8_t prefer;
+
+    prefer = (flags & MEM_FAST) ? 1 : 0;
+    for (uint8_t pass = 0; pass < 2; pass++) {
+        *tree = &MemTree[prefer];
+        if (((*tree)->last_node != NULL) && ((*tree)->last_node->value >= WantSize)) {
+            find_node = rb_first_greater(*tree, WantSize);
+            if (find_node != NULL) {
+                break;
+            }
+        }
+        if (flags & MEM_FAST_ONLY) {
+            break;
+        }
+        prefer ^= 1;
+    }
+    return find_node;
+}
+
+/*
+ * Cut a used block down to WantSize, the tail goes back as a free block.
+ */
+static void SplitBlock(heap_node *use_node, size_t WantSize)
+{
+    heap_node *new_node;
+
+    if ((use_node->iter_node.value - WantSize) > MIN_size) {
+        new_node = (void *) (((uint8_t *) use_node) + WantSize);
+        new_node->fast = use_node->fast;
+        new_node->iter_node.value = use_node->iter_node.value - WantSize;
+        use_node->iter_node.value = WantSize;
+
+        list_add_next(&(use_node->link_node), &(new_node->link_node));
+        InsertFreeBlock(new_node);
+    }
+}
+
+static void MallocFail(void)
+{
+    MemStats.FailCount++;
+    if (AlarmHook) {
+        mem_get_stats(&MemStats);
+        AlarmHook(&MemStats);
+    }
+}
+
+static void MallocDone(void)
+{
+    MemGen++;
+    if (TheHeap.AllSize < MemStats.MinFreeBytes) {
+        MemStats.MinFreeBytes = TheHeap.AllSize;
+    }
+    if (AlarmHook) {
+        mem_get_stats(&MemStats);
+        if (MemStats.LargestFree < AlarmNeed) {
+            AlarmHook(&MemStats);
+        }
+    }
+}
+
+static size_t BlockSize(size_t WantSize)
+{
+    WantSize += HeapStructSize;
+    if((WantSize & alignment_byte) != 0x00) {
+        WantSize += (alignment_byte + 1) - (WantSize & alignment_byte);
+    }
+    return WantSize;
+}
+
 /*
  *
  *
  */
-void *mem_malloc(size_t WantSize)
+void *mem_malloc_tagged(size_t WantSize, uint8_t flags, void *tag)
 {
     heap_node *use_node;
-    heap_node *new_node;
     rb_node   *find_node;
-    size_t alignment_require_size;
-    size_t block_size;
+    rb_root   *tree;
     void *xReturn = NULL;
+#if configMemTrace
+    size_t TraceSize = WantSize;
+#endif
+
+    if ((flags & MEM_FAST_ONLY) || (WantSize <= configMemFastSize)) {
+        flags |= MEM_FAST;
+    }
 
     if (WantSize) {
-        WantSize += HeapStructSize;
+        WantSize = BlockSize(WantSize);
     } else {
         goto free;
     }
-    if((WantSize & alignment_byte) != 0x00) {
-        alignment_require_size = (alignment_byte + 1) - (WantSize & alignment_byte);
-        WantSize += alignment_require_size;
-    }
     if(TheHeap.cache_node.prev == NULL) {
         mem_init();
     }
 
-    if (((find_node = MemTree.last_node) == NULL)
-        || (find_node->value < WantSize)) {
-        goto free;
-    }
-    
-    find_node = rb_first_greater(&MemTree, WantSize);
+    find_node = FindBlock(WantSize, flags, &tree);
     if (find_node == NULL) {
+        MallocFail();
         goto free;
     }
-
-    block_size = find_node->value;
-    rb_remove_node(&MemTree, find_node);
+    rb_remove_node(tree, find_node);
 
     use_node = container_of(find_node, heap_node, iter_node);
     use_node->used = Used;
 
     xReturn = (void*)((uint8_t *)use_node + HeapStructSize);
 
-    if ((find_node->value - WantSize) > MIN_size) {
-        new_node = (void *) (((uint8_t *) use_node) + WantSize);
-        new_node->used = UnUse;
-        use_node->iter_node.value = WantSize;
+    SplitBlock(use_node, WantSize);
+    TheHeap.AllSize -= use_node->iter_node.value;
+#if configMemTag
+    use_node->tag = tag;
+#else
+    (void)tag;
+#endif
+    MemStats.MallocCount++;
+    MallocDone();
 
-        list_add_next(&(use_node->link_node), &(new_node->link_node));
+    free:
+    MEMTRACE(MEMTRACE_MALLOC, xReturn, TraceSize);
+    return xReturn;
+}
+
+
+//the tag is the caller's return address
+void *mem_malloc_flags(size_t WantSize, uint8_t flags)
+{
+    return mem_malloc_tagged(WantSize, flags, __builtin_return_address(0));
+}
+
+void *mem_malloc(size_t WantSize)
+{
+    return mem_malloc_tagged(WantSize, MEM_NORMAL, __builtin_return_address(0));
+}
+
+
+/*
+ * Take a block big enough for the worst padding, then the padding in front of the
+ * aligned address is split off as a free block of its own, so nothing is lost.
+ * The padding is either zero or at least MIN_size.
+ */
+void *mem_aligned_alloc(size_t align, size_t WantSize)
+{
+    heap_node *use_node;
+    heap_node *pad_node;
+    rb_node   *find_node;
+    rb_root   *tree;
+    PTR_SIZE  addr, aligned;
+    size_t    block_size;
+    void *xReturn = NULL;
+    uint8_t flags = MEM_NORMAL;
+#if configMemTrace
+    size_t TraceSize = WantSize;
+#endif
 
-        new_node->iter_node.value = block_size - WantSize;
-        rb_Insert_node(&MemTree, &(new_node->iter_node));
+    if (align & (align - 1)) {
+        return NULL;
+    }
+    if (align <= (alignment_byte + 1)) {
+        return mem_malloc_tagged(WantSize, MEM_NORMAL, __builtin_return_address(0));
+    }
+    if (WantSize <= configMemFastSize) {
+        flags |= MEM_FAST;
+    }
+
+    if (WantSize) {
+        WantSize = BlockSize(WantSize);
+    } else {
+        goto free;
+    }
+    if(TheHeap.cache_node.prev == NULL) {
+        mem_init();
+    }
+
+    find_node = FindBlock(WantSize + align + MIN_size, flags, &tree);
+    if (find_node == NULL) {
+        MallocFail();
+        goto free;
+    }
+    rb_remove_node(tree, find_node);
+
+    use_node = container_of(find_node, heap_node, iter_node);
+    block_size = find_node->value;
+
+    addr = (PTR_SIZE)use_node + HeapStructSize;
+    aligned = (addr + align - 1) & ~((PTR_SIZE)align - 1);
+    while ((aligned != addr) && ((aligned - addr) < MIN_size)) {
+        aligned += align;
+    }
+    if (aligned != addr) {
+        //the block in front of us is used, so the padding stays a block of its own
+        pad_node = use_node;
+        use_node = (heap_node *)(aligned - HeapStructSize);
+        use_node->fast = pad_node->fast;
+        use_node->iter_node.value = block_size - (aligned - addr);
+        list_add_next(&(pad_node->link_node), &(use_node->link_node));
+
+        pad_node->iter_node.value = aligned - addr;
+        rb_Insert_node(&MemTree[pad_node->fast], &(pad_node->iter_node));
     }
+    use_node->used = Used;
+
+    xReturn = (void *)aligned;
+
+    SplitBlock(use_node, WantSize);
     TheHeap.AllSize -= use_node->iter_node.value;
+#if configMemTag
+    use_node->tag = __builtin_return_address(0);
+#endif
+    MemStats.MallocCount++;
+    MallocDone();
 
     free:
+    MEMTRACE(MEMTRACE_MALLOC, xReturn, TraceSize);
     return xReturn;
 }
 
 
-void mem_free(void *xReturn)
+/*
+ * Shrink in place, grow in place when the next block is free and big enough,
+ * otherwise move. The trace sees a resize as a free plus a malloc.
+ */
+void *mem_realloc(void *xReturn, size_t WantSize)
 {
-    heap_node *free_node;
-    uint8_t *xFree = (uint8_t *)xReturn;
-    xFree -= HeapStructSize;
-    free_node = (void*)xFree;
-    free_node->used = UnUse;
-    TheHeap.AllSize += free_node->iter_node.value;
+    heap_node *use_node;
+    heap_node *adj_node;
+    struct list_node *iter_node;
+    size_t block_size;
+    size_t need;
+    void *xNew;
+
+    if (xReturn == NULL) {
+        return mem_malloc_tagged(WantSize, MEM_NORMAL, __builtin_return_address(0));
+    }
+    if (WantSize == 0) {
+        mem_free(xReturn);
+        return NULL;
+    }
+
+    use_node = (heap_node *)((uint8_t *)xReturn - HeapStructSize);
+    block_size = use_node->iter_node.value;
+    need = BlockSize(WantSize);
+
+    if (block_size < need) {
+        iter_node = use_node->link_node.next;
+        if (iter_node != &(TheHeap.cache_node)) {
+            adj_node = container_of(iter_node, heap_node, link_node);
+            if ((adj_node->used == UnUse) && (block_size + adj_node->iter_node.value >= need)) {
+                rb_remove_node(&MemTree[adj_node->fast], &(adj_node->iter_node));
+                list_remove(&(adj_node->link_node));
+                use_node->iter_node.value += adj_node->iter_node.value;
+                TheHeap.AllSize -= adj_node->iter_node.value;
+            }
+        }
+    }
+
+    if (use_node->iter_node.value >= need) {
+        MEMTRACE(MEMTRACE_FREE, xReturn, 0);
+        block_size = use_node->iter_node.value;
+        SplitBlock(use_node, need);
+        TheHeap.AllSize += block_size - use_node->iter_node.value;
+        MallocDone();
+        MEMTRACE(MEMTRACE_MALLOC, xReturn, WantSize);
+        return xReturn;
+    }
 
+    xNew = mem_malloc_tagged(WantSize, use_node->fast ? MEM_FAST : MEM_NORMAL,
+                             __builtin_return_address(0));
+    if (xNew == NULL) {
+        return NULL;
+    }
+    memcpy(xNew, xReturn, block_size - HeapStructSize);
+    mem_free(xReturn);
+    return xNew;
+}
+
+
+/*
+ * Merge with the free neighbours and put the result into its size tree.
+ */
+static void InsertFreeBlock(heap_node* free_node)
+{
     heap_node *adj_node;
     heap_node *insert_node;
     struct list_node *iter_node;
+
+    free_node->used = UnUse;
     insert_node = free_node;
 
     iter_node = free_node->link_node.next;
@@ -168,7 +463,7 @@ void mem_free(void *xReturn)
         if(adj_node->used == UnUse) {
             list_remove(&(adj_node->link_node));
             free_node->iter_node.value += adj_node->iter_node.value;
-            rb_remove_node(&MemTree, &(adj_node->iter_node));
+            rb_remove_node(&MemTree[adj_node->fast], &(adj_node->iter_node));
             insert_node = free_node;
         }
     }
@@ -179,10 +474,89 @@ void mem_free(void *xReturn)
         if(adj_node->used == UnUse) {
             list_remove(&(free_node->link_node));
             adj_node->iter_node.value += free_node->iter_node.value;
-            rb_remove_node(&MemTree, &(adj_node->iter_node));
+            rb_remove_node(&MemTree[adj_node->fast], &(adj_node->iter_node));
             insert_node = adj_node;
         }
     }
 
-    rb_Insert_node(&MemTree, &(insert_node->iter_node));
+    rb_Insert_node(&MemTree[insert_node->fast], &(insert_node->iter_node));
+}
+
+
+void mem_free(void *xReturn)
+{
+    heap_node *free_node;
+    uint8_t *xFree = (uint8_t *)xReturn;
+    MEMTRACE(MEMTRACE_FREE, xReturn, 0);
+    xFree -= HeapStructSize;
+    free_node = (void*)xFree;
+    TheHeap.AllSize += free_node->iter_node.value;
+    MemStats.FreeCount++;
+    MemGen++;
+
+    InsertFreeBlock(free_node);
+}
+
+
+/*
+ * Everything here is O(1): the biggest free block is the last node of a size tree.
+ */
+void mem_get_stats(mem_stats *stats)
+{
+    size_t largest = 0;
+
+    for (uint8_t i = 0; i < 2; i++) {
+        if (MemTree[i].last_node && (MemTree[i].last_node->value > largest)) {
+            largest = MemTree[i].last_node->value;
+        }
+    }
+    MemStats.FreeBytes = TheHeap.AllSize;
+    MemStats.LargestFree = largest ? largest - HeapStructSize : 0;
+    MemStats.FreeBlocks = MemTree[0].count + MemTree[1].count;
+    *stats = MemStats;
+}
+
+/*
+ * need is the biggest block we must always be able to get, the hook runs on the
+ * malloc which leaves no free block that big, and on every failed malloc.
+ */
+void mem_set_alarm(size_t need, mem_alarm_hook hook)
+{
+    AlarmNeed = need;
+    AlarmHook = hook;
+}
+
+/*
+ * Report every used block and its tag to hook, at most budget blocks per call.
+ * Returns true when the pass is done, a pass which sees a malloc/free starts over.
+ */
+uint8_t mem_walk(uint16_t budget, mem_tag_hook hook)
+{
+    heap_node *node;
+
+    if(TheHeap.cache_node.prev == NULL) {
+        mem_init();
+    }
+    if ((WalkNode == NULL) || (WalkGen != MemGen)) {
+        WalkGen = MemGen;
+        WalkNode = TheHeap.cache_node.next;
+    }
+
+    while (budget--) {
+        if (WalkNode == &(TheHeap.cache_node)) {
+            WalkNode = NULL;
+            return 1;
+        }
+        node = container_of(WalkNode, heap_node, link_node);
+        //skip the end block of an added region
+        if ((node->used == Used) && (node->iter_node.value > HeapStructSize) && hook) {
+#if configMemTag
+            hook(node->tag, node->iter_node.value - HeapStructSize);
+#else
+            hook(NULL, node->iter_node.value - HeapStructSize);
+#endif
+        }
+        WalkNode = WalkNode->next;
+    }
+    return 0;
 }
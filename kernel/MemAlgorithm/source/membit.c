@@ -59,7 +59,7 @@ PoolHeadHandle mempool_creat(uint16_t size,uint8_t amount)
 
     ThePool->BlockSize = size;
     ThePool->bitmask = 0;
-    ThePool->bitmask |= ((1 << amount) - 1);
+    ThePool->bitmask |= (amount >= 32) ? ~0U : ((1U << amount) - 1);
     return ThePool;
 }
 
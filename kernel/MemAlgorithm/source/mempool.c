@@ -25,6 +25,7 @@
 
 #include "mempool.h"
 #include "heap.h"
+#include "link_list.h"
 
 Class(PoolNode)
 {
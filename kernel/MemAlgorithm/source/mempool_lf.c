@@ -0,0 +1,168 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2024 skaiui2
+
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *  https://github.com/skaiui2/SKRTOS_sparrow
+ */
+
+#include "mempool_lf.h"
+#include "atomic.h"
+#include "heap.h"
+
+/*
+ * The free list is a Treiber stack, no interrupt is masked.
+ * The top word packs a tag and a block index: (tag << 16) | index.
+ * Every successful push or pop adds one to the tag, so if a block is popped and
+ * pushed back between our read and our cmpxchg, the word differs and we try again.
+ * A free block keeps the index of the next free block in its first word.
+ */
+#define LF_NIL                  0xFFFFU
+#define LF_INDEX(top)           ((uint16_t)((top) & 0xFFFFU))
+#define LF_TAG(top)             ((top) >> 16)
+#define LF_PACK(tag, index)     (((uint32_t)(tag) << 16) | (uint32_t)(index))
+
+Class(LfPoolHead)
+{
+    uint32_t top;
+    uint32_t remain;
+    size_t BlockSize;
+    uint16_t AllCount;
+};
+
+static const size_t HeadStructSize = (sizeof(LfPoolHead) + (size_t)(alignment_byte)) &~(alignment_byte);
+
+
+static inline void *lf_block(LfPoolHead *ThePool, uint16_t index)
+{
+    return (void *)((size_t)ThePool + HeadStructSize + ThePool->BlockSize * index);
+}
+
+
+LfPoolHandle lfPool_creat(uint16_t size, uint16_t amount)
+{
+    LfPoolHead *ThePool;
+    size_t apart_size = size;
+    size_t all_size;
+
+    if ((amount == 0) || (amount >= LF_NIL)) {
+        return NULL;
+    }
+    if (apart_size < sizeof(uint32_t)) {
+        apart_size = sizeof(uint32_t);
+    }
+    if (apart_size & alignment_byte) {
+        apart_size += alignment_byte;
+        apart_size &= (~alignment_byte);
+    }
+
+    all_size = apart_size * amount;
+    all_size += HeadStructSize;
+    ThePool = heap_malloc(all_size);
+    if (ThePool == NULL) {
+        return NULL;
+    }
+
+    *ThePool = (LfPoolHead){
+            .top = LF_PACK(0, 0),
+            .remain = amount,
+            .BlockSize = apart_size,
+            .AllCount = amount
+    };
+    for (uint16_t i = 0; i < amount - 1; i++) {
+        *(uint32_t *)lf_block(ThePool, i) = i + 1;
+    }
+    *(uint32_t *)lf_block(ThePool, amount - 1) = LF_NIL;
+
+    return ThePool;
+}
+
+
+void *lfPool_alloc(LfPoolHandle ThePool)
+{
+    uint32_t top;
+    uint32_t new_top;
+    uint16_t index;
+
+    if (!ThePool) {
+        return NULL;
+    }
+
+    do {
+        top = *(volatile uint32_t *)&ThePool->top;
+        index = LF_INDEX(top);
+        if (index == LF_NIL) {
+            return NULL;
+        }
+        //If the block was taken meanwhile, this word is garbage, but the tag makes cmpxchg fail.
+        new_top = LF_PACK(LF_TAG(top) + 1, LF_INDEX(*(volatile uint32_t *)lf_block(ThePool, index)));
+    } while (atomic_cmpxchg(top, new_top, &ThePool->top) != top);
+
+    atomic_dec(&ThePool->remain);
+    return lf_block(ThePool, index);
+}
+
+
+void lfPool_free(LfPoolHandle ThePool, void *xRet)
+{
+    uint32_t top;
+    uint32_t new_top;
+    size_t offset;
+    uint16_t index;
+
+    if ((!ThePool) || (!xRet)) {
+        return;
+    }
+
+    if ((size_t)xRet < (size_t)ThePool + HeadStructSize) {
+        return;
+    }
+    offset = (size_t)xRet - (size_t)ThePool - HeadStructSize;
+    //a pointer into the middle of a block would push a link on top of its neighbour's data
+    if ((offset % ThePool->BlockSize != 0) || (offset / ThePool->BlockSize >= ThePool->AllCount)) {
+        return;
+    }
+    index = (uint16_t)(offset / ThePool->BlockSize);
+
+    do {
+        top = *(volatile uint32_t *)&ThePool->top;
+        *(volatile uint32_t *)xRet = LF_INDEX(top);
+        new_top = LF_PACK(LF_TAG(top) + 1, index);
+    } while (atomic_cmpxchg(top, new_top, &ThePool->top) != top);
+
+    atomic_inc(&ThePool->remain);
+}
+
+
+uint16_t lfPool_remain(LfPoolHandle ThePool)
+{
+    if (!ThePool) {
+        return 0;
+    }
+    return (uint16_t)(*(volatile uint32_t *)&ThePool->remain);
+}
+
+
+void lfPool_delete(LfPoolHandle ThePool)
+{
+    if (ThePool) {
+        heap_free(ThePool);
+    }
+}
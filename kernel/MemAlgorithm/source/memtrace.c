@@ -0,0 +1,85 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2024 skaiui2
+
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *  https://github.com/skaiui2/SKRTOS_sparrow
+ */
+
+#include "memtrace.h"
+
+#if configMemTrace
+
+static memtrace_rec TraceBuf[configMemTraceDepth];
+static uint32_t TraceCount;
+static uint32_t TraceDrop;
+static memtrace_sink TraceSink;
+
+/*
+ * The header goes out first, so the sink sees a complete trace stream.
+ */
+void memtrace_set_sink(memtrace_sink sink)
+{
+    memtrace_head head = {
+            .magic = MEMTRACE_MAGIC,
+            .version = MEMTRACE_VERSION
+    };
+
+    TraceSink = sink;
+    TraceCount = 0;
+    TraceDrop = 0;
+    if (TraceSink) {
+        TraceSink(&head, sizeof(head));
+    }
+}
+
+void memtrace_flush(void)
+{
+    if (TraceSink && TraceCount) {
+        TraceSink(TraceBuf, TraceCount * sizeof(memtrace_rec));
+    }
+    TraceCount = 0;
+}
+
+/*
+ * No sink, no room: the record is dropped and counted, the allocator never waits for us.
+ */
+void memtrace_record(uint32_t op, void *ptr, size_t size)
+{
+    if (TraceCount == configMemTraceDepth) {
+        if (!TraceSink) {
+            TraceDrop++;
+            return;
+        }
+        memtrace_flush();
+    }
+
+    TraceBuf[TraceCount++] = (memtrace_rec){
+            .addr = (uint32_t)(size_t)ptr,
+            .info = MEMTRACE_INFO(op, size)
+    };
+}
+
+uint32_t memtrace_dropped(void)
+{
+    return TraceDrop;
+}
+
+#endif
@@ -117,6 +117,64 @@ static inline void atomic_set(uint32_t i, uint32_t *v) {
             );
 }
 
+/*
+ * Compare and swap: if *v still holds old, store new into it.
+ * The value read by ldrex is returned, so the swap succeeded only when it equals old.
+ * On mismatch clrex drops the exclusive monitor, an interrupt between ldrex and strex
+ * makes strex fail and we simply try again, so it is safe in both task and ISR.
+ * The first dmb makes earlier stores (a pushed block's link) visible before the swap,
+ * the second keeps later loads (a popped block's contents) from running ahead of it.
+ */
+static inline uint32_t atomic_cmpxchg(uint32_t old, uint32_t new, uint32_t *v) {
+    uint32_t prev, res;
+    __asm volatile (
+            "   dmb                \n"
+            "1: ldrex %0, [%2]     \n"
+            "   teq %0, %3         \n"
+            "   bne 2f             \n"
+            "   strex %1, %4, [%2] \n"
+            "   teq %1, #0         \n"
+            "   bne 1b             \n"
+            "   dmb                \n"
+            "   b 3f               \n"
+            "2: clrex              \n"
+            "3:                    \n"
+            : "=&r" (prev), "=&r" (res)
+            : "r" (v), "r" (old), "r" (new)
+            : "cc", "memory"
+            );
+    return prev;
+}
+
+/*
+ * Swap: store new into *v and return what was there. Nothing to compare, so it
+ * only loops again when an interrupt broke the exclusive access.
+ * The dmb makes earlier stores visible before new is.
+ */
+static inline uint32_t atomic_xchg(uint32_t new, uint32_t *v) {
+    uint32_t prev, res;
+    __asm volatile (
+            "   dmb                \n"
+            "1: ldrex %0, [%2]     \n"
+            "   strex %1, %3, [%2] \n"
+            "   teq %1, #0         \n"
+            "   bne 1b             \n"
+            : "=&r" (prev), "=&r" (res)
+            : "r" (v), "r" (new)
+            : "cc", "memory"
+            );
+    return prev;
+}
+
+/*
+ * atomic_xchg() for pointer slots, a pointer is one word on the targets.
+ */
+static inline void *atomic_xchg_ptr(void *new, void **v) {
+    _Static_assert(sizeof(void *) == sizeof(uint32_t), "pointers must be 32 bit");
+    return (void *)(uintptr_t)atomic_xchg((uint32_t)(uintptr_t)new, (uint32_t *)v);
+}
+
+
 
 
 
@@ -0,0 +1,90 @@
+#ifndef BPTREE_H
+#define BPTREE_H
+
+#include "class.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * B+tree of (key, item) pairs with wide nodes, an ordered index like rb_root with
+ * fewer cache misses per lookup. The tree only keeps the item pointer, so items can be
+ * the structures which embed an rb_node today, container_of() works the same way.
+ *
+ * Entries are ordered by key, then by item address, so the same key may be used by
+ * several items and bpt_remove() always finds the one asked for.
+ * Leaves are chained, bpt_next() walks them without going back up the tree.
+ */
+
+//one node, best a multiple of the cache line
+#ifndef BPT_NODE_SIZE
+#define BPT_NODE_SIZE   256
+#endif
+
+#ifndef BPT_KEY32
+#define BPT_KEY32       0
+#endif
+
+#if BPT_KEY32
+typedef uint32_t bpt_key_t;
+#else
+typedef uint64_t bpt_key_t;
+#endif
+
+#define BPT_LEAF_MAX    ((BPT_NODE_SIZE - 2 * sizeof(void *) - sizeof(uint32_t)) / (sizeof(bpt_key_t) + sizeof(void *)))
+#define BPT_INNER_MAX   ((BPT_NODE_SIZE - 2 * sizeof(uint32_t)) / (sizeof(bpt_key_t) + 2 * sizeof(void *)))
+
+//below these a node at the minimum has no sibling to merge with or borrow from
+_Static_assert(BPT_INNER_MAX >= 4, "BPT_NODE_SIZE too small for an inner node of 4 children");
+_Static_assert(BPT_LEAF_MAX >= 3, "BPT_NODE_SIZE too small for a leaf of 3 entries");
+
+Class(bpt_leaf)
+{
+    uint16_t count;
+    uint16_t leaf;
+    bpt_leaf *prev;
+    bpt_leaf *next;
+    bpt_key_t keys[BPT_LEAF_MAX];
+    void *items[BPT_LEAF_MAX];
+};
+
+//child i holds the entries from separator i - 1 up to, not including, separator i
+Class(bpt_inner)
+{
+    uint16_t count;                             //children
+    uint16_t leaf;
+    bpt_key_t keys[BPT_INNER_MAX - 1];
+    void *items[BPT_INNER_MAX - 1];
+    void *child[BPT_INNER_MAX];
+};
+
+Class(bpt_root)
+{
+    void *node;
+    bpt_leaf *first_leaf;
+    bpt_leaf *last_leaf;
+    uint32_t count;                             //entries
+    uint32_t nodes;
+    uint16_t height;                            //0: empty, 1: the root is a leaf
+};
+
+Class(bpt_iter)
+{
+    bpt_leaf *leaf;
+    uint16_t pos;
+};
+
+#define bpt_iter_key(it)    ((it)->leaf->keys[(it)->pos])
+
+void bpt_root_init(bpt_root *tree);
+void bpt_clear(bpt_root *tree);
+int bpt_insert(bpt_root *tree, bpt_key_t key, void *item);
+int bpt_remove(bpt_root *tree, bpt_key_t key, void *item);
+int bpt_bulk_load(bpt_root *tree, const bpt_key_t *keys, void * const *items, uint32_t n);
+
+void *bpt_first(bpt_root *tree, bpt_iter *it);
+void *bpt_last(bpt_root *tree, bpt_iter *it);
+void *bpt_first_greater(bpt_root *tree, bpt_key_t key, bpt_iter *it);
+void *bpt_next(bpt_iter *it);
+void *bpt_prev(bpt_iter *it);
+
+#endif
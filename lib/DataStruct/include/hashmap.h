@@ -32,10 +32,23 @@ struct hashmap_entry {
     void *value;
 };
 
+#define HASHMAP_REHASH_BUDGET   4
+
+/*
+ * With a max_load set the table doubles once it holds more than max_load entries per
+ * 100 buckets. The old table is kept and every operation moves rehash_budget of its
+ * buckets into the new one, so no single call pays for the whole rehash.
+ */
 struct hashmap {
     struct list_node *buckets;
     uword_t bucket_count;
     int key_type;
+    size_t count;
+    struct list_node *old_buckets;      //NULL: no rehash running
+    uword_t old_count;
+    uword_t rehash_idx;                 //old buckets below this are already moved
+    uint16_t max_load;                  //0: fixed size
+    uint16_t rehash_budget;             //0: only hashmap_rehash_step() moves buckets
 };
 
 void hashmap_init(struct hashmap *map, size_t bucket_count, int key_type);
@@ -43,5 +56,7 @@ void hashmap_put(struct hashmap *map, void *key, void *value);
 void *hashmap_get(struct hashmap *map, void *key);
 int hashmap_remove(struct hashmap *map, void *key);
 int hashmap_contains(struct hashmap *map, void *key);
+void hashmap_set_incremental(struct hashmap *map, uint16_t max_load, uint16_t rehash_budget);
+int hashmap_rehash_step(struct hashmap *map, uword_t budget);
 
 #endif
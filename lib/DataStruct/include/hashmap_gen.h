@@ -0,0 +1,224 @@
+#ifndef HASHMAP_GEN_H
+#define HASHMAP_GEN_H
+
+#include "class.h"
+#include "heap.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Typed open addressing hashmap generator.
+ *
+ *   HASHMAP_DEFINE(port_map, uint16_t, struct conn *, hashmap_hash_u32, HASHMAP_EQ)
+ *
+ * emits Class(port_map) and static inline port_map_init/_destroy/_put/_get/_remove/_contains.
+ * Keys and values are stored by value in one table, hash and equality are plain calls the
+ * compiler inlines into the probe loop. hash_fn(key) returns uint32_t, equal_fn(a, b) is
+ * true for the same key, it only runs once the cached hashes match.
+ * Robin Hood probing, backward shift delete, the table grows and shrinks by itself.
+ */
+
+#ifndef HASHMAP_GEN_GROW_LOAD
+#define HASHMAP_GEN_GROW_LOAD       80
+#endif
+#ifndef HASHMAP_GEN_SHRINK_LOAD
+#define HASHMAP_GEN_SHRINK_LOAD     20
+#endif
+#define HASHMAP_GEN_MIN_CAPACITY    8
+
+#define HASHMAP_EQ(a, b)        ((a) == (b))
+#define HASHMAP_STR_EQ(a, b)    (strcmp((a), (b)) == 0)
+
+static inline uint32_t hashmap_hash_u32(uint32_t key)
+{
+    key ^= key >> 16;
+    key *= 0x85ebca6bU;
+    key ^= key >> 13;
+    key *= 0xc2b2ae35U;
+    key ^= key >> 16;
+    return key;
+}
+
+static inline uint32_t hashmap_hash_u64(uint64_t key)
+{
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ULL;
+    key ^= key >> 33;
+    return (uint32_t)key;
+}
+
+static inline uint32_t hashmap_hash_ptr(const void *key)
+{
+    return hashmap_hash_u64((uint64_t)(uintptr_t)key);
+}
+
+static inline uint32_t hashmap_hash_str(const char *key)
+{
+    uint32_t h = 2166136261U;
+    while (*key)
+        h = (h ^ (unsigned char)*key++) * 16777619U;
+    return hashmap_hash_u32(h);
+}
+
+
+#define HASHMAP_DEFINE(name, key_t, value_t, hash_fn, equal_fn)                         \
+                                                                                        \
+Class(name##_entry) {                                                                   \
+    uint32_t hash;              /* 0: empty slot */                                     \
+    key_t key;                                                                          \
+    value_t value;                                                                      \
+};                                                                                      \
+                                                                                        \
+Class(name) {                                                                           \
+    name##_entry *entries;                                                              \
+    uint32_t capacity;                                                                  \
+    uint32_t count;                                                                     \
+    uint32_t min_capacity;                                                              \
+};                                                                                      \
+                                                                                        \
+static inline uint32_t name##_hash(key_t key)                                           \
+{                                                                                       \
+    uint32_t h = hash_fn(key);                                                          \
+    return h ? h : 1;                                                                   \
+}                                                                                       \
+                                                                                        \
+static inline void name##_place(name##_entry *entries, uint32_t mask, name##_entry cur) \
+{                                                                                       \
+    name##_entry tmp;                                                                   \
+    uint32_t i = cur.hash & mask;                                                       \
+    uint32_t dist = 0;                                                                  \
+                                                                                        \
+    for (;;) {                                                                          \
+        if (entries[i].hash == 0) {                                                     \
+            entries[i] = cur;                                                           \
+            return;                                                                     \
+        }                                                                               \
+        uint32_t d = (i - entries[i].hash) & mask;                                      \
+        if (d < dist) {                                                                 \
+            tmp = entries[i];                                                           \
+            entries[i] = cur;                                                           \
+            cur = tmp;                                                                  \
+            dist = d;                                                                   \
+        }                                                                               \
+        i = (i + 1) & mask;                                                             \
+        dist++;                                                                         \
+    }                                                                                   \
+}                                                                                       \
+                                                                                        \
+static inline int name##_resize(name *map, uint32_t capacity)                           \
+{                                                                                       \
+    name##_entry *old = map->entries;                                                   \
+    name##_entry *entries = heap_malloc(sizeof(name##_entry) * capacity);               \
+                                                                                        \
+    if (entries == NULL)                                                                \
+        return -1;                                                                      \
+    for (uint32_t i = 0; i < capacity; i++)                                             \
+        entries[i].hash = 0;                                                            \
+    for (uint32_t i = 0; i < map->capacity; i++) {                                      \
+        if (old[i].hash)                                                                \
+            name##_place(entries, capacity - 1, old[i]);                                \
+    }                                                                                   \
+    map->entries = entries;                                                             \
+    map->capacity = capacity;                                                           \
+    if (old)                                                                            \
+        heap_free(old);                                                                 \
+    return 0;                                                                           \
+}                                                                                       \
+                                                                                        \
+static inline int name##_init(name *map, uint32_t capacity)                             \
+{                                                                                       \
+    uint32_t cap = HASHMAP_GEN_MIN_CAPACITY;                                            \
+                                                                                        \
+    while (cap < capacity)                                                              \
+        cap <<= 1;                                                                      \
+    *map = (name) {                                                                     \
+        .entries = NULL,                                                                \
+        .capacity = 0,                                                                  \
+        .count = 0,                                                                     \
+        .min_capacity = cap,                                                            \
+    };                                                                                  \
+    return name##_resize(map, cap);                                                     \
+}                                                                                       \
+                                                                                        \
+static inline void name##_destroy(name *map)                                            \
+{                                                                                       \
+    if (map->entries)                                                                   \
+        heap_free(map->entries);                                                        \
+    map->entries = NULL;                                                                \
+    map->capacity = 0;                                                                  \
+    map->count = 0;                                                                     \
+}                                                                                       \
+                                                                                        \
+static inline int name##_find(name *map, uint32_t h, key_t key)                         \
+{                                                                                       \
+    uint32_t mask = map->capacity - 1;                                                  \
+    uint32_t i = h & mask;                                                              \
+                                                                                        \
+    for (uint32_t dist = 0; ; dist++) {                                                 \
+        name##_entry *e = &map->entries[i];                                             \
+        if (e->hash == 0 || ((i - e->hash) & mask) < dist)                              \
+            return -1;                                                                  \
+        if (e->hash == h && equal_fn(e->key, key))                                      \
+            return (int)i;                                                              \
+        i = (i + 1) & mask;                                                             \
+    }                                                                                   \
+}                                                                                       \
+                                                                                        \
+static inline int name##_put(name *map, key_t key, value_t value)                       \
+{                                                                                       \
+    uint32_t h = name##_hash(key);                                                      \
+    int i = name##_find(map, h, key);                                                   \
+                                                                                        \
+    if (i >= 0) {                                                                       \
+        map->entries[i].value = value;                                                  \
+        return 0;                                                                       \
+    }                                                                                   \
+    if ((uint64_t)(map->count + 1) * 100 > (uint64_t)map->capacity * HASHMAP_GEN_GROW_LOAD) { \
+        if (name##_resize(map, map->capacity << 1) != 0 && map->count + 1 >= map->capacity) \
+            return -1;                                                                  \
+    }                                                                                   \
+    name##_place(map->entries, map->capacity - 1,                                       \
+                 (name##_entry) { .hash = h, .key = key, .value = value });             \
+    map->count++;                                                                       \
+    return 0;                                                                           \
+}                                                                                       \
+                                                                                        \
+/* the pointer stays valid until the next put or remove */                              \
+static inline value_t *name##_get(name *map, key_t key)                                 \
+{                                                                                       \
+    int i = name##_find(map, name##_hash(key), key);                                    \
+    return (i >= 0) ? &map->entries[i].value : NULL;                                    \
+}                                                                                       \
+                                                                                        \
+static inline int name##_contains(name *map, key_t key)                                 \
+{                                                                                       \
+    return name##_find(map, name##_hash(key), key) >= 0;                                \
+}                                                                                       \
+                                                                                        \
+static inline int name##_remove(name *map, key_t key)                                   \
+{                                                                                       \
+    uint32_t mask = map->capacity - 1;                                                  \
+    int found = name##_find(map, name##_hash(key), key);                                \
+    uint32_t i, j;                                                                      \
+                                                                                        \
+    if (found < 0)                                                                      \
+        return 0;                                                                       \
+    i = (uint32_t)found;                                                                \
+    j = (i + 1) & mask;                                                                 \
+    while (map->entries[j].hash && ((j - map->entries[j].hash) & mask) != 0) {          \
+        map->entries[i] = map->entries[j];                                              \
+        i = j;                                                                          \
+        j = (j + 1) & mask;                                                             \
+    }                                                                                   \
+    map->entries[i].hash = 0;                                                           \
+    map->count--;                                                                       \
+    if (map->capacity > map->min_capacity &&                                            \
+        (uint64_t)map->count * 100 < (uint64_t)map->capacity * HASHMAP_GEN_SHRINK_LOAD) \
+        name##_resize(map, map->capacity >> 1);                                         \
+    return 1;                                                                           \
+}
+
+#endif
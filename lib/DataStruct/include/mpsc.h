@@ -0,0 +1,43 @@
+#ifndef MPSC_H
+#define MPSC_H
+
+#include "class.h"
+#include <stdint.h>
+
+/*
+ * Intrusive multi producer, single consumer queue (Vyukov).
+ * mpsc_push() is one atomic swap and one store, no loop on other producers and no
+ * interrupt masking, so tasks and ISRs can push while one task pops.
+ *
+ * A producer interrupted between its swap and its store hides what it pushed and
+ * everything after: mpsc_pop() returns NULL until that producer runs again.
+ * The consumer must not treat NULL as proof that the queue is empty, only that it
+ * has nothing to take right now, mpsc_empty() tells the two apart.
+ */
+
+Class(mpsc_node)
+{
+    mpsc_node *next;
+};
+
+Class(mpsc_queue)
+{
+    mpsc_node *head;                //last pushed, producers swap it
+    mpsc_node *tail;                //next to pop, only the consumer touches it
+    mpsc_node stub;
+};
+
+typedef void (*mpsc_fn)(mpsc_node *node, void *arg);
+
+void mpsc_init(mpsc_queue *q);
+void mpsc_push(mpsc_queue *q, mpsc_node *node);
+mpsc_node *mpsc_pop(mpsc_queue *q);
+uint32_t mpsc_drain(mpsc_queue *q, mpsc_fn fn, void *arg, uint32_t budget);
+
+//only the stub left, it goes back in when the last node is popped
+static inline int mpsc_empty(mpsc_queue *q)
+{
+    return *(mpsc_node * volatile *)&q->head == &q->stub;
+}
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef OHASHMAP_H
+#define OHASHMAP_H
+
+#include "hashmap.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Open addressing hashmap, Robin Hood probing, entries live inline in one table
+ * taken from heap_malloc(). Same key types as struct hashmap.
+ */
+
+//load factors in percent, the table doubles above grow and halves below shrink
+#ifndef OHASHMAP_GROW_LOAD
+#define OHASHMAP_GROW_LOAD      80
+#endif
+#ifndef OHASHMAP_SHRINK_LOAD
+#define OHASHMAP_SHRINK_LOAD    20
+#endif
+
+#define OHASHMAP_MIN_CAPACITY   8
+
+struct ohashmap_entry {
+    uint32_t hash;      //0: empty slot
+    void *key;
+    void *value;
+};
+
+struct ohashmap {
+    struct ohashmap_entry *entries;
+    uint32_t capacity;
+    uint32_t count;
+    uint32_t min_capacity;
+    uint8_t grow_load;
+    uint8_t shrink_load;
+    int key_type;
+};
+
+int ohashmap_init(struct ohashmap *map, size_t capacity, int key_type);
+void ohashmap_destroy(struct ohashmap *map);
+void ohashmap_set_load(struct ohashmap *map, uint8_t grow_load, uint8_t shrink_load);
+int ohashmap_put(struct ohashmap *map, void *key, void *value);
+void *ohashmap_get(struct ohashmap *map, void *key);
+int ohashmap_remove(struct ohashmap *map, void *key);
+int ohashmap_contains(struct ohashmap *map, void *key);
+
+#endif
@@ -1,6 +1,5 @@
 #ifndef RADIX_H
 #define RADIX_H
-#include "macro.h"
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -10,13 +9,38 @@
 #define BIT_LEVEL   4
 #define SIZE_LEVEL  (1 << BIT_LEVEL)
 
+//tags mark items, e.g. dirty blocks, every node keeps one bit per slot and tag
+#ifndef RADIX_TREE_MAX_TAGS
+#define RADIX_TREE_MAX_TAGS 2
+#endif
+
+//1: single-child chains are left out, a sparse key costs about one leaf
+#ifndef RADIX_TREE_SKIP
+#define RADIX_TREE_SKIP     1
+#endif
+
+//nodes come from a pool which takes this many from the heap at a time
+#ifndef RADIX_NODE_BATCH
+#define RADIX_NODE_BATCH    16
+#endif
+
+#if SIZE_LEVEL <= 16
+typedef uint16_t radix_tag_t;
+#elif SIZE_LEVEL <= 32
+typedef uint32_t radix_tag_t;
+#else
+typedef uint64_t radix_tag_t;
+#endif
+
 
 struct radix_tree_node {
     void *slots[SIZE_LEVEL];
     struct radix_tree_node *parent;
+    size_t base;                                //first index under this node
+    radix_tag_t tags[RADIX_TREE_MAX_TAGS];     //bit set: the slot or something below it is tagged
     uint8_t offset;
-    unsigned int count;
-    unsigned int height;
+    uint8_t count;
+    uint8_t height;
 };
 
 struct radix_tree_root {
@@ -27,6 +51,7 @@ struct radix_tree_root {
 
 
 void radix_tree_init(struct radix_tree_root *root);
+int radix_tree_preload(unsigned int nodes);
 void radix_tree_node_init(struct radix_tree_node *node, uint8_t height);
 int radix_tree_insert(struct radix_tree_root *root, size_t index, void *item);
 void *radix_tree_lookup(struct radix_tree_root *root, size_t index);
@@ -34,6 +59,15 @@ void *radix_tree_root_left(struct radix_tree_root *root);
 void *radix_tree_lookup_upper_bound(struct radix_tree_root *root, size_t index);
 void *radix_tree_delete(struct radix_tree_root *root, size_t index);
 
+unsigned int radix_tree_gang_lookup(struct radix_tree_root *root, void **results, size_t *indices,
+                                    size_t first_index, unsigned int max_items);
+unsigned int radix_tree_gang_lookup_tag(struct radix_tree_root *root, void **results, size_t *indices,
+                                        size_t first_index, unsigned int max_items, unsigned int tag);
+void *radix_tree_tag_set(struct radix_tree_root *root, size_t index, unsigned int tag);
+void *radix_tree_tag_clear(struct radix_tree_root *root, size_t index, unsigned int tag);
+int radix_tree_tag_get(struct radix_tree_root *root, size_t index, unsigned int tag);
+int radix_tree_tagged(struct radix_tree_root *root, unsigned int tag);
+
 
 
 
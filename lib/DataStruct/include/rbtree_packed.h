@@ -0,0 +1,88 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2024 skaiui2
+
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *  https://github.com/skaiui2/SKRTOS_sparrow
+ */
+
+#ifndef RBTREE_PACKED_H
+#define RBTREE_PACKED_H
+#include "class.h"
+
+/*
+ * rb_node without the root back-pointer and with the colour kept in bit 0 of the
+ * parent pointer: parent, left, right and the key, 16 bytes on a 32-bit MCU with
+ * RBP_KEY32 instead of 32. Nodes must be at least 2-byte aligned.
+ *
+ * RBP_KEY32: 32-bit keys compared wrap-aware (compare.h), for tick deadlines which
+ * stay within half the number range of each other. Otherwise plain 64-bit keys.
+ */
+#ifndef RBP_KEY32
+#define RBP_KEY32   0
+#endif
+
+#if RBP_KEY32
+#include "compare.h"
+typedef uint32_t rbp_key_t;
+#define RBP_BEFORE(a, b)    compare_before((a), (b))
+#else
+typedef uint64_t rbp_key_t;
+#define RBP_BEFORE(a, b)    ((a) < (b))
+#endif
+
+#define RBP_RED     0
+#define RBP_BLACK   1
+
+Class(rbp_node)
+{
+    uintptr_t rb_parent_color;
+    rbp_node *rb_right;
+    rbp_node *rb_left;
+    rbp_key_t value;
+};
+
+Class(rbp_root)
+{
+    rbp_node *rb_node;
+    rbp_node *first_node;
+    rbp_node *last_node;
+    uint32_t count;
+};
+
+#define rbp_parent(n)       ((rbp_node *)((n)->rb_parent_color & ~(uintptr_t)1))
+#define rbp_color(n)        ((n)->rb_parent_color & 1)
+
+//a node which is in no tree points at itself, rbp_node_init() and rbp_remove_node() do that
+#define rbp_node_linked(n)  ((n)->rb_parent_color != (uintptr_t)(n))
+
+void rbp_root_init(rbp_root *root);
+void rbp_node_init(rbp_node *node);
+void rbp_insert_node(rbp_root *root, rbp_node *new_node);
+void rbp_remove_node(rbp_root *root, rbp_node *node);
+
+rbp_node *rbp_first(rbp_root *root);
+rbp_node *rbp_last(rbp_root *root);
+rbp_node *rbp_next(rbp_node *node);
+rbp_node *rbp_prev(rbp_node *node);
+rbp_node *rbp_first_greater(rbp_root *root, rbp_key_t key);
+
+
+#endif
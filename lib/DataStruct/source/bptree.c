@@ -0,0 +1,615 @@
+#include "bptree.h"
+#include "heap.h"
+#include <string.h>
+
+_Static_assert(sizeof(bpt_leaf) <= BPT_NODE_SIZE, "bpt_leaf larger than BPT_NODE_SIZE");
+_Static_assert(sizeof(bpt_inner) <= BPT_NODE_SIZE, "bpt_inner larger than BPT_NODE_SIZE");
+
+#define BPT_LEAF_MIN    (BPT_LEAF_MAX / 2)
+#define BPT_INNER_MIN   (BPT_INNER_MAX / 2)
+#define BPT_MAX_DEPTH   16
+
+static inline int bpt_less(bpt_key_t ka, void *ia, bpt_key_t kb, void *ib)
+{
+    return (ka < kb) || (ka == kb && (uintptr_t)ia < (uintptr_t)ib);
+}
+
+//child of n which holds (key, item): the number of separators not after it
+static inline uint16_t bpt_inner_slot(bpt_inner *n, bpt_key_t key, void *item)
+{
+    uint16_t lo = 0, hi = n->count - 1;
+
+    while (lo < hi) {
+        uint16_t mid = (lo + hi) >> 1;
+        if (bpt_less(key, item, n->keys[mid], n->items[mid])) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    return lo;
+}
+
+//number of entries of n before (key, item)
+static inline uint16_t bpt_leaf_pos(bpt_leaf *n, bpt_key_t key, void *item)
+{
+    uint16_t lo = 0, hi = n->count;
+
+    while (lo < hi) {
+        uint16_t mid = (lo + hi) >> 1;
+        if (bpt_less(n->keys[mid], n->items[mid], key, item)) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static void *bpt_alloc(bpt_root *tree, uint16_t leaf)
+{
+    bpt_leaf *node = heap_malloc(leaf ? sizeof(bpt_leaf) : sizeof(bpt_inner));
+
+    if (node == NULL) {
+        return NULL;
+    }
+    node->count = 0;
+    node->leaf = leaf;
+    tree->nodes++;
+    return node;
+}
+
+static void bpt_free(bpt_root *tree, void *node)
+{
+    heap_free(node);
+    tree->nodes--;
+}
+
+void bpt_root_init(bpt_root *tree)
+{
+    *tree = (bpt_root){
+        .node = NULL,
+        .first_leaf = NULL,
+        .last_leaf = NULL,
+        .count = 0,
+        .nodes = 0,
+        .height = 0
+    };
+}
+
+static void bpt_free_subtree(bpt_root *tree, void *node, uint16_t height)
+{
+    if (height > 1) {
+        bpt_inner *inner = node;
+        for (uint16_t i = 0; i < inner->count; i++) {
+            bpt_free_subtree(tree, inner->child[i], height - 1);
+        }
+    }
+    bpt_free(tree, node);
+}
+
+void bpt_clear(bpt_root *tree)
+{
+    if (tree->node) {
+        bpt_free_subtree(tree, tree->node, tree->height);
+    }
+    bpt_root_init(tree);
+}
+
+
+static void bpt_leaf_put(bpt_leaf *leaf, uint16_t pos, bpt_key_t key, void *item)
+{
+    memmove(&leaf->keys[pos + 1], &leaf->keys[pos], (leaf->count - pos) * sizeof(bpt_key_t));
+    memmove(&leaf->items[pos + 1], &leaf->items[pos], (leaf->count - pos) * sizeof(void *));
+    leaf->keys[pos] = key;
+    leaf->items[pos] = item;
+    leaf->count++;
+}
+
+static void bpt_leaf_cut(bpt_leaf *leaf, uint16_t pos)
+{
+    leaf->count--;
+    memmove(&leaf->keys[pos], &leaf->keys[pos + 1], (leaf->count - pos) * sizeof(bpt_key_t));
+    memmove(&leaf->items[pos], &leaf->items[pos + 1], (leaf->count - pos) * sizeof(void *));
+}
+
+/*
+ * Split a full leaf while putting (key, item) at pos, the upper half goes to right.
+ */
+static void bpt_leaf_split(bpt_root *tree, bpt_leaf *leaf, bpt_leaf *right,
+                           uint16_t pos, bpt_key_t key, void *item)
+{
+    uint16_t keep = (BPT_LEAF_MAX + 1) / 2;
+    uint16_t from = (pos < keep) ? keep - 1 : keep;
+
+    right->count = BPT_LEAF_MAX - from;
+    memcpy(right->keys, &leaf->keys[from], right->count * sizeof(bpt_key_t));
+    memcpy(right->items, &leaf->items[from], right->count * sizeof(void *));
+    leaf->count = from;
+    if (pos < keep) {
+        bpt_leaf_put(leaf, pos, key, item);
+    } else {
+        bpt_leaf_put(right, pos - keep, key, item);
+    }
+
+    right->prev = leaf;
+    right->next = leaf->next;
+    if (leaf->next) {
+        leaf->next->prev = right;
+    } else {
+        tree->last_leaf = right;
+    }
+    leaf->next = right;
+}
+
+/*
+ * Put separator (key, item) at i and child right at i + 1. A full node is split,
+ * right then gets the upper half and (key, item) becomes what goes one level up.
+ */
+static void bpt_inner_put(bpt_inner *node, bpt_inner *right, uint16_t i,
+                          bpt_key_t *key, void **item, void **child)
+{
+    bpt_key_t tk[BPT_INNER_MAX];
+    void *ti[BPT_INNER_MAX];
+    void *tc[BPT_INNER_MAX + 1];
+    uint16_t seps = node->count - 1;
+    uint16_t keep;
+
+    if (node->count < BPT_INNER_MAX) {
+        memmove(&node->keys[i + 1], &node->keys[i], (seps - i) * sizeof(bpt_key_t));
+        memmove(&node->items[i + 1], &node->items[i], (seps - i) * sizeof(void *));
+        memmove(&node->child[i + 2], &node->child[i + 1], (node->count - i - 1) * sizeof(void *));
+        node->keys[i] = *key;
+        node->items[i] = *item;
+        node->child[i + 1] = *child;
+        node->count++;
+        return;
+    }
+
+    memcpy(tk, node->keys, i * sizeof(bpt_key_t));
+    memcpy(ti, node->items, i * sizeof(void *));
+    tk[i] = *key;
+    ti[i] = *item;
+    memcpy(&tk[i + 1], &node->keys[i], (seps - i) * sizeof(bpt_key_t));
+    memcpy(&ti[i + 1], &node->items[i], (seps - i) * sizeof(void *));
+    memcpy(tc, node->child, (i + 1) * sizeof(void *));
+    tc[i + 1] = *child;
+    memcpy(&tc[i + 2], &node->child[i + 1], (node->count - i - 1) * sizeof(void *));
+
+    //keep children [0, keep), tk[keep - 1] moves up, the rest goes right
+    keep = (BPT_INNER_MAX + 1) / 2;
+    node->count = keep;
+    memcpy(node->keys, tk, (keep - 1) * sizeof(bpt_key_t));
+    memcpy(node->items, ti, (keep - 1) * sizeof(void *));
+    memcpy(node->child, tc, keep * sizeof(void *));
+
+    right->count = BPT_INNER_MAX + 1 - keep;
+    memcpy(right->keys, &tk[keep], (right->count - 1) * sizeof(bpt_key_t));
+    memcpy(right->items, &ti[keep], (right->count - 1) * sizeof(void *));
+    memcpy(right->child, &tc[keep], right->count * sizeof(void *));
+
+    *key = tk[keep - 1];
+    *item = ti[keep - 1];
+    *child = right;
+}
+
+/*
+ * All nodes a split needs are taken before anything changes, so a failed
+ * heap_malloc() leaves the tree as it was. Returns -1 for that or when the
+ * pair is already in the tree.
+ */
+int bpt_insert(bpt_root *tree, bpt_key_t key, void *item)
+{
+    bpt_inner *path[BPT_MAX_DEPTH];
+    uint16_t slot[BPT_MAX_DEPTH];
+    void *spare[BPT_MAX_DEPTH + 1];
+    uint16_t need = 0;
+    bpt_leaf *leaf;
+    void *node;
+    void *child;
+    uint16_t pos;
+    int d;
+
+    if (tree->node == NULL) {
+        leaf = bpt_alloc(tree, 1);
+        if (leaf == NULL) {
+            return -1;
+        }
+        leaf->prev = leaf->next = NULL;
+        tree->node = leaf;
+        tree->first_leaf = tree->last_leaf = leaf;
+        tree->height = 1;
+    }
+
+    node = tree->node;
+    for (d = 0; d < tree->height - 1; d++) {
+        path[d] = node;
+        slot[d] = bpt_inner_slot(node, key, item);
+        node = path[d]->child[slot[d]];
+    }
+    leaf = node;
+    pos = bpt_leaf_pos(leaf, key, item);
+    if (pos < leaf->count && leaf->keys[pos] == key && leaf->items[pos] == item) {
+        return -1;
+    }
+
+    if (leaf->count < BPT_LEAF_MAX) {
+        bpt_leaf_put(leaf, pos, key, item);
+        tree->count++;
+        return 0;
+    }
+
+    need = 1;
+    for (d = tree->height - 2; d >= 0 && path[d]->count == BPT_INNER_MAX; d--) {
+        need++;
+    }
+    if (d < 0) {
+        need++;
+    }
+    for (uint16_t i = 0; i < need; i++) {
+        spare[i] = bpt_alloc(tree, i == 0);
+        if (spare[i] == NULL) {
+            while (i--) {
+                bpt_free(tree, spare[i]);
+            }
+            return -1;
+        }
+    }
+
+    bpt_leaf_split(tree, leaf, spare[0], pos, key, item);
+    tree->count++;
+
+    child = spare[0];
+    key = ((bpt_leaf *)child)->keys[0];
+    item = ((bpt_leaf *)child)->items[0];
+    need = 1;
+    for (d = tree->height - 2; d >= 0; d--) {
+        uint16_t full = (path[d]->count == BPT_INNER_MAX);
+        bpt_inner_put(path[d], full ? spare[need] : NULL, slot[d], &key, &item, &child);
+        if (!full) {
+            return 0;
+        }
+        need++;
+    }
+
+    //the root was split too
+    bpt_inner *root = spare[need];
+    root->count = 2;
+    root->keys[0] = key;
+    root->items[0] = item;
+    root->child[0] = tree->node;
+    root->child[1] = child;
+    tree->node = root;
+    tree->height++;
+    return 0;
+}
+
+
+/*
+ * node at slot i of parent fell under half full: take one entry from a sibling,
+ * or merge with it when both fit in one node. Returns 1 when parent lost a child.
+ */
+static int bpt_rebalance(bpt_root *tree, bpt_inner *parent, uint16_t i, uint16_t is_leaf)
+{
+    uint16_t k = (i > 0) ? i - 1 : 0;           //separator between left and right
+    void *left = parent->child[k];
+    void *right = parent->child[k + 1];
+
+    if (is_leaf) {
+        bpt_leaf *l = left, *r = right;
+
+        if (l->count + r->count <= BPT_LEAF_MAX) {
+            memcpy(&l->keys[l->count], r->keys, r->count * sizeof(bpt_key_t));
+            memcpy(&l->items[l->count], r->items, r->count * sizeof(void *));
+            l->count += r->count;
+            l->next = r->next;
+            if (r->next) {
+                r->next->prev = l;
+            } else {
+                tree->last_leaf = l;
+            }
+            bpt_free(tree, r);
+            goto drop;
+        }
+        if (i > 0) {
+            bpt_leaf_put(r, 0, l->keys[l->count - 1], l->items[l->count - 1]);
+            l->count--;
+        } else {
+            bpt_leaf_put(l, l->count, r->keys[0], r->items[0]);
+            bpt_leaf_cut(r, 0);
+        }
+        parent->keys[k] = r->keys[0];
+        parent->items[k] = r->items[0];
+        return 0;
+    } else {
+        bpt_inner *l = left, *r = right;
+
+        if (l->count + r->count <= BPT_INNER_MAX) {
+            l->keys[l->count - 1] = parent->keys[k];
+            l->items[l->count - 1] = parent->items[k];
+            memcpy(&l->keys[l->count], r->keys, (r->count - 1) * sizeof(bpt_key_t));
+            memcpy(&l->items[l->count], r->items, (r->count - 1) * sizeof(void *));
+            memcpy(&l->child[l->count], r->child, r->count * sizeof(void *));
+            l->count += r->count;
+            bpt_free(tree, r);
+            goto drop;
+        }
+        if (i > 0) {
+            //the last child of left moves over, the separators rotate through parent
+            memmove(&r->keys[1], r->keys, (r->count - 1) * sizeof(bpt_key_t));
+            memmove(&r->items[1], r->items, (r->count - 1) * sizeof(void *));
+            memmove(&r->child[1], r->child, r->count * sizeof(void *));
+            r->keys[0] = parent->keys[k];
+            r->items[0] = parent->items[k];
+            r->child[0] = l->child[l->count - 1];
+            r->count++;
+            parent->keys[k] = l->keys[l->count - 2];
+            parent->items[k] = l->items[l->count - 2];
+            l->count--;
+        } else {
+            l->keys[l->count - 1] = parent->keys[k];
+            l->items[l->count - 1] = parent->items[k];
+            l->child[l->count] = r->child[0];
+            l->count++;
+            parent->keys[k] = r->keys[0];
+            parent->items[k] = r->items[0];
+            memmove(r->keys, &r->keys[1], (r->count - 2) * sizeof(bpt_key_t));
+            memmove(r->items, &r->items[1], (r->count - 2) * sizeof(void *));
+            memmove(r->child, &r->child[1], (r->count - 1) * sizeof(void *));
+            r->count--;
+        }
+        return 0;
+    }
+
+    drop:
+    //right was the last child when k + 2 == count, nothing after it to move
+    if (parent->count > k + 2) {
+        memmove(&parent->keys[k], &parent->keys[k + 1], (parent->count - k - 2) * sizeof(bpt_key_t));
+        memmove(&parent->items[k], &parent->items[k + 1], (parent->count - k - 2) * sizeof(void *));
+        memmove(&parent->child[k + 1], &parent->child[k + 2], (parent->count - k - 2) * sizeof(void *));
+    }
+    parent->count--;
+    return 1;
+}
+
+int bpt_remove(bpt_root *tree, bpt_key_t key, void *item)
+{
+    bpt_inner *path[BPT_MAX_DEPTH];
+    uint16_t slot[BPT_MAX_DEPTH];
+    bpt_leaf *leaf;
+    void *node = tree->node;
+    uint16_t pos;
+    int d;
+
+    if (node == NULL) {
+        return -1;
+    }
+    for (d = 0; d < tree->height - 1; d++) {
+        path[d] = node;
+        slot[d] = bpt_inner_slot(node, key, item);
+        node = path[d]->child[slot[d]];
+    }
+    leaf = node;
+    pos = bpt_leaf_pos(leaf, key, item);
+    if (pos == leaf->count || leaf->keys[pos] != key || leaf->items[pos] != item) {
+        return -1;
+    }
+    bpt_leaf_cut(leaf, pos);
+    tree->count--;
+
+    if (leaf->count < BPT_LEAF_MIN && tree->height > 1) {
+        d = tree->height - 2;
+        if (bpt_rebalance(tree, path[d], slot[d], 1)) {
+            for (d--; d >= 0 && path[d + 1]->count < BPT_INNER_MIN; d--) {
+                if (!bpt_rebalance(tree, path[d], slot[d], 0)) {
+                    break;
+                }
+            }
+        }
+    }
+
+    node = tree->node;
+    if (tree->height > 1 && ((bpt_inner *)node)->count == 1) {
+        tree->node = ((bpt_inner *)node)->child[0];
+        tree->height--;
+        bpt_free(tree, node);
+    } else if (tree->height == 1 && ((bpt_leaf *)node)->count == 0) {
+        bpt_free(tree, node);
+        bpt_root_init(tree);
+    }
+    return 0;
+}
+
+
+/*
+ * keys/items sorted by key, then by item address, the tree must be empty.
+ * Every level is spread evenly over as few nodes as fit, so each is at least half full.
+ */
+int bpt_bulk_load(bpt_root *tree, const bpt_key_t *keys, void * const *items, uint32_t n)
+{
+    void **level;
+    uint32_t count, nodes, per, extra, at = 0, i;
+    uint16_t height = 1;
+
+    if (tree->node != NULL) {
+        return -1;
+    }
+    for (i = 1; i < n; i++) {
+        if (!bpt_less(keys[i - 1], items[i - 1], keys[i], items[i])) {
+            return -1;
+        }
+    }
+    if (n == 0) {
+        return 0;
+    }
+
+    nodes = (n + BPT_LEAF_MAX - 1) / BPT_LEAF_MAX;
+    level = heap_malloc(nodes * sizeof(void *));
+    if (level == NULL) {
+        return -1;
+    }
+
+    per = n / nodes;
+    extra = n % nodes;
+    for (i = 0; i < nodes; i++) {
+        bpt_leaf *leaf = bpt_alloc(tree, 1);
+        if (leaf == NULL) {
+            while (i--) {
+                bpt_free(tree, level[i]);
+            }
+            heap_free(level);
+            return -1;
+        }
+        leaf->count = per + (i < extra);
+        memcpy(leaf->keys, &keys[at], leaf->count * sizeof(bpt_key_t));
+        memcpy(leaf->items, &items[at], leaf->count * sizeof(void *));
+        at += leaf->count;
+        leaf->prev = i ? level[i - 1] : NULL;
+        leaf->next = NULL;
+        if (i) {
+            ((bpt_leaf *)level[i - 1])->next = leaf;
+        }
+        level[i] = leaf;
+    }
+    tree->first_leaf = level[0];
+    tree->last_leaf = level[nodes - 1];
+
+    //the parents of a level overwrite it from the front, they never pass the reader
+    for (count = nodes; count > 1; count = nodes) {
+        nodes = (count + BPT_INNER_MAX - 1) / BPT_INNER_MAX;
+        per = count / nodes;
+        extra = count % nodes;
+        at = 0;
+        for (i = 0; i < nodes; i++) {
+            bpt_inner *inner = bpt_alloc(tree, 0);
+            if (inner == NULL) {
+                goto fail;
+            }
+            inner->count = per + (i < extra);
+            for (uint16_t c = 0; c < inner->count; c++) {
+                void *child = level[at++];
+                inner->child[c] = child;
+                if (c) {
+                    //the separator is the first entry under the child
+                    for (uint16_t h = height; h > 1; h--) {
+                        child = ((bpt_inner *)child)->child[0];
+                    }
+                    inner->keys[c - 1] = ((bpt_leaf *)child)->keys[0];
+                    inner->items[c - 1] = ((bpt_leaf *)child)->items[0];
+                }
+            }
+            level[i] = inner;
+        }
+        height++;
+    }
+    tree->node = level[0];
+    tree->height = height;
+    tree->count = n;
+    heap_free(level);
+    return 0;
+
+    fail:
+    //level holds the new parents [0, i) and the children not taken yet [at, count)
+    while (i--) {
+        bpt_free_subtree(tree, level[i], height + 1);
+    }
+    while (at < count) {
+        bpt_free_subtree(tree, level[at++], height);
+    }
+    heap_free(level);
+    bpt_root_init(tree);
+    return -1;
+}
+
+
+void *bpt_first(bpt_root *tree, bpt_iter *it)
+{
+    it->leaf = tree->first_leaf;
+    it->pos = 0;
+    return it->leaf ? it->leaf->items[0] : NULL;
+}
+
+void *bpt_last(bpt_root *tree, bpt_iter *it)
+{
+    it->leaf = tree->last_leaf;
+    it->pos = it->leaf ? it->leaf->count - 1 : 0;
+    return it->leaf ? it->leaf->items[it->pos] : NULL;
+}
+
+/*
+ * First entry whose key is greater than key, like rb_first_greater().
+ */
+void *bpt_first_greater(bpt_root *tree, bpt_key_t key, bpt_iter *it)
+{
+    void *node = tree->node;
+    bpt_leaf *leaf;
+    uint16_t lo, hi;
+
+    it->leaf = NULL;
+    if (node == NULL) {
+        return NULL;
+    }
+    for (uint16_t d = 1; d < tree->height; d++) {
+        bpt_inner *inner = node;
+        lo = 0;
+        hi = inner->count - 1;
+        while (lo < hi) {
+            uint16_t mid = (lo + hi) >> 1;
+            if (key < inner->keys[mid]) {
+                hi = mid;
+            } else {
+                lo = mid + 1;
+            }
+        }
+        node = inner->child[lo];
+    }
+
+    leaf = node;
+    lo = 0;
+    hi = leaf->count;
+    while (lo < hi) {
+        uint16_t mid = (lo + hi) >> 1;
+        if (key < leaf->keys[mid]) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    if (lo == leaf->count) {
+        leaf = leaf->next;
+        lo = 0;
+    }
+    it->leaf = leaf;
+    it->pos = lo;
+    return leaf ? leaf->items[lo] : NULL;
+}
+
+void *bpt_next(bpt_iter *it)
+{
+    if (it->leaf == NULL) {
+        return NULL;
+    }
+    if (++it->pos == it->leaf->count) {
+        it->leaf = it->leaf->next;
+        it->pos = 0;
+        if (it->leaf == NULL) {
+            return NULL;
+        }
+    }
+    return it->leaf->items[it->pos];
+}
+
+void *bpt_prev(bpt_iter *it)
+{
+    if (it->leaf == NULL) {
+        return NULL;
+    }
+    if (it->pos == 0) {
+        it->leaf = it->leaf->prev;
+        if (it->leaf == NULL) {
+            return NULL;
+        }
+        it->pos = it->leaf->count;
+    }
+    return it->leaf->items[--it->pos];
+}
@@ -22,7 +22,8 @@ static uword_t hashmap_hash(struct hashmap *map, void *key)
             uword_t h = 0;
             while (*s)
                 h = h * GOLDEN_RATIO_PRIME + (unsigned char)(*s++);
-            return h;
+            //the low bits only see the low bits of each char, fold the mixed high half in
+            return h ^ (h >> (PLATFORM_BITS / 2));
         }
         case HASHMAP_KEY_INT:
         case HASHMAP_KEY_PTR:
@@ -50,76 +51,156 @@ void hashmap_init(struct hashmap *map, size_t bucket_count, int key_type)
     uword_t count = next_power_of_two((uword_t)bucket_count);
     map->bucket_count = count;
     map->key_type = key_type;
+    map->count = 0;
+    map->old_buckets = NULL;
+    map->old_count = 0;
+    map->rehash_idx = 0;
+    map->max_load = 0;
+    map->rehash_budget = HASHMAP_REHASH_BUDGET;
 
     map->buckets = malloc(sizeof(struct list_node) * count);
     for (uword_t i = 0; i < count; i++)
         list_node_init(&map->buckets[i]);
 }
 
-static struct list_node *hashmap_bucket(struct hashmap *map, void *key)
+void hashmap_set_incremental(struct hashmap *map, uint16_t max_load, uint16_t rehash_budget)
 {
-    uword_t h = hashmap_hash(map, key);
+    map->max_load = max_load;
+    map->rehash_budget = rehash_budget;
+}
+
+/*
+ * Old bucket i splits into new buckets i and i + old_count, those two are only set up
+ * when bucket i moves. Until then its keys, new ones included, stay in the old table,
+ * so starting a rehash costs one malloc and nothing else.
+ */
+static struct list_node *hashmap_bucket(struct hashmap *map, uword_t h)
+{
+    if (map->old_buckets != NULL) {
+        uword_t idx = h & (map->old_count - 1);
+        if (idx >= map->rehash_idx)
+            return &map->old_buckets[idx];
+    }
     return &map->buckets[h & (map->bucket_count - 1)];
 }
 
-void hashmap_put(struct hashmap *map, void *key, void *value)
+/*
+ * Move up to budget old buckets into the new table, returns 1 once no rehash is left.
+ */
+int hashmap_rehash_step(struct hashmap *map, uword_t budget)
 {
-    struct list_node *bucket = hashmap_bucket(map, key);
-    struct list_node *p;
+    if (map->old_buckets == NULL)
+        return 1;
 
-    for (p = bucket->next; p != bucket; p = p->next) {
-        struct hashmap_entry *e = container_of(p, struct hashmap_entry, node);
-        if (hashmap_key_equal(map, e->key, key)) {
-            e->value = value;
-            return;
+    while (budget-- && map->rehash_idx < map->old_count) {
+        struct list_node *old = &map->old_buckets[map->rehash_idx];
+        list_node_init(&map->buckets[map->rehash_idx]);
+        list_node_init(&map->buckets[map->rehash_idx + map->old_count]);
+        map->rehash_idx++;
+
+        while (old->next != old) {
+            struct list_node *p = old->next;
+            struct hashmap_entry *e = container_of(p, struct hashmap_entry, node);
+            uword_t h = hashmap_hash(map, e->key);
+            list_remove(p);
+            list_add_next(&map->buckets[h & (map->bucket_count - 1)], p);
         }
     }
 
-    struct hashmap_entry *entry = malloc(sizeof(struct hashmap_entry));
-    entry->key = key;
-    entry->value = value;
-    list_node_init(&entry->node);
-    list_add_next(bucket, &entry->node);
+    if (map->rehash_idx < map->old_count)
+        return 0;
+    free(map->old_buckets);
+    map->old_buckets = NULL;
+    map->old_count = 0;
+    return 1;
 }
 
-void *hashmap_get(struct hashmap *map, void *key)
+/*
+ * A new table only starts once the last one is fully moved, a failed malloc keeps the old size.
+ */
+static void hashmap_grow(struct hashmap *map)
+{
+    struct list_node *buckets;
+
+    if (map->max_load == 0 || map->old_buckets != NULL ||
+        map->count * 100 <= (size_t)map->bucket_count * map->max_load)
+        return;
+
+    buckets = malloc(sizeof(struct list_node) * (map->bucket_count << 1));
+    if (buckets == NULL)
+        return;
+
+    map->old_buckets = map->buckets;
+    map->old_count = map->bucket_count;
+    map->rehash_idx = 0;
+    map->buckets = buckets;
+    map->bucket_count <<= 1;
+}
+
+static struct hashmap_entry *hashmap_find(struct hashmap *map, void *key, uword_t h)
 {
-    struct list_node *bucket = hashmap_bucket(map, key);
+    struct list_node *bucket = hashmap_bucket(map, h);
     struct list_node *p;
 
     for (p = bucket->next; p != bucket; p = p->next) {
         struct hashmap_entry *e = container_of(p, struct hashmap_entry, node);
         if (hashmap_key_equal(map, e->key, key))
-            return e->value;
+            return e;
     }
     return NULL;
 }
 
-int hashmap_remove(struct hashmap *map, void *key)
+void hashmap_put(struct hashmap *map, void *key, void *value)
 {
-    struct list_node *bucket = hashmap_bucket(map, key);
-    struct list_node *p;
+    uword_t h = hashmap_hash(map, key);
+    struct hashmap_entry *entry;
 
-    for (p = bucket->next; p != bucket; p = p->next) {
-        struct hashmap_entry *e = container_of(p, struct hashmap_entry, node);
-        if (hashmap_key_equal(map, e->key, key)) {
-            list_remove(&e->node);
-            free(e);
-            return 1;
-        }
+    if (map->old_buckets != NULL)
+        hashmap_rehash_step(map, map->rehash_budget);
+
+    entry = hashmap_find(map, key, h);
+    if (entry != NULL) {
+        entry->value = value;
+        return;
     }
-    return 0;
+
+    entry = malloc(sizeof(struct hashmap_entry));
+    entry->key = key;
+    entry->value = value;
+    list_node_init(&entry->node);
+    list_add_next(hashmap_bucket(map, h), &entry->node);
+    map->count++;
+    hashmap_grow(map);
 }
 
-int hashmap_contains(struct hashmap *map, void *key)
+void *hashmap_get(struct hashmap *map, void *key)
 {
-    struct list_node *bucket = hashmap_bucket(map, key);
-    struct list_node *p;
+    struct hashmap_entry *e;
 
-    for (p = bucket->next; p != bucket; p = p->next) {
-        struct hashmap_entry *e = container_of(p, struct hashmap_entry, node);
-        if (hashmap_key_equal(map, e->key, key))
-            return 1;
-    }
-    return 0;
+    if (map->old_buckets != NULL)
+        hashmap_rehash_step(map, map->rehash_budget);
+    e = hashmap_find(map, key, hashmap_hash(map, key));
+    return e ? e->value : NULL;
+}
+
+int hashmap_remove(struct hashmap *map, void *key)
+{
+    struct hashmap_entry *e;
+
+    if (map->old_buckets != NULL)
+        hashmap_rehash_step(map, map->rehash_budget);
+    e = hashmap_find(map, key, hashmap_hash(map, key));
+    if (e == NULL)
+        return 0;
+    list_remove(&e->node);
+    free(e);
+    map->count--;
+    return 1;
+}
+
+int hashmap_contains(struct hashmap *map, void *key)
+{
+    if (map->old_buckets != NULL)
+        hashmap_rehash_step(map, map->rehash_budget);
+    return hashmap_find(map, key, hashmap_hash(map, key)) != NULL;
 }
@@ -0,0 +1,72 @@
+#include "mpsc.h"
+#include "atomic.h"
+#include <stddef.h>
+
+#define mpsc_next(node)     (*(mpsc_node * volatile *)&(node)->next)
+
+void mpsc_init(mpsc_queue *q)
+{
+    q->stub.next = NULL;
+    q->head = &q->stub;
+    q->tail = &q->stub;
+}
+
+/*
+ * The swap orders producers, the store links the old head to us.
+ */
+void mpsc_push(mpsc_queue *q, mpsc_node *node)
+{
+    mpsc_node *prev;
+
+    node->next = NULL;
+    prev = atomic_xchg_ptr(node, (void **)&q->head);
+    mpsc_next(prev) = node;
+}
+
+mpsc_node *mpsc_pop(mpsc_queue *q)
+{
+    mpsc_node *tail = q->tail;
+    mpsc_node *next = mpsc_next(tail);
+
+    if (tail == &q->stub) {
+        if (next == NULL) {
+            return NULL;
+        }
+        q->tail = next;
+        tail = next;
+        next = mpsc_next(next);
+    }
+    if (next) {
+        q->tail = next;
+        return tail;
+    }
+
+    //tail is the last node we can see, a push may be half done behind it
+    if (tail != *(mpsc_node * volatile *)&q->head) {
+        return NULL;
+    }
+    //tail cannot leave while it is the only node, put the stub behind it
+    mpsc_push(q, &q->stub);
+    next = mpsc_next(tail);
+    if (next) {
+        q->tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+/*
+ * Pop up to budget nodes (0: until nothing is left to take) and hand each to fn.
+ * fn may push to the same queue, what it pushes can come back in this drain.
+ */
+uint32_t mpsc_drain(mpsc_queue *q, mpsc_fn fn, void *arg, uint32_t budget)
+{
+    mpsc_node *node;
+    uint32_t done = 0;
+
+    while ((budget == 0 || done < budget) && (node = mpsc_pop(q)) != NULL) {
+        fn(node, arg);
+        done++;
+    }
+    return done;
+}
@@ -0,0 +1,236 @@
+#include "ohashmap.h"
+#include "heap.h"
+#include <string.h>
+
+static inline uint32_t ohashmap_pow2(uint32_t x)
+{
+    if (x <= 1)
+        return 1;
+    return (uint32_t)1 << (32 - __builtin_clz(x - 1));
+}
+
+/*
+ * Keys are often small sequential integers or aligned pointers, so they go through a
+ * full avalanche mix before the low bits pick the slot. Strings are FNV-1a first.
+ * 0 marks an empty slot, so it is never returned.
+ */
+static inline uint32_t ohashmap_mix(uword_t h)
+{
+#if PLATFORM_BITS == 64
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+#else
+    h ^= h >> 16;
+    h *= 0x85ebca6bU;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35U;
+    h ^= h >> 16;
+#endif
+    return (uint32_t)h;
+}
+
+static uint32_t ohashmap_hash(struct ohashmap *map, void *key)
+{
+    uword_t h = 0;
+    uint32_t hash;
+
+    switch (map->key_type) {
+        case HASHMAP_KEY_STRING: {
+            unsigned char *s = key;
+            uint32_t f = 2166136261U;
+            while (*s)
+                f = (f ^ *s++) * 16777619U;
+            h = f;
+            break;
+        }
+        case HASHMAP_KEY_INT:
+        case HASHMAP_KEY_PTR:
+            h = (uword_t)key;
+            break;
+        default:
+            break;
+    }
+    hash = ohashmap_mix(h);
+    return hash ? hash : 1;
+}
+
+static inline int ohashmap_key_equal(struct ohashmap *map, void *a, void *b)
+{
+    if (map->key_type == HASHMAP_KEY_STRING)
+        return strcmp((char *)a, (char *)b) == 0;
+    return a == b;
+}
+
+static inline uint32_t ohashmap_dist(uint32_t hash, uint32_t slot, uint32_t mask)
+{
+    return (slot - hash) & mask;
+}
+
+/*
+ * Robin Hood insert: an entry which is closer to its home slot than we are to ours
+ * gives its slot up and moves on.
+ */
+static void ohashmap_place(struct ohashmap_entry *entries, uint32_t mask,
+                           uint32_t hash, void *key, void *value)
+{
+    struct ohashmap_entry tmp;
+    struct ohashmap_entry cur = { .hash = hash, .key = key, .value = value };
+    uint32_t i = hash & mask;
+    uint32_t dist = 0;
+
+    for (;;) {
+        struct ohashmap_entry *e = &entries[i];
+        if (e->hash == 0) {
+            *e = cur;
+            return;
+        }
+        uint32_t d = ohashmap_dist(e->hash, i, mask);
+        if (d < dist) {
+            tmp = *e;
+            *e = cur;
+            cur = tmp;
+            dist = d;
+        }
+        i = (i + 1) & mask;
+        dist++;
+    }
+}
+
+static int ohashmap_resize(struct ohashmap *map, uint32_t capacity)
+{
+    struct ohashmap_entry *old = map->entries;
+    struct ohashmap_entry *entries;
+    uint32_t old_capacity = map->capacity;
+
+    entries = heap_malloc(sizeof(struct ohashmap_entry) * capacity);
+    if (entries == NULL)
+        return -1;
+    memset(entries, 0, sizeof(struct ohashmap_entry) * capacity);
+
+    for (uint32_t i = 0; i < old_capacity; i++) {
+        if (old[i].hash)
+            ohashmap_place(entries, capacity - 1, old[i].hash, old[i].key, old[i].value);
+    }
+    map->entries = entries;
+    map->capacity = capacity;
+    if (old)
+        heap_free(old);
+    return 0;
+}
+
+static int ohashmap_find(struct ohashmap *map, uint32_t hash, void *key)
+{
+    uint32_t mask = map->capacity - 1;
+    uint32_t i = hash & mask;
+
+    for (uint32_t dist = 0; ; dist++) {
+        struct ohashmap_entry *e = &map->entries[i];
+        if (e->hash == 0 || ohashmap_dist(e->hash, i, mask) < dist)
+            return -1;
+        if (e->hash == hash && ohashmap_key_equal(map, e->key, key))
+            return (int)i;
+        i = (i + 1) & mask;
+    }
+}
+
+int ohashmap_init(struct ohashmap *map, size_t capacity, int key_type)
+{
+    if (capacity < OHASHMAP_MIN_CAPACITY)
+        capacity = OHASHMAP_MIN_CAPACITY;
+
+    *map = (struct ohashmap) {
+        .entries = NULL,
+        .capacity = 0,
+        .count = 0,
+        .min_capacity = ohashmap_pow2((uint32_t)capacity),
+        .grow_load = OHASHMAP_GROW_LOAD,
+        .shrink_load = OHASHMAP_SHRINK_LOAD,
+        .key_type = key_type,
+    };
+    return ohashmap_resize(map, map->min_capacity);
+}
+
+void ohashmap_destroy(struct ohashmap *map)
+{
+    if (map->entries)
+        heap_free(map->entries);
+    map->entries = NULL;
+    map->capacity = 0;
+    map->count = 0;
+}
+
+/*
+ * shrink_load is kept below half of grow_load, so a grow is not undone by the next remove.
+ */
+void ohashmap_set_load(struct ohashmap *map, uint8_t grow_load, uint8_t shrink_load)
+{
+    if (grow_load == 0 || grow_load > 95)
+        grow_load = 95;
+    if (shrink_load >= grow_load / 2)
+        shrink_load = grow_load / 4;
+    map->grow_load = grow_load;
+    map->shrink_load = shrink_load;
+}
+
+int ohashmap_put(struct ohashmap *map, void *key, void *value)
+{
+    uint32_t hash = ohashmap_hash(map, key);
+    int i = ohashmap_find(map, hash, key);
+
+    if (i >= 0) {
+        map->entries[i].value = value;
+        return 0;
+    }
+
+    if ((uint64_t)(map->count + 1) * 100 > (uint64_t)map->capacity * map->grow_load) {
+        //keep going while at least one slot stays empty, probes stop there
+        if (ohashmap_resize(map, map->capacity << 1) != 0 && map->count + 1 >= map->capacity)
+            return -1;
+    }
+
+    ohashmap_place(map->entries, map->capacity - 1, hash, key, value);
+    map->count++;
+    return 0;
+}
+
+void *ohashmap_get(struct ohashmap *map, void *key)
+{
+    int i = ohashmap_find(map, ohashmap_hash(map, key), key);
+    return (i >= 0) ? map->entries[i].value : NULL;
+}
+
+/*
+ * Backward shift delete, no tombstones: the entries behind move one slot closer home.
+ */
+int ohashmap_remove(struct ohashmap *map, void *key)
+{
+    uint32_t mask = map->capacity - 1;
+    int found = ohashmap_find(map, ohashmap_hash(map, key), key);
+    uint32_t i, j;
+
+    if (found < 0)
+        return 0;
+
+    i = (uint32_t)found;
+    j = (i + 1) & mask;
+    while (map->entries[j].hash && ohashmap_dist(map->entries[j].hash, j, mask) != 0) {
+        map->entries[i] = map->entries[j];
+        i = j;
+        j = (j + 1) & mask;
+    }
+    map->entries[i].hash = 0;
+    map->count--;
+
+    if (map->capacity > map->min_capacity &&
+        (uint64_t)map->count * 100 < (uint64_t)map->capacity * map->shrink_load)
+        ohashmap_resize(map, map->capacity >> 1);
+    return 1;
+}
+
+int ohashmap_contains(struct ohashmap *map, void *key)
+{
+    return ohashmap_find(map, ohashmap_hash(map, key), key) >= 0;
+}
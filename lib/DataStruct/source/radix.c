@@ -1,4 +1,5 @@
 #include "radix.h"
+#include "heap.h"
 
 
 __attribute__((always_inline)) inline uint8_t log2_clz64(uint64_t value)
@@ -14,6 +15,58 @@ static inline uint8_t radix_tree_height(uint64_t index)
     return msb / BIT_LEVEL + 1;
 }
 
+static inline uint32_t radix_tree_shift(const struct radix_tree_node *node)
+{
+    return (node->height - 1) * BIT_LEVEL;
+}
+
+//node->base holds the index bits above the node, with skipped levels they must match too
+static inline int radix_tree_covers(const struct radix_tree_node *node, size_t index)
+{
+    uint32_t bits = node->height * BIT_LEVEL;
+
+    if (bits >= sizeof(size_t) * 8) {
+        return 1;
+    }
+    return (index >> bits) == (node->base >> bits);
+}
+
+static inline size_t radix_tree_base(size_t index, uint8_t height)
+{
+    uint32_t bits = height * BIT_LEVEL;
+
+    if (bits >= sizeof(size_t) * 8) {
+        return 0;
+    }
+    return index & ~(((size_t)1 << bits) - 1);
+}
+
+
+/*
+ * Free nodes are shared by all trees and chained through parent. They come from
+ * heap_malloc() RADIX_NODE_BATCH at a time and are never given back.
+ */
+static struct radix_tree_node *NodePool;
+static unsigned int NodePoolFree;
+
+int radix_tree_preload(unsigned int nodes)
+{
+    struct radix_tree_node *chunk;
+
+    while (NodePoolFree < nodes) {
+        chunk = heap_malloc(sizeof(struct radix_tree_node) * RADIX_NODE_BATCH);
+        if (chunk == NULL) {
+            return -1;
+        }
+        for (int i = 0; i < RADIX_NODE_BATCH; i++) {
+            chunk[i].parent = NodePool;
+            NodePool = &chunk[i];
+        }
+        NodePoolFree += RADIX_NODE_BATCH;
+    }
+    return 0;
+}
+
 
 void radix_tree_init(struct radix_tree_root *root)
 {
@@ -28,6 +81,7 @@ void radix_tree_node_init(struct radix_tree_node *node, uint8_t height)
 {
     *node = (struct radix_tree_node) {
             .parent = NULL,
+            .base = 0,
             .count = 0,
             .height = height
     };
@@ -35,10 +89,14 @@ void radix_tree_node_init(struct radix_tree_node *node, uint8_t height)
 
 struct radix_tree_node *radix_tree_node_alloc(struct radix_tree_root *root, uint8_t height)
 {
-    struct radix_tree_node *node = heap_malloc(sizeof(struct radix_tree_node));
-    if (node == NULL) {
+    struct radix_tree_node *node;
+
+    if (NodePool == NULL && radix_tree_preload(1) != 0) {
         return NULL;
     }
+    node = NodePool;
+    NodePool = node->parent;
+    NodePoolFree--;
 
     root->count++;
     radix_tree_node_init(node, height);
@@ -48,49 +106,101 @@ struct radix_tree_node *radix_tree_node_alloc(struct radix_tree_root *root, uint
 
 void radix_tree_node_free(struct radix_tree_root *root, struct radix_tree_node *node)
 {
-    heap_free(node);
+    node->parent = NodePool;
+    NodePool = node;
+    NodePoolFree++;
     root->count--;
 }
 
+static inline void radix_tree_link(struct radix_tree_node *parent, uint8_t offset,
+                                   struct radix_tree_node *child)
+{
+    parent->slots[offset] = child;
+    child->parent = parent;
+    child->offset = offset;
+}
+
 int radix_tree_grow_height(struct radix_tree_root *root, uint8_t height)
 {
     while(root->height < height) {
-        (root->height)++;
-        struct radix_tree_node *new_node = radix_tree_node_alloc(root, root->height);
+        //the old root keeps index 0 .. its span, so it always lands in slot 0
+        struct radix_tree_node *new_node = radix_tree_node_alloc(root,
+                RADIX_TREE_SKIP ? height : root->height + 1);
         if (!new_node) {
             return -1;
         }
-        new_node->offset = 0;
+        for (int tag = 0; tag < RADIX_TREE_MAX_TAGS; tag++) {
+            if (root->rnode->tags[tag]) {
+                new_node->tags[tag] |= 1;
+            }
+        }
 
-        root->rnode->parent = new_node;
-        new_node->slots[0] = root->rnode;
+        radix_tree_link(new_node, 0, root->rnode);
         new_node->count++;
         root->rnode = new_node;
+        root->height = new_node->height;
     }
     return (int)root->height;
 }
 
+/*
+ * index and the chain under child part at some skipped level, put a node there
+ * which holds child and has room for index.
+ */
+static struct radix_tree_node *radix_tree_split(struct radix_tree_root *root,
+                                                struct radix_tree_node *child, size_t index)
+{
+    struct radix_tree_node *node;
+    uint8_t height = child->height + 1;
+    uint8_t offset;
+
+    while ((index ^ child->base) >> (height * BIT_LEVEL)) {
+        height++;
+    }
+
+    node = radix_tree_node_alloc(root, height);
+    if (!node) {
+        return NULL;
+    }
+    node->base = radix_tree_base(index, height);
+
+    radix_tree_link(child->parent, child->offset, node);
+    offset = (child->base >> radix_tree_shift(node)) & (SIZE_LEVEL - 1);
+    radix_tree_link(node, offset, child);
+    node->count = 1;
+    for (int tag = 0; tag < RADIX_TREE_MAX_TAGS; tag++) {
+        if (child->tags[tag]) {
+            node->tags[tag] |= (radix_tag_t)1 << offset;
+        }
+    }
+    return node;
+}
+
 int radix_tree_grow_node(struct radix_tree_root *root, size_t index, void *item)
 {
     struct radix_tree_node *node = root->rnode;
+    struct radix_tree_node *child;
     uint8_t offset;
-    uint8_t height = root->height;
-    uint8_t shift = (height - 1) * BIT_LEVEL;
-
-    while (height-- > 1) {
-        offset = (index >> shift) & (SIZE_LEVEL - 1);
-        if (!node->slots[offset]) {
-            node->slots[offset] = radix_tree_node_alloc(root, height);
-            if (!node->slots[offset]) {
+
+    while (node->height > 1) {
+        offset = (index >> radix_tree_shift(node)) & (SIZE_LEVEL - 1);
+        child = node->slots[offset];
+        if (!child) {
+            //with RADIX_TREE_SKIP a new key hangs its leaf straight off the first node it shares
+            child = radix_tree_node_alloc(root, RADIX_TREE_SKIP ? 1 : node->height - 1);
+            if (!child) {
                 return -1;
             }
-
+            child->base = radix_tree_base(index, child->height);
+            radix_tree_link(node, offset, child);
             node->count++;
-            ((struct radix_tree_node *)node->slots[offset])->offset = offset;
-            ((struct radix_tree_node *)node->slots[offset])->parent = node;
+        } else if (!radix_tree_covers(child, index)) {
+            child = radix_tree_split(root, child, index);
+            if (!child) {
+                return -1;
+            }
         }
-        node = (struct radix_tree_node *)node->slots[offset];
-        shift -= BIT_LEVEL;
+        node = child;
     }
 
     struct radix_tree_node *leaf = node;
@@ -105,10 +215,26 @@ int radix_tree_grow_node(struct radix_tree_root *root, size_t index, void *item)
 }
 
 
+/*
+ * The nodes are taken up front, so an insert never fails half way and leaves
+ * empty nodes behind. With RADIX_TREE_SKIP that is a new root, a split node and a
+ * leaf; without, one node per level the root grows by and one per level below it.
+ */
 int radix_tree_insert(struct radix_tree_root *root, size_t index, void *item)
 {
     struct radix_tree_node **node_ptr = &root->rnode;
-    int height = radix_tree_height(index);
+    unsigned int height = radix_tree_height(index);
+    unsigned int top = (height > root->height) ? height : root->height;
+    unsigned int need;
+
+    if (RADIX_TREE_SKIP) {
+        need = 3;
+    } else {
+        need = *node_ptr ? (top - root->height) + (top - 1) : height;
+    }
+    if (radix_tree_preload(need) != 0) {
+        return -1;
+    }
 
     //If no node, it can grow node no need to grow height!
     if (!*node_ptr) {
@@ -116,16 +242,12 @@ int radix_tree_insert(struct radix_tree_root *root, size_t index, void *item)
         if (!*node_ptr) {
             return -1;
         }
-        (*node_ptr)->parent = (struct radix_tree_node *)root;
         root->height = height;
         return radix_tree_grow_node(root, index, item);
     }
 
-    if (height > root->height) {
-        height = radix_tree_grow_height(root, height);
-        if (height < 0) {
-            return height;
-        }
+    if (height > root->height && radix_tree_grow_height(root, height) < 0) {
+        return -1;
     }
 
     return radix_tree_grow_node(root, index, item);
@@ -151,63 +273,70 @@ int radix_tree_insert(struct radix_tree_root *root, size_t index, void *item)
  * any remainder bits are correctly accounted for by adding one more level.
  *
  * Traversal principle:
- * - Initialize shift = (height - 1) * BIT_LEVEL
- * - At each level: offset = (index >> shift) & (SIZE_LEVEL - 1)
- * - Then shift -= BIT_LEVEL and descend to the next level
+ * - At each node: shift = (node->height - 1) * BIT_LEVEL
+ * - offset = (index >> shift) & (SIZE_LEVEL - 1), then descend to the child
  * - At the leaf level, slots hold actual items, and rightward traversal
  *   supports upper-bound queries.
  *
+ * With RADIX_TREE_SKIP a child may sit several levels below its parent, the
+ * single-child nodes in between are simply not there. Such a child only holds
+ * the index when the bits above it match node->base, sparse keys then cost one
+ * leaf each instead of a whole chain.
+ *
  * By adjusting BIT_LEVEL, the tree can seamlessly switch between binary
  * (BIT_LEVEL=1), quaternary (BIT_LEVEL=2), or higher branching structures,
  * achieving scalable and flexible expansion.
  */
 
-void *radix_tree_lookup(struct radix_tree_root *root, size_t index)
+/*
+ * Leaf holding index, NULL when the path to it does not exist.
+ */
+static struct radix_tree_node *radix_tree_leaf(struct radix_tree_root *root, size_t index)
 {
     struct radix_tree_node *node = root->rnode;
-    int height = (int)root->height;
-    uint32_t shift = (height - 1) * BIT_LEVEL;
-    uint8_t offset;
 
-    if (!node) {
+    if (!node || radix_tree_height(index) > root->height) {
         return NULL;
     }
 
-    while (height > 0) {
-        offset = (int)((index >> shift) & (SIZE_LEVEL - 1));
-        node = (struct radix_tree_node *)node->slots[offset];
-        if (!node) {
+    while (node->height > 1) {
+        node = (struct radix_tree_node *)node->slots[(index >> radix_tree_shift(node)) & (SIZE_LEVEL - 1)];
+        if (!node || !radix_tree_covers(node, index)) {
             return NULL;
         }
-        shift -= BIT_LEVEL;
-        height--;
     }
-
     return node;
 }
 
-
-void *radix_tree_node_left(struct radix_tree_node *node)
+void *radix_tree_lookup(struct radix_tree_root *root, size_t index)
 {
-    int offset;
-    int height;
+    struct radix_tree_node *node = radix_tree_leaf(root, index);
+
     if (!node) {
         return NULL;
     }
+    return node->slots[index & (SIZE_LEVEL - 1)];
+}
 
-    height = (int)node->height;
-    while (height > 0) {
-        if (!node) {
-            return NULL;
-        }
+
+void *radix_tree_node_left(struct radix_tree_node *node)
+{
+    int offset;
+
+    while (node) {
         offset = 0;
         while ((offset < SIZE_LEVEL) && (!node->slots[offset])) {
             offset++;
         }
+        if (offset == SIZE_LEVEL) {
+            return NULL;
+        }
+        if (node->height == 1) {
+            return node->slots[offset];
+        }
         node = (struct radix_tree_node *)node->slots[offset];
-        height--;
     }
-    return node;
+    return NULL;
 }
 
 
@@ -218,27 +347,21 @@ __attribute__((always_inline)) inline void *radix_tree_root_left(struct radix_tr
 
 void *radix_tree_delete(struct radix_tree_root *root, size_t index)
 {
-    struct radix_tree_node *node = root->rnode;
-    int height = (int)root->height;
-    uint8_t shift = (height - 1) * BIT_LEVEL;
+    struct radix_tree_node *node = radix_tree_leaf(root, index);
     uint8_t offset;
 
-    if (height < radix_tree_height(index)) return NULL;
-
-    while (height > 1) {
-        if (!node) return NULL;
-        offset = (index >> shift) & (SIZE_LEVEL - 1);
-        node = (struct radix_tree_node *)node->slots[offset];
-        shift -= BIT_LEVEL;
-        height--;
-    }
-
     if (!node) return NULL;
 
     offset = index & (SIZE_LEVEL - 1);
     void *item = node->slots[offset];
     if (!item) return NULL;
 
+    for (unsigned int tag = 0; tag < RADIX_TREE_MAX_TAGS; tag++) {
+        if (node->tags[tag] & ((radix_tag_t)1 << offset)) {
+            radix_tree_tag_clear(root, index, tag);
+        }
+    }
+
     node->slots[offset] = NULL;
     node->count--;
 
@@ -251,8 +374,20 @@ void *radix_tree_delete(struct radix_tree_root *root, size_t index)
         node = parent;
     }
 
-    if (root->rnode && root->rnode->count == 0) {
+#if RADIX_TREE_SKIP
+    //a node down to one child node is a level which can be skipped again
+    if (node != root->rnode && node->height > 1 && node->count == 1) {
+        offset = 0;
+        while (!node->slots[offset]) {
+            offset++;
+        }
+        radix_tree_link(node->parent, node->offset, node->slots[offset]);
         radix_tree_node_free(root, node);
+    }
+#endif
+
+    if (root->rnode && root->rnode->count == 0) {
+        radix_tree_node_free(root, root->rnode);
         root->rnode = NULL;
         root->height = 0;
     }
@@ -260,53 +395,190 @@ void *radix_tree_delete(struct radix_tree_root *root, size_t index)
     return item;
 }
 
-void *radix_tree_lookup_upper_bound(struct radix_tree_root *root, size_t index) {
-    uint8_t offset;
-    uint32_t shift = (root->height - 1) * BIT_LEVEL;
+//first item at index or after it
+void *radix_tree_lookup_upper_bound(struct radix_tree_root *root, size_t index)
+{
+    void *item;
 
-    struct radix_tree_node *node = root->rnode;
-    if (!node) return NULL;
+    if (radix_tree_gang_lookup(root, &item, NULL, index, 1) == 0) {
+        return NULL;
+    }
+    return item;
+}
 
-    while (node && node->height > 1) {
-        offset = (index >> shift) & (SIZE_LEVEL - 1);
-        if (node->slots[offset]) {
-            node = node->slots[offset];
-            shift -= BIT_LEVEL;
-        } else {
-            while(++offset < SIZE_LEVEL) {
-                if (node->slots[offset]) {
-                    return radix_tree_node_left(node->slots[offset]);
-                }
-            }
 
+/*
+ * The tag bit is set in every node on the path, so a clear bit in a parent
+ * means nothing under that slot is tagged and the whole subtree can be skipped.
+ */
+void *radix_tree_tag_set(struct radix_tree_root *root, size_t index, unsigned int tag)
+{
+    struct radix_tree_node *node = radix_tree_leaf(root, index);
+    uint8_t offset = index & (SIZE_LEVEL - 1);
+    void *item;
+
+    if (!node || tag >= RADIX_TREE_MAX_TAGS || !node->slots[offset]) {
+        return NULL;
+    }
+    item = node->slots[offset];
+
+    while (node) {
+        if (node->tags[tag] & ((radix_tag_t)1 << offset)) {
             break;
         }
+        node->tags[tag] |= (radix_tag_t)1 << offset;
+        offset = node->offset;
+        node = (node == root->rnode) ? NULL : node->parent;
     }
+    return item;
+}
 
-    // if in leaf layer
-    if (node && node->height == 1) {
-        offset = index & (SIZE_LEVEL - 1);
-        if (node->slots[offset]) {
-            return node->slots[offset];
-        }
+void *radix_tree_tag_clear(struct radix_tree_root *root, size_t index, unsigned int tag)
+{
+    struct radix_tree_node *node = radix_tree_leaf(root, index);
+    uint8_t offset = index & (SIZE_LEVEL - 1);
+    void *item;
 
-        while (++offset < SIZE_LEVEL) {
-            if (node->slots[offset]) {
-                return node->slots[offset];
-            }
-        }
+    if (!node || tag >= RADIX_TREE_MAX_TAGS || !node->slots[offset]) {
+        return NULL;
     }
+    item = node->slots[offset];
 
-    while (node && node->parent) {
-        uint8_t off = node->offset;
+    node->tags[tag] &= ~((radix_tag_t)1 << offset);
+    while (node->tags[tag] == 0 && node != root->rnode) {
+        offset = node->offset;
         node = node->parent;
-        while (++off < SIZE_LEVEL) {
-            if (node->slots[off]) {
-                return radix_tree_node_left(node->slots[off]);
+        node->tags[tag] &= ~((radix_tag_t)1 << offset);
+    }
+    return item;
+}
+
+int radix_tree_tag_get(struct radix_tree_root *root, size_t index, unsigned int tag)
+{
+    struct radix_tree_node *node = radix_tree_leaf(root, index);
+
+    if (!node || tag >= RADIX_TREE_MAX_TAGS) {
+        return 0;
+    }
+    return (node->tags[tag] >> (index & (SIZE_LEVEL - 1))) & 1;
+}
+
+int radix_tree_tagged(struct radix_tree_root *root, unsigned int tag)
+{
+    return root->rnode && (tag < RADIX_TREE_MAX_TAGS) && root->rnode->tags[tag];
+}
+
+static inline int radix_tree_slot_used(struct radix_tree_node *node, uint8_t offset, int tag)
+{
+    if (tag < 0) {
+        return node->slots[offset] != NULL;
+    }
+    return (node->tags[tag] >> offset) & 1;
+}
+
+/*
+ * Walk down to the first used slot at or after index, skipping empty (or untagged)
+ * subtrees on the way, then take every item of that leaf in one go.
+ * That is one descent per leaf instead of one per item.
+ */
+static unsigned int radix_tree_gang(struct radix_tree_root *root, void **results, size_t *indices,
+                                    size_t index, unsigned int max_items, int tag)
+{
+    struct radix_tree_node *node;
+    struct radix_tree_node *child;
+    unsigned int ret = 0;
+    uint32_t shift;
+    size_t max_index;
+    size_t base;
+    uint8_t offset;
+
+    if (!root->rnode || max_items == 0) {
+        return 0;
+    }
+    if (root->height * BIT_LEVEL >= sizeof(size_t) * 8) {
+        max_index = SIZE_MAX;
+    } else {
+        max_index = ((size_t)1 << (root->height * BIT_LEVEL)) - 1;
+    }
+
+    while (index <= max_index) {
+        node = root->rnode;
+
+        for (;;) {
+            shift = radix_tree_shift(node);
+            offset = (index >> shift) & (SIZE_LEVEL - 1);
+            while (offset < SIZE_LEVEL && !radix_tree_slot_used(node, offset, tag)) {
+                offset++;
             }
-        }
+            base = (index >> shift) & ~(size_t)(SIZE_LEVEL - 1);
 
+            if (offset == SIZE_LEVEL) {
+                //nothing left under this node, go on with the next one from the top
+                base += SIZE_LEVEL;
+                if (base == 0 || base > (max_index >> shift)) {
+                    return ret;
+                }
+                index = base << shift;
+                break;
+            }
+            if (offset != ((index >> shift) & (SIZE_LEVEL - 1))) {
+                index = (base | offset) << shift;
+            }
+
+            if (node->height == 1) {
+                for (; offset < SIZE_LEVEL; offset++) {
+                    if (!radix_tree_slot_used(node, offset, tag)) {
+                        continue;
+                    }
+                    results[ret] = node->slots[offset];
+                    if (indices) {
+                        indices[ret] = base | offset;
+                    }
+                    if (++ret == max_items) {
+                        return ret;
+                    }
+                }
+                index = (index | (SIZE_LEVEL - 1)) + 1;
+                if (index == 0) {
+                    return ret;
+                }
+                break;
+            }
+
+            child = (struct radix_tree_node *)node->slots[offset];
+            if (!radix_tree_covers(child, index)) {
+                //a skipped chain, either all of it is behind index or all of it is before
+                if (child->base < index) {
+                    base = (base | offset) + 1;
+                    if (base == 0 || base > (max_index >> shift)) {
+                        return ret;
+                    }
+                    index = base << shift;
+                    break;
+                }
+                index = child->base;
+            }
+            node = child;
+        }
     }
+    return ret;
+}
 
-    return NULL;
-}
\ No newline at end of file
+/*
+ * Up to max_items items with index >= first_index in ascending order, their indices
+ * go to indices unless it is NULL. Returns how many were found.
+ */
+unsigned int radix_tree_gang_lookup(struct radix_tree_root *root, void **results, size_t *indices,
+                                    size_t first_index, unsigned int max_items)
+{
+    return radix_tree_gang(root, results, indices, first_index, max_items, -1);
+}
+
+unsigned int radix_tree_gang_lookup_tag(struct radix_tree_root *root, void **results, size_t *indices,
+                                        size_t first_index, unsigned int max_items, unsigned int tag)
+{
+    if (tag >= RADIX_TREE_MAX_TAGS) {
+        return 0;
+    }
+    return radix_tree_gang(root, results, indices, first_index, max_items, (int)tag);
+}
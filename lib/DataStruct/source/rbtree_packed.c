@@ -0,0 +1,416 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2024 skaiui2
+
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *  https://github.com/skaiui2/SKRTOS_sparrow
+ */
+
+#include "rbtree_packed.h"
+
+
+static inline void rbp_set_parent(rbp_node *node, rbp_node *parent)
+{
+    node->rb_parent_color = (node->rb_parent_color & 1) | (uintptr_t)parent;
+}
+
+static inline void rbp_set_color(rbp_node *node, uintptr_t color)
+{
+    node->rb_parent_color = (node->rb_parent_color & ~(uintptr_t)1) | color;
+}
+
+static inline void rbp_link_node(rbp_node *node, rbp_node *parent,
+                                 rbp_node **rb_link)
+{
+    node->rb_parent_color = (uintptr_t)parent | RBP_RED;
+    node->rb_left = node->rb_right = NULL;
+
+    *rb_link = node;
+}
+
+static inline void rbp_change_child(rbp_node *old, rbp_node *new,
+                                    rbp_node *parent, rbp_root *root)
+{
+    if (parent != NULL) {
+        if (parent->rb_left == old) {
+            parent->rb_left = new;
+        } else {
+            parent->rb_right = new;
+        }
+    } else {
+        root->rb_node = new;
+    }
+}
+
+
+static void rbp_rotate_left(rbp_node *node, rbp_root *root)
+{
+    rbp_node *right = node->rb_right;
+    rbp_node *parent = rbp_parent(node);
+
+    node->rb_right = right->rb_left;
+    if (node->rb_right != NULL) {
+        rbp_set_parent(right->rb_left, node);
+    }
+    right->rb_left = node;
+
+    rbp_set_parent(right, parent);
+    rbp_change_child(node, right, parent, root);
+    rbp_set_parent(node, right);
+}
+
+static void rbp_rotate_right(rbp_node *node, rbp_root *root)
+{
+    rbp_node *left = node->rb_left;
+    rbp_node *parent = rbp_parent(node);
+
+    node->rb_left = left->rb_right;
+    if (node->rb_left != NULL) {
+        rbp_set_parent(left->rb_right, node);
+    }
+    left->rb_right = node;
+
+    rbp_set_parent(left, parent);
+    rbp_change_child(node, left, parent, root);
+    rbp_set_parent(node, left);
+}
+
+
+static void rbp_insert_color(rbp_node *node, rbp_root *root)
+{
+    rbp_node *parent, *grand_parent, *uncle, *tmp;
+
+    while ((parent = rbp_parent(node)) && rbp_color(parent) == RBP_RED) {
+        grand_parent = rbp_parent(parent);
+
+        if (parent == grand_parent->rb_left) {
+            uncle = grand_parent->rb_right;
+            if (uncle && rbp_color(uncle) == RBP_RED) {
+                rbp_set_color(uncle, RBP_BLACK);
+                rbp_set_color(parent, RBP_BLACK);
+                rbp_set_color(grand_parent, RBP_RED);
+                node = grand_parent;
+                continue;
+            }
+
+            if (parent->rb_right == node) {
+                rbp_rotate_left(parent, root);
+                tmp = parent;
+                parent = node;
+                node = tmp;
+            }
+
+            rbp_set_color(parent, RBP_BLACK);
+            rbp_set_color(grand_parent, RBP_RED);
+            rbp_rotate_right(grand_parent, root);
+        } else {
+            uncle = grand_parent->rb_left;
+            if (uncle && rbp_color(uncle) == RBP_RED) {
+                rbp_set_color(uncle, RBP_BLACK);
+                rbp_set_color(parent, RBP_BLACK);
+                rbp_set_color(grand_parent, RBP_RED);
+                node = grand_parent;
+                continue;
+            }
+
+            if (parent->rb_left == node) {
+                rbp_rotate_right(parent, root);
+                tmp = parent;
+                parent = node;
+                node = tmp;
+            }
+
+            rbp_set_color(parent, RBP_BLACK);
+            rbp_set_color(grand_parent, RBP_RED);
+            rbp_rotate_left(grand_parent, root);
+        }
+    }
+
+    rbp_set_color(root->rb_node, RBP_BLACK);
+}
+
+#define rbp_is_black(n)     (!(n) || rbp_color(n) == RBP_BLACK)
+
+static void rbp_erase_color(rbp_node *node, rbp_node *parent, rbp_root *root)
+{
+    rbp_node *other;
+
+    while (rbp_is_black(node) && node != root->rb_node) {
+        if (parent->rb_left == node) {
+            other = parent->rb_right;
+            if (rbp_color(other) == RBP_RED) {
+                rbp_set_color(other, RBP_BLACK);
+                rbp_set_color(parent, RBP_RED);
+                rbp_rotate_left(parent, root);
+                other = parent->rb_right;
+            }
+
+            if (rbp_is_black(other->rb_left) && rbp_is_black(other->rb_right)) {
+                rbp_set_color(other, RBP_RED);
+                node = parent;
+                parent = rbp_parent(node);
+            } else {
+                if (rbp_is_black(other->rb_right)) {
+                    rbp_set_color(other->rb_left, RBP_BLACK);
+                    rbp_set_color(other, RBP_RED);
+                    rbp_rotate_right(other, root);
+                    other = parent->rb_right;
+                }
+                rbp_set_color(other, rbp_color(parent));
+                rbp_set_color(parent, RBP_BLACK);
+                if (other->rb_right) {
+                    rbp_set_color(other->rb_right, RBP_BLACK);
+                }
+                rbp_rotate_left(parent, root);
+                node = root->rb_node;
+                break;
+            }
+        } else {
+            other = parent->rb_left;
+            if (rbp_color(other) == RBP_RED) {
+                rbp_set_color(other, RBP_BLACK);
+                rbp_set_color(parent, RBP_RED);
+                rbp_rotate_right(parent, root);
+                other = parent->rb_left;
+            }
+
+            if (rbp_is_black(other->rb_left) && rbp_is_black(other->rb_right)) {
+                rbp_set_color(other, RBP_RED);
+                node = parent;
+                parent = rbp_parent(node);
+            } else {
+                if (rbp_is_black(other->rb_left)) {
+                    rbp_set_color(other->rb_right, RBP_BLACK);
+                    rbp_set_color(other, RBP_RED);
+                    rbp_rotate_left(other, root);
+                    other = parent->rb_left;
+                }
+                rbp_set_color(other, rbp_color(parent));
+                rbp_set_color(parent, RBP_BLACK);
+                if (other->rb_left) {
+                    rbp_set_color(other->rb_left, RBP_BLACK);
+                }
+                rbp_rotate_right(parent, root);
+                node = root->rb_node;
+                break;
+            }
+        }
+    }
+
+    if (node) {
+        rbp_set_color(node, RBP_BLACK);
+    }
+}
+
+static void rbp_erase(rbp_node *node, rbp_root *root)
+{
+    rbp_node *child, *parent;
+    uintptr_t color;
+
+    if (!node->rb_left) {
+        child = node->rb_right;
+    } else if (!node->rb_right) {
+        child = node->rb_left;
+    } else {
+        rbp_node *left;
+        rbp_node *old = node;
+
+        node = node->rb_right;
+        while ((left = node->rb_left) != NULL) {
+            node = left;
+        }
+
+        child = node->rb_right;
+        parent = rbp_parent(node);
+        color = rbp_color(node);
+
+        if (child) {
+            rbp_set_parent(child, parent);
+        }
+        rbp_change_child(node, child, parent, root);
+
+        if (parent == old) {
+            parent = node;
+        }
+        node->rb_parent_color = old->rb_parent_color;
+        node->rb_right = old->rb_right;
+        node->rb_left = old->rb_left;
+
+        rbp_change_child(old, node, rbp_parent(old), root);
+
+        rbp_set_parent(old->rb_left, node);
+        if (old->rb_right) {
+            rbp_set_parent(old->rb_right, node);
+        }
+        goto color;
+    }
+
+    parent = rbp_parent(node);
+    color = rbp_color(node);
+
+    if (child) {
+        rbp_set_parent(child, parent);
+    }
+    rbp_change_child(node, child, parent, root);
+
+    color:
+    if (color == RBP_BLACK) {
+        rbp_erase_color(child, parent, root);
+    }
+}
+
+
+void rbp_root_init(rbp_root *root)
+{
+    *root = (rbp_root){
+        .rb_node = NULL,
+        .first_node = NULL,
+        .last_node = NULL,
+        .count = 0
+    };
+}
+
+void rbp_node_init(rbp_node *node)
+{
+    *node = (rbp_node){
+        .rb_parent_color = (uintptr_t)node,
+        .rb_left = NULL,
+        .rb_right = NULL,
+        .value = 0
+    };
+}
+
+/*
+ * Equal keys go behind the ones already in the tree.
+ */
+void rbp_insert_node(rbp_root *root, rbp_node *new_node)
+{
+    rbp_node **link = &(root->rb_node), *parent = NULL;
+
+    while (*link) {
+        parent = *link;
+        if (RBP_BEFORE(new_node->value, parent->value)) {
+            link = &(parent->rb_left);
+        } else {
+            link = &(parent->rb_right);
+        }
+    }
+
+    if (root->count != 0) {
+        if (!RBP_BEFORE(new_node->value, root->last_node->value)) {
+            root->last_node = new_node;
+        }
+        if (RBP_BEFORE(new_node->value, root->first_node->value)) {
+            root->first_node = new_node;
+        }
+    } else {
+        root->first_node = new_node;
+        root->last_node = new_node;
+    }
+
+    rbp_link_node(new_node, parent, link);
+    rbp_insert_color(new_node, root);
+    root->count++;
+}
+
+void rbp_remove_node(rbp_root *root, rbp_node *node)
+{
+    if (root->count > 1) {
+        if (node == root->last_node) {
+            root->last_node = rbp_prev(node);
+        }
+        if (node == root->first_node) {
+            root->first_node = rbp_next(node);
+        }
+    } else {
+        root->last_node = NULL;
+        root->first_node = NULL;
+    }
+    rbp_erase(node, root);
+    node->rb_parent_color = (uintptr_t)node;
+    root->count--;
+}
+
+
+rbp_node *rbp_first(rbp_root *root)
+{
+    return root->first_node;
+}
+
+rbp_node *rbp_last(rbp_root *root)
+{
+    return root->last_node;
+}
+
+rbp_node *rbp_next(rbp_node *node)
+{
+    rbp_node *parent;
+
+    if (node->rb_right) {
+        node = node->rb_right;
+        while (node->rb_left) {
+            node = node->rb_left;
+        }
+        return node;
+    }
+
+    while ((parent = rbp_parent(node)) && node == parent->rb_right) {
+        node = parent;
+    }
+    return parent;
+}
+
+rbp_node *rbp_prev(rbp_node *node)
+{
+    rbp_node *parent;
+
+    if (node->rb_left) {
+        node = node->rb_left;
+        while (node->rb_right) {
+            node = node->rb_right;
+        }
+        return node;
+    }
+
+    while ((parent = rbp_parent(node)) && node == parent->rb_left) {
+        node = parent;
+    }
+    return parent;
+}
+
+/*
+ * First node whose key comes strictly after key, NULL if there is none.
+ */
+rbp_node *rbp_first_greater(rbp_root *root, rbp_key_t key)
+{
+    rbp_node *node = root->rb_node;
+    rbp_node *candidate = NULL;
+
+    while (node != NULL) {
+        if (RBP_BEFORE(key, node->value)) {
+            candidate = node;
+            node = node->rb_left;
+        } else {
+            node = node->rb_right;
+        }
+    }
+
+    return candidate;
+}
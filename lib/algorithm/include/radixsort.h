@@ -0,0 +1,37 @@
+#ifndef RADIXSORT_H
+#define RADIXSORT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * LSD radix sort of unsigned keys, one byte per pass, stable.
+ * A byte which is the same in every key skips its scatter, so timestamps close
+ * together only pay for the low bytes. The counters take 256 size_t of stack.
+ * scratch holds n keys (and n values for _kv), the result always ends up in keys.
+ *
+ * Keys which wrap around (tick counters, see compare_before()) are unsigned only
+ * after subtracting the oldest one: keys[i] -= base, sort, add base back.
+ */
+void radix_sort_u16(uint16_t *keys, uint16_t *scratch, size_t n);
+void radix_sort_u32(uint32_t *keys, uint32_t *scratch, size_t n);
+void radix_sort_u64(uint64_t *keys, uint64_t *scratch, size_t n);
+
+//values[i] moves along with keys[i]
+void radix_sort_u16_kv(uint16_t *keys, void **values, uint16_t *key_scratch, void **value_scratch, size_t n);
+void radix_sort_u32_kv(uint32_t *keys, void **values, uint32_t *key_scratch, void **value_scratch, size_t n);
+void radix_sort_u64_kv(uint64_t *keys, void **values, uint64_t *key_scratch, void **value_scratch, size_t n);
+
+/*
+ * Merge of sorted runs: run i is src[bounds[i]] up to src[bounds[i + 1]], so bounds
+ * has runs + 1 entries. dst gets all bounds[runs] - bounds[0] keys, equal keys keep
+ * their run order. Returns -1 when there are more than MERGE_MAX_RUNS runs.
+ */
+#ifndef MERGE_MAX_RUNS
+#define MERGE_MAX_RUNS  16
+#endif
+
+int merge_runs_u32(uint32_t *dst, const uint32_t *src, const size_t *bounds, unsigned int runs);
+int merge_runs_u64(uint64_t *dst, const uint64_t *src, const size_t *bounds, unsigned int runs);
+
+#endif
@@ -0,0 +1,135 @@
+#ifndef SORT_H
+#define SORT_H
+
+#include <stddef.h>
+
+/*
+ * Introsort: quicksort with a median of three pivot, insertion sort under
+ * SORT_INSERTION elements and heapsort once the partitions go 2*log2(n) deep.
+ * O(n log n) worst case. The smaller partition is sorted by recursion and the
+ * larger one by the loop, so the stack stays under log2(n) frames.
+ * Not stable.
+ *
+ * sort() works on any element size like qsort(). SORT_DEFINE() emits a typed copy
+ * where less() and the swaps are inlined:
+ *
+ *   #define timer_less(a, b)   ((a).expire < (b).expire)
+ *   SORT_DEFINE(timer_sort, struct timer, timer_less)
+ *   timer_sort(timers, n);
+ */
+
+#ifndef SORT_INSERTION
+#define SORT_INSERTION  16
+#endif
+
+typedef int (*sort_cmp)(const void *a, const void *b);
+
+void sort(void *base, size_t n, size_t size, sort_cmp cmp);
+
+static inline unsigned int sort_depth(size_t n)
+{
+    unsigned int depth = 0;
+    while (n >>= 1)
+        depth++;
+    return depth * 2;
+}
+
+
+#define SORT_DEFINE(name, type, less)                                                   \
+                                                                                        \
+static inline void name##_swap(type *a, type *b)                                        \
+{                                                                                       \
+    type tmp = *a;                                                                      \
+    *a = *b;                                                                            \
+    *b = tmp;                                                                           \
+}                                                                                       \
+                                                                                        \
+static inline void name##_insertion(type *arr, size_t n)                                \
+{                                                                                       \
+    for (size_t i = 1; i < n; i++) {                                                    \
+        type cur = arr[i];                                                              \
+        size_t j = i;                                                                   \
+        for (; j > 0 && less(cur, arr[j - 1]); j--)                                     \
+            arr[j] = arr[j - 1];                                                        \
+        arr[j] = cur;                                                                   \
+    }                                                                                   \
+}                                                                                       \
+                                                                                        \
+static inline void name##_sift(type *arr, size_t root, size_t n)                        \
+{                                                                                       \
+    size_t child;                                                                       \
+                                                                                        \
+    while ((child = 2 * root + 1) < n) {                                                \
+        if (child + 1 < n && less(arr[child], arr[child + 1]))                          \
+            child++;                                                                    \
+        if (!less(arr[root], arr[child]))                                               \
+            return;                                                                     \
+        name##_swap(&arr[root], &arr[child]);                                           \
+        root = child;                                                                   \
+    }                                                                                   \
+}                                                                                       \
+                                                                                        \
+static inline void name##_heap(type *arr, size_t n)                                     \
+{                                                                                       \
+    for (size_t i = n / 2; i-- > 0; )                                                   \
+        name##_sift(arr, i, n);                                                         \
+    while (n > 1) {                                                                     \
+        name##_swap(&arr[0], &arr[--n]);                                                \
+        name##_sift(arr, 0, n);                                                         \
+    }                                                                                   \
+}                                                                                       \
+                                                                                        \
+/* the sorted samples go to 0, n - 2 (the pivot) and n - 1 to bound the scans */       \
+static inline size_t name##_partition(type *arr, size_t n)                              \
+{                                                                                       \
+    size_t a = n / 4, m = n / 2, b = n - n / 4, i = 0, j = n - 2;                       \
+                                                                                        \
+    if (less(arr[m], arr[a]))                                                           \
+        name##_swap(&arr[m], &arr[a]);                                                  \
+    if (less(arr[b], arr[m])) {                                                         \
+        name##_swap(&arr[b], &arr[m]);                                                  \
+        if (less(arr[m], arr[a]))                                                       \
+            name##_swap(&arr[m], &arr[a]);                                              \
+    }                                                                                   \
+    name##_swap(&arr[a], &arr[0]);                                                      \
+    name##_swap(&arr[b], &arr[n - 1]);                                                  \
+    name##_swap(&arr[m], &arr[n - 2]);                                                  \
+    for (;;) {                                                                          \
+        while (less(arr[++i], arr[n - 2]))                                              \
+            ;                                                                           \
+        while (less(arr[n - 2], arr[--j]))                                              \
+            ;                                                                           \
+        if (i >= j)                                                                     \
+            break;                                                                      \
+        name##_swap(&arr[i], &arr[j]);                                                  \
+    }                                                                                   \
+    name##_swap(&arr[i], &arr[n - 2]);                                                  \
+    return i;                                                                           \
+}                                                                                       \
+                                                                                        \
+static inline void name##_intro(type *arr, size_t n, unsigned int depth)                \
+{                                                                                       \
+    while (n > SORT_INSERTION) {                                                        \
+        if (depth-- == 0) {                                                             \
+            name##_heap(arr, n);                                                        \
+            return;                                                                     \
+        }                                                                               \
+        size_t p = name##_partition(arr, n);                                            \
+        if (p < n - p - 1) {                                                            \
+            name##_intro(arr, p, depth);                                                \
+            arr += p + 1;                                                               \
+            n -= p + 1;                                                                 \
+        } else {                                                                        \
+            name##_intro(arr + p + 1, n - p - 1, depth);                                \
+            n = p;                                                                      \
+        }                                                                               \
+    }                                                                                   \
+    name##_insertion(arr, n);                                                           \
+}                                                                                       \
+                                                                                        \
+static inline void name(type *arr, size_t n)                                            \
+{                                                                                       \
+    name##_intro(arr, n, sort_depth(n));                                                \
+}
+
+#endif
@@ -0,0 +1,123 @@
+#include "radixsort.h"
+#include <string.h>
+
+/*
+ * One pass per byte: count, turn the counts into offsets, scatter.
+ * The scatter has no compares, only the pass skip depends on the data.
+ */
+#define RADIX_SORT(bits, key_t)                                                                 \
+void radix_sort_u##bits##_kv(key_t *keys, void **values, key_t *key_scratch,                    \
+                             void **value_scratch, size_t n)                                    \
+{                                                                                               \
+    size_t count[256];                                                                          \
+    key_t *src = keys, *dst = key_scratch, *tmp;                                                \
+    void **vsrc = values, **vdst = value_scratch, **vtmp;                                       \
+    size_t i, sum, c;                                                                           \
+                                                                                                \
+    if (n < 2) {                                                                                \
+        return;                                                                                 \
+    }                                                                                           \
+    for (unsigned int shift = 0; shift < bits; shift += 8) {                                    \
+        memset(count, 0, sizeof(count));                                                        \
+        for (i = 0; i < n; i++) {                                                               \
+            count[(src[i] >> shift) & 0xff]++;                                                  \
+        }                                                                                       \
+        if (count[(src[0] >> shift) & 0xff] == n) {                                             \
+            continue;                                                                           \
+        }                                                                                       \
+        for (i = 0, sum = 0; i < 256; i++) {                                                    \
+            c = count[i];                                                                       \
+            count[i] = sum;                                                                     \
+            sum += c;                                                                           \
+        }                                                                                       \
+        if (vsrc) {                                                                             \
+            for (i = 0; i < n; i++) {                                                           \
+                size_t at = count[(src[i] >> shift) & 0xff]++;                                  \
+                dst[at] = src[i];                                                               \
+                vdst[at] = vsrc[i];                                                             \
+            }                                                                                   \
+        } else {                                                                                \
+            for (i = 0; i < n; i++) {                                                           \
+                dst[count[(src[i] >> shift) & 0xff]++] = src[i];                                \
+            }                                                                                   \
+        }                                                                                       \
+        tmp = src;                                                                              \
+        src = dst;                                                                              \
+        dst = tmp;                                                                              \
+        vtmp = vsrc;                                                                            \
+        vsrc = vdst;                                                                            \
+        vdst = vtmp;                                                                            \
+    }                                                                                           \
+    if (src != keys) {                                                                          \
+        memcpy(keys, src, n * sizeof(key_t));                                                   \
+        if (values) {                                                                           \
+            memcpy(values, vsrc, n * sizeof(void *));                                           \
+        }                                                                                       \
+    }                                                                                           \
+}                                                                                               \
+                                                                                                \
+void radix_sort_u##bits(key_t *keys, key_t *scratch, size_t n)                                  \
+{                                                                                               \
+    radix_sort_u##bits##_kv(keys, NULL, scratch, NULL, n);                                      \
+}
+
+RADIX_SORT(16, uint16_t)
+RADIX_SORT(32, uint32_t)
+RADIX_SORT(64, uint64_t)
+
+
+/*
+ * Binary heap of run numbers keyed by each run's next key, ties go to the
+ * lower run so the merge is stable.
+ */
+#define MERGE_RUNS(bits, key_t)                                                                 \
+int merge_runs_u##bits(key_t *dst, const key_t *src, const size_t *bounds, unsigned int runs)   \
+{                                                                                               \
+    size_t pos[MERGE_MAX_RUNS];                                                                 \
+    uint8_t heap[MERGE_MAX_RUNS];                                                               \
+    unsigned int size = 0, i, child, r;                                                         \
+                                                                                                \
+    if (runs > MERGE_MAX_RUNS) {                                                                \
+        return -1;                                                                              \
+    }                                                                                           \
+    for (r = 0; r < runs; r++) {                                                                \
+        pos[r] = bounds[r];                                                                     \
+        if (pos[r] == bounds[r + 1]) {                                                          \
+            continue;                                                                           \
+        }                                                                                       \
+        for (i = size++; i > 0 && src[pos[r]] < src[pos[heap[(i - 1) / 2]]]; i = (i - 1) / 2) { \
+            heap[i] = heap[(i - 1) / 2];                                                        \
+        }                                                                                       \
+        heap[i] = r;                                                                            \
+    }                                                                                           \
+                                                                                                \
+    while (size > 1) {                                                                          \
+        r = heap[0];                                                                            \
+        *dst++ = src[pos[r]++];                                                                 \
+        if (pos[r] == bounds[r + 1]) {                                                          \
+            r = heap[--size];                                                                   \
+        }                                                                                       \
+        for (i = 0; (child = 2 * i + 1) < size; i = child) {                                    \
+            if (child + 1 < size &&                                                             \
+                (src[pos[heap[child + 1]]] < src[pos[heap[child]]] ||                           \
+                 (src[pos[heap[child + 1]]] == src[pos[heap[child]]] &&                         \
+                  heap[child + 1] < heap[child]))) {                                            \
+                child++;                                                                        \
+            }                                                                                   \
+            if (src[pos[r]] < src[pos[heap[child]]] ||                                          \
+                (src[pos[r]] == src[pos[heap[child]]] && r < heap[child])) {                    \
+                break;                                                                          \
+            }                                                                                   \
+            heap[i] = heap[child];                                                              \
+        }                                                                                       \
+        heap[i] = r;                                                                            \
+    }                                                                                           \
+    if (size) {                                                                                 \
+        r = heap[0];                                                                            \
+        memcpy(dst, &src[pos[r]], (bounds[r + 1] - pos[r]) * sizeof(key_t));                    \
+    }                                                                                           \
+    return 0;                                                                                   \
+}
+
+MERGE_RUNS(32, uint32_t)
+MERGE_RUNS(64, uint64_t)
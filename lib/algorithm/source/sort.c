@@ -0,0 +1,121 @@
+#include "sort.h"
+#include <stdint.h>
+
+#define ELEM(i)     (base + (i) * size)
+
+static inline void sort_swap(char *a, char *b, size_t size)
+{
+    if (((uintptr_t)a | (uintptr_t)b | size) % sizeof(size_t) == 0) {
+        size_t *x = (size_t *)a, *y = (size_t *)b;
+        for (size /= sizeof(size_t); size; size--, x++, y++) {
+            size_t tmp = *x;
+            *x = *y;
+            *y = tmp;
+        }
+        return;
+    }
+    for (; size; size--, a++, b++) {
+        char tmp = *a;
+        *a = *b;
+        *b = tmp;
+    }
+}
+
+static void sort_insertion(char *base, size_t n, size_t size, sort_cmp cmp)
+{
+    for (size_t i = 1; i < n; i++) {
+        for (size_t j = i; j > 0 && cmp(ELEM(j), ELEM(j - 1)) < 0; j--) {
+            sort_swap(ELEM(j), ELEM(j - 1), size);
+        }
+    }
+}
+
+static void sort_sift(char *base, size_t root, size_t n, size_t size, sort_cmp cmp)
+{
+    size_t child;
+
+    while ((child = 2 * root + 1) < n) {
+        if (child + 1 < n && cmp(ELEM(child), ELEM(child + 1)) < 0) {
+            child++;
+        }
+        if (cmp(ELEM(root), ELEM(child)) >= 0) {
+            return;
+        }
+        sort_swap(ELEM(root), ELEM(child), size);
+        root = child;
+    }
+}
+
+static void sort_heap(char *base, size_t n, size_t size, sort_cmp cmp)
+{
+    for (size_t i = n / 2; i-- > 0; ) {
+        sort_sift(base, i, n, size, cmp);
+    }
+    while (n > 1) {
+        sort_swap(ELEM(0), ELEM(--n), size);
+        sort_sift(base, 0, n, size, cmp);
+    }
+}
+
+/*
+ * The pivot is the median of the elements at a quarter, half and three quarters,
+ * sampling inside the range keeps organ pipe input from picking an extreme.
+ * The three are sorted and moved to 0, n - 2 (the pivot) and n - 1, so the
+ * first and last element bound both scans and no index checks are needed.
+ */
+static size_t sort_partition(char *base, size_t n, size_t size, sort_cmp cmp)
+{
+    size_t a = n / 4, m = n / 2, b = n - n / 4, i = 0, j = n - 2;
+    char *pivot = ELEM(n - 2);
+
+    if (cmp(ELEM(m), ELEM(a)) < 0) {
+        sort_swap(ELEM(m), ELEM(a), size);
+    }
+    if (cmp(ELEM(b), ELEM(m)) < 0) {
+        sort_swap(ELEM(b), ELEM(m), size);
+        if (cmp(ELEM(m), ELEM(a)) < 0) {
+            sort_swap(ELEM(m), ELEM(a), size);
+        }
+    }
+    sort_swap(ELEM(a), ELEM(0), size);
+    sort_swap(ELEM(b), ELEM(n - 1), size);
+    sort_swap(ELEM(m), pivot, size);
+
+    for (;;) {
+        while (cmp(ELEM(++i), pivot) < 0) { }
+        while (cmp(pivot, ELEM(--j)) < 0) { }
+        if (i >= j) {
+            break;
+        }
+        sort_swap(ELEM(i), ELEM(j), size);
+    }
+    sort_swap(ELEM(i), pivot, size);
+    return i;
+}
+
+static void sort_intro(char *base, size_t n, size_t size, sort_cmp cmp, unsigned int depth)
+{
+    size_t p;
+
+    while (n > SORT_INSERTION) {
+        if (depth-- == 0) {
+            sort_heap(base, n, size, cmp);
+            return;
+        }
+        p = sort_partition(base, n, size, cmp);
+        if (p < n - p - 1) {
+            sort_intro(base, p, size, cmp, depth);
+            base = ELEM(p + 1);
+            n -= p + 1;
+        } else {
+            sort_intro(ELEM(p + 1), n - p - 1, size, cmp, depth);
+            n = p;
+        }
+    }
+    sort_insertion(base, n, size, cmp);
+}
+
+void sort(void *base, size_t n, size_t size, sort_cmp cmp)
+{
+    sort_intro(base, n, size, cmp, sort_depth(n));
+}